@@ -6,9 +6,32 @@
 #include "KeyValue.h"
 #include <cstring>
 #include <cstdlib>
+#include <cstdio>
+#include <cstdint>
+#include <cerrno>
+#include <cctype>
+#include <new>
 
 // For min and max
 #include <algorithm>
+#include <unordered_set>
+#include <thread>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <climits>
+#endif
+
+#if KEYVALUE_STATS
+#include <chrono>
+
+#define STATS_TIMER_START(timer) std::chrono::steady_clock::time_point timer = std::chrono::steady_clock::now()
+#define STATS_TIMER_END(timer, seconds) seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - timer).count()
+#else
+#define STATS_TIMER_START(timer)
+#define STATS_TIMER_END(timer, seconds)
+#endif
 
 #define ALLOW_QUOTELESS_STRINGS 1
 
@@ -18,6 +41,13 @@
 
 #define ESCAPE_CHAR '\\'
 
+#define CONDITIONAL_BEGIN '['
+#define CONDITIONAL_END ']'
+
+// Lazy parsing skims blocks this many bytes at a time. Its copy of the document gets padded so that it can read past the end
+#define SKIP_CHUNK_SIZE 64
+#define SKIP_PADDING SKIP_CHUNK_SIZE
+
 #define SINGLE_LINE_COMMENT "//"
 
 #define TAB_STYLE "    "
@@ -25,8 +55,55 @@
 #define POOL_STARTING_LENGTH 0
 #define POOL_INCREMENT_LENGTH 4
 
+#define PATH_SEPARATOR '/'
+
+#define INCLUDE_DIRECTIVE "#include"
+#define BASE_DIRECTIVE "#base"
+
+// Nodes with fewer kids than this are quicker to scan than to binary search, so they don't get sorted
+#define SORTED_KEYS_MIN_CHILDREN 8
+
+// Dedup tables start out with room for about one string per this many bytes of string buffer
+#define DEDUP_BYTES_PER_STRING 16
+#define DEDUP_MIN_TABLE_SIZE 256
+
+// Merges, patches and diffs pack their strings into blocks this big
+#define PACKED_BLOCK_SIZE 4096
+
+// Nodes with up to half this many children can be indexed by key without allocating
+#define KEY_INDEX_INLINE_SIZE 32
+
+// Patch operations. See Key Value Merging in the header
+#define PATCH_ADD '+'
+#define PATCH_REMOVE '-'
+#define PATCH_REPLACE '='
+#define PATCH_EDIT '~'
+
+// Transcoding never hands the writer less than this at once, however small the buffer it was asked for
+#define JSON_MIN_BUFFER_SIZE 64
+// Duplicate key tables start out this big, per depth
+#define JSON_MIN_KEY_TABLE_SIZE 16
+
+// Snapshot chains longer than this get flattened on commit, no matter how small their edits were
+#define SNAPSHOT_MAX_CHAIN_LENGTH 64
+
+// How many readers can be in the middle of KeyValueStore::Snapshot at once. Any more spin until a slot frees up, which
+// only takes as long as copying a shared_ptr
+#define STORE_READER_SLOTS 64
+
+// Batches smaller than this many roots per thread don't get any more threads
+#define EXTRACT_ROWS_PER_THREAD 1024
+
+// Room for this many inotify events per read. More just take another read
+#define RELOAD_EVENT_BUFFER_COUNT 64
+
+// How many queued nodes ahead breadth first Visit prefetches the strings of the first child of. The first children of nodes
+// twice as far along get prefetched themselves
+#define VISIT_PREFETCH_DISTANCE 8
+
 #ifdef _WIN32
 #define strcasecmp _stricmp
+#define strncasecmp _strnicmp
 #endif
 
 //////////////////////
@@ -137,789 +214,5536 @@ kvString_t ReadQuotelessString(const char*& str)
 
 #endif // ALLOW_QUOTELESS_STRINGS
 
-
-////////////////////
-// Key Value Pool //
-////////////////////
-
-
-template<typename T>
-KeyValuePool<T>::KeyValuePool()
+// Reads a [$CONDITIONAL] tag. str must be on the [, and ends up after the ]
+KeyValueErrorCode ReadConditional(const char*& str, kvString_t& inset)
 {
+	str++;
+	inset.string = const_cast<char*>(str);
 
-	position = 0;
+	for (; *str != CONDITIONAL_END; str++)
+	{
+		if (*str == '\0' || *str == '\n')
+			return KeyValueErrorCode::INCOMPLETE_CONDITIONAL;
+	}
 
-	firstPool = new PoolChunk(POOL_STARTING_LENGTH);
+	inset.length = str - inset.string;
+	str++;
 
-	currentPool = firstPool;
+	return KeyValueErrorCode::NONE;
 }
 
-template<typename T>
-KeyValuePool<T>::~KeyValuePool()
+static bool HasSymbol(const std::vector<std::string>& symbols, const char* name, size_t length)
 {
-	if (firstPool)
-		Drain();
+	for (const std::string& symbol : symbols)
+	{
+		if (symbol.length() == length && strncasecmp(symbol.c_str(), name, length) == 0)
+			return true;
+	}
+	return false;
 }
 
-template<typename T>
-void KeyValuePool<T>::Drain()
+// Conditionals are terms like $WIN32 or !$X360, joined by && and ||. && goes first, like it does in C
+static bool EvaluateConditional(kvString_t conditional, const std::vector<std::string>& symbols)
 {
-	PoolChunk* nextPool = firstPool;
-	PoolChunk* old;
+	const char* str = conditional.string;
+	const char* end = str + conditional.length;
 
-	while (nextPool)
+	bool result = false;
+	bool term = true;
+	while (str < end)
 	{
-		free(nextPool->pool);
-		old = nextPool;
-		nextPool = nextPool->next;
-		delete old;
-	}
+		for (; str < end && IsWhitespace(*str); str++);
 
-	firstPool = nullptr;
-	currentPool = nullptr;
-}
+		bool negate = str < end && *str == '!';
+		if (negate)
+			str++;
+		if (str < end && *str == '$')
+			str++;
 
-template<typename T>
-T* KeyValuePool<T>::Create()
-{
-	if (!IsFull())
-	{
-	returnKV:
-		T* kv = &currentPool->pool[position];
-		position++;
-		return kv;
-	}
+		const char* name = str;
+		for (; str < end && !IsWhitespace(*str) && *str != '&' && *str != '|'; str++);
 
-	// If the pool is full, we have to allocated a new one, and try again
-	position = 0;
-	size_t newLength = currentPool->length + POOL_INCREMENT_LENGTH;
+		if (str > name)
+			term = term && (HasSymbol(symbols, name, str - name) != negate);
 
-	currentPool = new PoolChunk(newLength, currentPool);
+		for (; str < end && IsWhitespace(*str); str++);
 
-	goto returnKV;
+		if (end - str >= 2 && str[0] == '|' && str[1] == '|')
+		{
+			result = result || term;
+			term = true;
+			str += 2;
+		}
+		else if (end - str >= 2 && str[0] == '&' && str[1] == '&')
+			str += 2;
+		else if (str < end)
+			str++; // Junk. Step over it so that we don't get stuck
+	}
+
+	return result || term;
 }
 
-template<typename T>
-KeyValuePool<T>::PoolChunk::PoolChunk(size_t length)
-{
-	next = nullptr;
+// Bit tricks for looking at 8 bytes at once. Only used on little endian machines, where the first byte is the lowest
+#define BROADCAST_BYTE(c) (0x0101010101010101ull * (unsigned char)(c))
 
-	pool = (T*)malloc(sizeof(T) * length);
-	this->length = length;
+// The high bit of every byte in word that's equal to c
+static inline uint64_t MatchBytes(uint64_t word, uint64_t c)
+{
+	uint64_t t = word ^ c;
+	return ~(((t & 0x7F7F7F7F7F7F7F7Full) + 0x7F7F7F7F7F7F7F7Full) | t) & 0x8080808080808080ull;
 }
 
-template<typename T>
-KeyValuePool<T>::PoolChunk::PoolChunk(size_t length, PoolChunk* last) : PoolChunk(length)
+// Squashes the high bits from MatchBytes into the low 8 bits
+static inline uint64_t PackBytes(uint64_t matches)
 {
-	last->next = this;
+	return ((matches >> 7) * 0x0102040810204080ull) >> 56;
 }
 
+// Bit i ends up set if an odd number of bits at or below i were set
+static inline uint64_t PrefixXor(uint64_t bits)
+{
+	bits ^= bits << 1;
+	bits ^= bits << 2;
+	bits ^= bits << 4;
+	bits ^= bits << 8;
+	bits ^= bits << 16;
+	bits ^= bits << 32;
+	return bits;
+}
 
-////////////////////
-// Key Value Root //
-////////////////////
+static inline size_t PopCount(uint64_t bits)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	return (size_t)__builtin_popcountll(bits);
+#else
+	bits = bits - ((bits >> 1) & 0x5555555555555555ull);
+	bits = (bits & 0x3333333333333333ull) + ((bits >> 2) & 0x3333333333333333ull);
+	bits = (bits + (bits >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+	return (size_t)((bits * 0x0101010101010101ull) >> 56);
+#endif
+}
 
-KeyValueRoot::KeyValueRoot(const char* str) : KeyValueRoot()
+static inline size_t CountTrailingZeros(uint64_t bits)
 {
-	Parse(str);
+#if defined(__GNUC__) || defined(__clang__)
+	return (size_t)__builtin_ctzll(bits);
+#else
+	size_t count = 0;
+	for (; !(bits & 1); bits >>= 1)
+		count++;
+	return count;
+#endif
 }
 
-KeyValueRoot::KeyValueRoot()
+// Just a hint, so it never faults. Bad and null addresses are fine
+static inline void Prefetch(const void* address)
 {
-	bufferSize = 0;
-	solidified = false;
-	rootNode = this;
+#if defined(__GNUC__) || defined(__clang__)
+	__builtin_prefetch(address);
+#else
+	(void)address;
+#endif
+}
 
-	key = { nullptr, 0 };
+enum class SkipChunkResult
+{
+	CONTINUE,
+	FOUND_END,
+	// Something in the chunk needs to be looked at a byte at a time
+	FALLBACK,
+};
+
+// Skims SKIP_CHUNK_SIZE bytes at once by turning them into bitmasks, so that short strings don't cost a branch each.
+// Comments, escapes and the end of the string are rare enough to leave to the byte at a time loop
+template<bool useEscapeSequences>
+static SkipChunkResult SkipChunk(const char*& str, size_t& depth, bool& inString)
+{
+	uint64_t quotes = 0, opens = 0, closes = 0, slashes = 0, special = 0;
+	for (size_t i = 0; i < SKIP_CHUNK_SIZE / 8; i++)
+	{
+		uint64_t word;
+		memcpy(&word, str + i * 8, 8);
 
-	isNode = true;
-	data.node = { nullptr, nullptr, 0 };
+		quotes |= PackBytes(MatchBytes(word, BROADCAST_BYTE(STRING_CONTAINER))) << (i * 8);
+		opens |= PackBytes(MatchBytes(word, BROADCAST_BYTE(BLOCK_BEGIN))) << (i * 8);
+		closes |= PackBytes(MatchBytes(word, BROADCAST_BYTE(BLOCK_END))) << (i * 8);
+		slashes |= PackBytes(MatchBytes(word, BROADCAST_BYTE(SINGLE_LINE_COMMENT[0]))) << (i * 8);
 
-	stringBuffer = nullptr;
+		special |= MatchBytes(word, 0);
+		if (useEscapeSequences)
+			special |= MatchBytes(word, BROADCAST_BYTE(ESCAPE_CHAR));
+	}
 
-}
+	if (special)
+		return SkipChunkResult::FALLBACK;
 
-KeyValueRoot::~KeyValueRoot()
-{
-	if (bufferSize > 0)
-		free(stringBuffer);
+	// Everything from an opening quote up to, but not including, its closing quote
+	uint64_t inside = PrefixXor(quotes) ^ (inString ? ~0ull : 0ull);
 
+	// A comment could start here, or run over into the next chunk
+	slashes &= ~inside;
+	if (slashes & ((slashes >> 1) | (1ull << 63)))
+		return SkipChunkResult::FALLBACK;
 
-	// writePoolStrings are allocated on creation of a node.. We have to clean all of these up manually :(
+	opens &= ~inside;
+	closes &= ~inside;
 
-	for (KeyValuePool<char*>::PoolChunk* current = writePoolStrings.firstPool; current != writePoolStrings.currentPool; current = current->next)
+	// If there aren't enough closes to get us out, the order they come in doesn't matter
+	if (PopCount(closes) >= depth)
 	{
-		for (size_t i = 0; i < current->length; i++)
+		for (uint64_t braces = opens | closes; braces; braces &= braces - 1)
 		{
-			delete[] current->pool[i];
+			uint64_t bit = braces & (~braces + 1);
+			if (opens & bit)
+				depth++;
+			else if (--depth == 0)
+			{
+				str += CountTrailingZeros(bit) + 1;
+				return SkipChunkResult::FOUND_END;
+			}
 		}
 	}
-
-	// The last pool might not be totally filled out...
-	for (size_t i = 0; i < writePoolStrings.position; i++)
+	else
 	{
-		delete[] writePoolStrings.currentPool->pool[i];
+		depth += PopCount(opens);
+		depth -= PopCount(closes);
 	}
 
+	inString = (inside >> 63) != 0;
+	str += SKIP_CHUNK_SIZE;
+	return SkipChunkResult::CONTINUE;
 }
 
-void KeyValueRoot::Solidify()
+// Steps over a whole block without looking at what's in it. str must be just after the {, and ends up just after its }
+// Braces in strings and comments don't count. When padded is set, there's at least SKIP_PADDING bytes after the end of
+// the string that can be read, which lets us go a chunk at a time
+template<bool useEscapeSequences>
+KeyValueErrorCode SkipBlock(const char*& str, bool padded)
 {
-	if (solidified)
-		return;
-	solidified = true;
-
-	// We need to take the pool, move the stuff into their correct positions, and delete it
-	if (data.node.childCount > 0)
-	{
-		KeyValue::Solidify();
-	}
+	const char* c = str;
+	size_t depth = 1;
+	bool inString = false;
 
-	// Copied of all of these values will be made. No need to retain the pools...
-	readPool.Drain();
-	writePool.Drain();
-	// Sadly, we can't drain the string pool... It contains keys and values for newly added nodes and pairs
-}
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	padded = false;
+#endif
 
-KeyValueErrorCode KeyValueRoot::Parse(const char* str, bool useEscapeSequences)
-{
-	if ( !str )
-		return KeyValueErrorCode::NO_INPUT;
+	// How far to go a byte at a time when a chunk can't be skimmed. Grows while chunks keep falling back, so comment
+	// heavy text doesn't pay for building masks it never gets to use
+	size_t scalarLength = SKIP_CHUNK_SIZE;
 
-	KeyValueErrorCode err;
-	if ( useEscapeSequences )
-		err = KeyValue::Parse<true, true>( str );
-	else
-		err = KeyValue::Parse<true, false>( str );
+	for (;;)
+	{
+		if (padded)
+		{
+			SkipChunkResult result = SkipChunk<useEscapeSequences>(c, depth, inString);
+			if (result == SkipChunkResult::CONTINUE)
+			{
+				scalarLength = SKIP_CHUNK_SIZE;
+				while ((result = SkipChunk<useEscapeSequences>(c, depth, inString)) == SkipChunkResult::CONTINUE);
+			}
+			else if (scalarLength < SKIP_CHUNK_SIZE * 16)
+				scalarLength *= 2;
 
-	if (err != KeyValueErrorCode::NONE)
-		return err;
+			if (result == SkipChunkResult::FOUND_END)
+			{
+				str = c;
+				return KeyValueErrorCode::NONE;
+			}
+		}
 
-	if (bufferSize > 0)
-	{
-		stringBuffer = (char*)malloc(sizeof(char) * bufferSize);
+		// A byte at a time, until we're past whatever the chunk couldn't handle
+		const char* scalarEnd = c + scalarLength;
+		while (!padded || c < scalarEnd)
+		{
+			char ch = *c++;
 
-		// Can't straight pass it, otherwise it'd mess with it
-		char* temp = stringBuffer;
-		if ( useEscapeSequences )
-			BuildData<true>( temp );
-		else
-			BuildData<false>( temp );
-	}
+			if (inString)
+			{
+				if (ch == STRING_CONTAINER)
+					inString = false;
+				else if (ch == '\0')
+				{
+					str = c - 1;
+					return KeyValueErrorCode::INCOMPLETE_STRING;
+				}
+				else if (useEscapeSequences && ch == ESCAPE_CHAR && *c)
+					c++;
+
+				continue;
+			}
 
-	// All good. Return no error
-	return KeyValueErrorCode::NONE;
-}
+			switch (ch)
+			{
+			case '\0':
+				str = c - 1;
+				return KeyValueErrorCode::INCOMPLETE_BLOCK;
 
+			case BLOCK_BEGIN:
+				depth++;
+				break;
 
-///////////////
-// Key Value //
-///////////////
+			case BLOCK_END:
+				if (--depth == 0)
+				{
+					str = c;
+					return KeyValueErrorCode::NONE;
+				}
+				break;
 
-// An invalid KV for use in returns with references
-KeyValue& KeyValue::GetInvalid()
-{
-	static const KeyValue invalid(true);
+			case STRING_CONTAINER:
+				inString = true;
+				break;
 
-	return const_cast<KeyValue&>(invalid);
+			case SINGLE_LINE_COMMENT[0]:
+				if (*c == SINGLE_LINE_COMMENT[1])
+				{
+					for (; *c && *c != '\r' && *c != '\n'; c++);
+				}
+				break;
+			}
+		}
+	}
 }
 
-
-void KeyValue::Solidify()
+// For recovering from errors. Skips ahead to the next block boundary, which is either just past the next block, or on the
+// next } or the end of the file. Only runs after something's already gone wrong, so it doesn't need to be quick
+template<bool useEscapeSequences>
+KeyValueErrorCode SkipToBlockBoundary(const char*& str, bool padded)
 {
-	KeyValue* newArray = new KeyValue[data.node.childCount];
-
-	KeyValue* current = data.node.children;
-
-	data.node.children = newArray;
-
-	// Is it worth block copying out of the pool?
-
-	size_t cc = data.node.childCount;
-	for (size_t i = 0; i < cc; i++)
+	for (;;)
 	{
-		memcpy(&newArray[i], current, sizeof(KeyValue));
+		SkipWhitespace(str);
 
-		if (newArray[i].isNode && newArray[i].data.node.childCount > 0)
-			newArray[i].Solidify();
+		switch (*str)
+		{
+		case '\0':
+		case BLOCK_END:
+			return KeyValueErrorCode::NONE;
 
-		// Maintains compatibility with linked list code
-		newArray[i].next = &newArray[i + 1];
+		case BLOCK_BEGIN:
+			str++;
+			return SkipBlock<useEscapeSequences>(str, padded);
 
-		current = current->next;
-	}
+		case STRING_CONTAINER:
+		{
+			kvString_t skipped;
+			KeyValueErrorCode error = ReadQuotedString<useEscapeSequences>(str, skipped);
+			if (error != KeyValueErrorCode::NONE)
+				return error;
+			break;
+		}
 
-	newArray[cc - 1].next = nullptr;
+		default:
+			str++;
+			break;
+		}
+	}
+}
 
+// Copies a string that's already been null terminated
+static void CopyTerminatedString(char*& destBuffer, kvString_t& str)
+{
+	memcpy(destBuffer, str.string, str.length + 1);
+	str.string = destBuffer;
+	destBuffer += str.length + 1;
 }
 
 
-KeyValue& KeyValue::InternalGet(const char* keyName) const
+////////////////////////////
+// Key Value String Table //
+////////////////////////////
+
+// Remembers every string copied into a buffer so that repeats can point at the first copy.
+// Open addressing with linear probing. Its memory only lives as long as the copy does
+class KeyValueStringTable
 {
-	if (!isNode || data.node.childCount <= 0 || !IsValid())
-		return GetInvalid();
+public:
+	KeyValueStringTable(KeyValueAllocator& allocator, size_t bufferSize) : allocator(allocator)
+	{
+		// Allocated on the first Intern, so an unused table costs nothing
+		capacity = DEDUP_MIN_TABLE_SIZE;
+		while (capacity * DEDUP_BYTES_PER_STRING < bufferSize)
+			capacity *= 2;
+	}
 
+	~KeyValueStringTable()
+	{
+		if (entries)
+			allocator.Free(entries, sizeof(Entry) * capacity);
+	}
 
-	// If we're solid, we can use a quicker route
-	if (rootNode->solidified)
+	// str was just copied to the end of destBuffer. If we've seen it before, str points at the old copy and the new one gets taken back
+	void Intern(char*& destBuffer, kvString_t& str)
 	{
-		size_t cc = data.node.childCount;
-		for (size_t i = 0; i < cc; i++)
+		// Anything this long is never going to be repeated. Keeps the lengths in the table small
+		if (str.length > UINT32_MAX)
+			return;
+
+		if (!entries)
+			Allocate();
+
+		uint32_t hash = Hash(str.string, str.length);
+		for (size_t i = hash & (capacity - 1);; i = (i + 1) & (capacity - 1))
 		{
-			if (strcasecmp(data.node.children[i].key.string, keyName) == 0)
+			Entry& entry = entries[i];
+			if (!entry.string)
 			{
-				return data.node.children[i];
+				entry = { str.string, (uint32_t)str.length, hash };
+				if (++count * 2 > capacity)
+					Grow();
+				return;
+			}
+
+			if (entry.hash == hash && entry.length == str.length && memcmp(entry.string, str.string, str.length) == 0)
+			{
+				destBuffer = str.string;
+				str.string = entry.string;
+
+				duplicates++;
+				savedBytes += str.length + 1;
+				return;
 			}
 		}
 	}
-	else
+
+	size_t duplicates = 0;
+	size_t savedBytes = 0;
+
+	// Eats 8 bytes at a time. Good enough to spread out short keys and long paths alike
+	static uint32_t Hash(const char* str, size_t length)
 	{
-		for (KeyValue* current = data.node.children; current; current = current->next)
+		uint64_t hash = 0x9E3779B97F4A7C15ull ^ length;
+		uint64_t chunk;
+		for (; length >= 8; str += 8, length -= 8)
 		{
-			if (strcasecmp(current->key.string, keyName) == 0)
-			{
-				return *current;
-			}
+			memcpy(&chunk, str, 8);
+			hash = (hash ^ chunk) * 0xFF51AFD7ED558CCDull;
+			hash ^= hash >> 32;
 		}
+
+		chunk = 0;
+		memcpy(&chunk, str, length);
+		hash ^= chunk;
+
+		// Every input bit has to reach the low bits, since those pick the slot
+		hash ^= hash >> 33;
+		hash *= 0xFF51AFD7ED558CCDull;
+		hash ^= hash >> 33;
+		hash *= 0xC4CEB9FE1A85EC53ull;
+		hash ^= hash >> 33;
+		return (uint32_t)hash;
 	}
 
-	return GetInvalid();
-}
+private:
 
-KeyValue& KeyValue::InternalAt(size_t index) const
-{
-	// If we cant get something, return invalid
-	if(!isNode || data.node.childCount <= 0 || index < 0 || index >= data.node.childCount || !IsValid())
-		return GetInvalid();
+	struct Entry
+	{
+		char* string;
+		uint32_t length;
+		uint32_t hash;
+	};
 
-	if (rootNode->solidified)
+	void Allocate()
 	{
-		return data.node.children[index];
+		entries = (Entry*)allocator.Allocate(sizeof(Entry) * capacity, alignof(Entry));
+		memset(entries, 0, sizeof(Entry) * capacity);
 	}
-	else
+
+	void Grow()
 	{
-		KeyValue* current = data.node.children;
-		for (int i = 0; i != index; i++)
+		Entry* old = entries;
+		size_t oldCapacity = capacity;
+
+		capacity *= 2;
+		Allocate();
+
+		for (size_t i = 0; i < oldCapacity; i++)
 		{
-			current = current->next;
+			if (!old[i].string)
+				continue;
+
+			size_t j = old[i].hash & (capacity - 1);
+			while (entries[j].string)
+				j = (j + 1) & (capacity - 1);
+			entries[j] = old[i];
 		}
-		return *current;
-	}
-}
 
+		allocator.Free(old, sizeof(Entry) * oldCapacity);
+	}
 
-KeyValue* KeyValue::Add(const char* keyName, const char* value)
-{
-	// Can't add to a solid kv without kids!
-	if (rootNode->solidified && !isNode)
-		return nullptr;
+	KeyValueAllocator& allocator;
+	Entry* entries = nullptr;
+	size_t capacity;
+	size_t count = 0;
+};
 
 
-	size_t keyLength = strlen(keyName);
-	char*& copiedKey = *rootNode->writePoolStrings.Create();
-	copiedKey = new char[keyLength + 1];
-	memcpy(copiedKey, keyName, keyLength);
-	copiedKey[keyLength] = '\0';
+////////////////////
+// Key Value Pool //
+////////////////////
 
-	size_t valueLength = strlen(value);
-	char*& copiedValue = *rootNode->writePoolStrings.Create();
-	copiedValue = new char[valueLength + 1];
-	memcpy(copiedValue, value, valueLength);
-	copiedValue[valueLength] = '\0';
 
-	KeyValue* newKV = CreateKVPair({ copiedKey, keyLength }, { copiedValue, valueLength }, rootNode->writePool);
+template<typename T>
+KeyValuePool<T>::KeyValuePool(KeyValueAllocator& allocator) : allocator(&allocator)
+{
+
+	position = 0;
+
+	firstPool = CreateChunk(POOL_STARTING_LENGTH, nullptr);
+
+	currentPool = firstPool;
+
+#if KEYVALUE_STATS
+	growthSeconds = 0;
+#endif
+}
+
+template<typename T>
+KeyValuePool<T>::~KeyValuePool()
+{
+	if (firstPool)
+		Drain();
+}
+
+template<typename T>
+void KeyValuePool<T>::Drain()
+{
+	PoolChunk* nextPool = firstPool;
+	PoolChunk* old;
+
+	while (nextPool)
+	{
+		old = nextPool;
+		nextPool = nextPool->next;
+		allocator->Free(old, ChunkHeaderSize() + sizeof(T) * old->length);
+	}
+
+	firstPool = nullptr;
+	currentPool = nullptr;
+}
+
+template<typename T>
+void KeyValuePool<T>::Reset()
+{
+	// Drained pools have nothing left to rewind
+	if (!firstPool)
+		firstPool = CreateChunk(POOL_STARTING_LENGTH, nullptr);
+
+	currentPool = firstPool;
+	position = 0;
+}
+
+template<typename T>
+T* KeyValuePool<T>::Create()
+{
+	if (!IsFull())
+	{
+	returnKV:
+		T* kv = &currentPool->pool[position];
+		position++;
+		return kv;
+	}
+
+	position = 0;
+
+	// If we've been reset, there might already be a chunk after this one we can fill
+	if (currentPool->next)
+	{
+		currentPool = currentPool->next;
+		if (!IsFull())
+			goto returnKV;
+		return Create();
+	}
+
+	// If the pool is full, we have to allocated a new one, and try again
+	size_t newLength = currentPool->length + POOL_INCREMENT_LENGTH;
+
+	STATS_TIMER_START(growthTimer);
+	currentPool = CreateChunk(newLength, currentPool);
+	STATS_TIMER_END(growthTimer, growthSeconds);
+
+	goto returnKV;
+}
+
+template<typename T>
+void KeyValuePool<T>::Measure(size_t& chunks, size_t& bytes) const
+{
+	for (PoolChunk* current = firstPool; current; current = current->next)
+	{
+		chunks++;
+		bytes += current->length * sizeof(T);
+	}
+}
+
+template<typename T>
+size_t KeyValuePool<T>::ChunkHeaderSize()
+{
+	// Round up so that whatever comes after the header is aligned
+	return (sizeof(PoolChunk) + alignof(T) - 1) / alignof(T) * alignof(T);
+}
+
+template<typename T>
+typename KeyValuePool<T>::PoolChunk* KeyValuePool<T>::CreateChunk(size_t length, PoolChunk* last)
+{
+	size_t alignment = std::max(alignof(PoolChunk), alignof(T));
+	char* memory = (char*)allocator->Allocate(ChunkHeaderSize() + sizeof(T) * length, alignment);
+
+	PoolChunk* chunk = new (memory) PoolChunk(length, (T*)(memory + ChunkHeaderSize()));
+	if (last)
+		last->next = chunk;
+	return chunk;
+}
+
+template<typename T>
+KeyValuePool<T>::PoolChunk::PoolChunk(size_t length, T* pool)
+{
+	next = nullptr;
+
+	this->pool = pool;
+	this->length = length;
+}
+
+
+/////////////////////////
+// Key Value Allocator //
+/////////////////////////
+
+class KeyValueDefaultAllocator : public KeyValueAllocator
+{
+public:
+	// malloc is already aligned for anything we'll ask for
+	void* Allocate(size_t size, size_t /*alignment*/) override { return malloc(size); }
+	void Free(void* block, size_t /*size*/) override { free(block); }
+};
+
+KeyValueAllocator& KeyValueAllocator::Default()
+{
+	static KeyValueDefaultAllocator allocator;
+	return allocator;
+}
+
+
+////////////////////
+// Key Value Root //
+////////////////////
+
+KeyValueRoot::KeyValueRoot(const char* str) : KeyValueRoot()
+{
+	Parse(str);
+}
+
+KeyValueRoot::KeyValueRoot() : KeyValueRoot(KeyValueAllocator::Default())
+{
+}
+
+KeyValueRoot::KeyValueRoot(KeyValueAllocator& allocator) : allocator(&allocator)
+{
+	storage = KeyValueStorage::Create(allocator);
+	next = nullptr;
+
+	key = { nullptr, 0 };
+
+	isNode = true;
+	data.node = { nullptr, nullptr, 0, 0 };
+}
+
+KeyValueRoot::KeyValueRoot(KeyValueRoot&& other) noexcept : allocator(other.allocator)
+{
+	// Start off empty and without storage, then take everything the other root has
+	storage = nullptr;
+	next = nullptr;
+
+	key = { nullptr, 0 };
+
+	isNode = true;
+	data.node = { nullptr, nullptr, 0, 0 };
+
+	Swap(other);
+}
+
+KeyValueRoot& KeyValueRoot::operator=(KeyValueRoot&& other) noexcept
+{
+	// Whatever we had goes to the other root, and gets freed along with it
+	if (this != &other)
+		Swap(other);
+	return *this;
+}
+
+KeyValueRoot::~KeyValueRoot()
+{
+	if (storage)
+		KeyValueStorage::Destroy(storage);
+}
+
+void KeyValueRoot::Swap(KeyValueRoot& other)
+{
+	// None of our kids point at us, only at our storage, so this is all it takes
+	std::swap(storage, other.storage);
+	std::swap(data.node, other.data.node);
+	std::swap(allocator, other.allocator);
+}
+
+void KeyValueRoot::Solidify(KeyValueSolidifyMode mode)
+{
+	if (!storage || storage->solidified)
+		return;
+	storage->solidified = true;
+	storage->sortedKeys = mode == KeyValueSolidifyMode::SORT_KEYS;
+
+	// Every kv is about to move
+	storage->DropSerialText();
+
+	STATS_TIMER_START(solidifyTimer);
+
+	// We need to take the pool, move the stuff into their correct positions, and delete it
+	if (data.node.childCount > 0)
+	{
+		// All of the kvs go into one array. The strings stay right where they are
+		size_t nodeCount = 0, stringBytes = 0;
+		CountTree(nodeCount, stringBytes);
+
+		KeyValue* nodes = storage->CreateSolidArray(nodeCount);
+		char* strings = nullptr;
+		Flatten<false>(nodes, strings, nullptr);
+
+		// GetAll always goes by the sorted lists. Get only does with SORT_KEYS
+		SortKeys(nodes - nodeCount, nodeCount);
+	}
+
+	// Copied of all of these values will be made. No need to retain the pools...
+	storage->readPool.Drain();
+	storage->writePool.Drain();
+	// Sadly, we can't drain the string pool... It contains keys and values for newly added nodes and pairs
+
+#if KEYVALUE_STATS
+	storage->solidifySeconds = 0;
+#endif
+	STATS_TIMER_END(solidifyTimer, storage->solidifySeconds);
+}
+
+// Works out the line and column of each error from its offset, with one pass over the document up to the last of them
+static void LocateErrors(const char* start, KeyValueError* errors, size_t count)
+{
+	const char* scanned = start;
+	const char* lineStart = start;
+	size_t line = 1;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		const char* at = start + errors[i].offset;
+
+		// Parse only goes forwards, so this shouldn't happen. Start over if it does
+		if (at < scanned)
+		{
+			scanned = lineStart = start;
+			line = 1;
+		}
+
+		for (const char* newline; (newline = (const char*)memchr(scanned, '\n', at - scanned)); scanned = newline + 1)
+		{
+			line++;
+			lineStart = newline + 1;
+		}
+		scanned = at;
+
+		errors[i].line = line;
+		errors[i].column = at - lineStart + 1;
+	}
+}
+
+KeyValueErrorCode KeyValueRoot::Parse(const char* str, bool useEscapeSequences)
+{
+	KeyValueParseOptions options;
+	options.useEscapeSequences = useEscapeSequences;
+	return Parse(str, options);
+}
+
+KeyValueErrorCode KeyValueRoot::Parse(const char* str, const KeyValueParseOptions& options)
+{
+	bool useEscapeSequences = options.useEscapeSequences;
+
+	if ( !str )
+		return KeyValueErrorCode::NO_INPUT;
+
+	if ( !storage )
+		Reset();
+
+	storage->DropSerialText();
+
+	storage->parseError = KeyValueError();
+	storage->parseErrors = options.errors;
+	if (options.errors)
+		options.errors->clear();
+
+#if KEYVALUE_STATS
+	storage->parseSeconds = 0;
+	storage->buildDataSeconds = 0;
+	double growthBefore = storage->readPool.growthSeconds;
+#endif
+
+	if (options.lazy)
+	{
+		// Lazy blocks get parsed long after str is gone, so they need a copy of their own
+		size_t length = strlen(str);
+		char* source = (char*)storage->CreateBlock(sizeof(char) * (length + 1 + SKIP_PADDING), alignof(char));
+		memcpy(source, str, length + 1);
+		memset(source + length + 1, 0, SKIP_PADDING);
+		str = source;
+
+		storage->lazyEscapes = useEscapeSequences;
+		storage->hasLazySymbols = options.symbols != nullptr;
+		if (options.symbols)
+			storage->lazySymbols = *options.symbols;
+	}
+
+	STATS_TIMER_START(parseTimer);
+	const char* start = str;
+	storage->parseStart = start;
+	KeyValueErrorCode err;
+	if ( useEscapeSequences )
+		err = KeyValue::Parse<true, true>( str, options.symbols, options.lazy );
+	else
+		err = KeyValue::Parse<true, false>( str, options.symbols, options.lazy );
+	storage->parseStart = nullptr;
+	storage->parseErrors = nullptr;
+	STATS_TIMER_END(parseTimer, storage->parseSeconds);
+
+#if KEYVALUE_STATS
+	storage->poolGrowthSeconds = storage->readPool.growthSeconds - growthBefore;
+#endif
+
+	// Lines are only worked out once something's gone wrong, so the parse itself never has to count them.
+	// Recovering returns NONE, but there's still the errors it got past
+	if (storage->parseError.code != KeyValueErrorCode::NONE)
+	{
+		err = storage->parseError.code;
+		if (options.errors)
+		{
+			LocateErrors(start, options.errors->data(), options.errors->size());
+			storage->parseError = options.errors->front();
+		}
+		else
+			LocateErrors(start, &storage->parseError, 1);
+	}
+
+	size_t bufferSize = storage->bufferSize;
+	if (bufferSize > 0)
+	{
+		// Only grows the buffer if the last one we had can't fit this parse
+		bool reused = storage->stringBuffer != nullptr;
+		storage->ReserveBuffer(bufferSize);
+
+		storage->deduplicateStrings = options.deduplicateStrings;
+		KeyValueStringTable table(*storage->allocator, bufferSize);
+		KeyValueStringTable* strings = options.deduplicateStrings ? &table : nullptr;
+
+		// Can't straight pass it, otherwise it'd mess with it
+		STATS_TIMER_START(buildDataTimer);
+		char* temp = storage->stringBuffer;
+		if ( useEscapeSequences )
+			BuildData<true>( temp, strings );
+		else
+			BuildData<false>( temp, strings );
+
+		// Everything dedup caught is dead space at the end of the buffer. Give it back, unless the root has been Reset and
+		// parsed into before. Then it's likely to be again, and the next parse can have the whole buffer without allocating
+		if (table.duplicates > 0)
+		{
+			storage->dedupStrings += table.duplicates;
+			storage->dedupBytes += table.savedBytes;
+			if (reused)
+				storage->bufferSize = temp - storage->stringBuffer;
+			else
+				storage->ShrinkBuffer(*this, temp - storage->stringBuffer);
+		}
+		STATS_TIMER_END(buildDataTimer, storage->buildDataSeconds);
+	}
+
+	if (options.includes)
+	{
+		KeyValueErrorCode includeErr = ResolveIncludes(options);
+		if (err == KeyValueErrorCode::NONE)
+			err = includeErr;
+	}
+
+	return err;
+}
+
+KeyValueRoot KeyValueRoot::Clone() const
+{
+	return CloneSubtree(*this);
+}
+
+KeyValueRoot KeyValueRoot::CloneSubtree(const KeyValue& kv)
+{
+	if (!kv.IsValid())
+		return KeyValueRoot();
+
+	KeyValueRoot clone(*kv.storage->allocator);
+	if (!kv.isNode || kv.data.node.childCount == 0)
+		return clone;
+
+	// Tally everything up first so the kvs and their strings can each be copied into one allocation
+	size_t nodeCount = 0, stringBytes = 0;
+	kv.CountTree(nodeCount, stringBytes);
+
+	KeyValueStorage* storage = clone.storage;
+	storage->ReserveBuffer(stringBytes);
+	storage->bufferSize = stringBytes;
+
+	// Copies of solid kvs are still solid. Anything else can still be added to, as the children stay linked together
+	storage->solidified = kv.storage->solidified;
+	storage->sortedKeys = kv.storage->sortedKeys;
+	storage->deduplicateStrings = kv.storage->deduplicateStrings;
+
+	KeyValueStringTable table(*storage->allocator, stringBytes);
+
+	KeyValue* nodes = storage->CreateSolidArray(nodeCount);
+	char* strings = storage->stringBuffer;
+
+	clone.data.node = kv.data.node;
+	clone.Flatten<true>(nodes, strings, storage->deduplicateStrings ? &table : nullptr);
+
+	if (table.duplicates > 0)
+	{
+		storage->dedupStrings = table.duplicates;
+		storage->dedupBytes = table.savedBytes;
+		storage->ShrinkBuffer(clone, strings - storage->stringBuffer);
+	}
+
+	// The sorted lists are laid out by where the kids used to be, so they have to be made again
+	if (storage->solidified)
+		clone.SortKeys(nodes - nodeCount, nodeCount);
+
+	return clone;
+}
+
+void KeyValueRoot::SortChildren(KeyValue& node, unsigned int* indices, unsigned int& offset)
+{
+	size_t cc = node.data.node.childCount;
+	if (!node.isNode || cc < SORTED_KEYS_MIN_CHILDREN)
+		return;
+
+	unsigned int* sorted = indices + offset;
+	for (unsigned int i = 0; i < cc; i++)
+		sorted[i] = i;
+
+	// Ties go to whichever came first, so that the first of any duplicate keys is still the one we find first.
+	// Cheaper than a stable sort, which needs to allocate
+	const KeyValue* children = node.data.node.children;
+	std::sort(sorted, sorted + cc, [children](unsigned int a, unsigned int b)
+	{
+		int compare = strcasecmp(children[a].key.string, children[b].key.string);
+		return compare < 0 || (compare == 0 && a < b);
+	});
+
+	node.data.node.sortedOffset = offset;
+	offset += (unsigned int)cc;
+}
+
+void KeyValueRoot::SortKeys(KeyValue* nodes, size_t nodeCount)
+{
+	// Tally up how many entries the sorted lists need. The first one is a dud so that 0 can mean unsorted
+	size_t entries = 1;
+	if (data.node.childCount >= SORTED_KEYS_MIN_CHILDREN)
+		entries += data.node.childCount;
+	for (size_t i = 0; i < nodeCount; i++)
+	{
+		if (nodes[i].isNode && nodes[i].data.node.childCount >= SORTED_KEYS_MIN_CHILDREN)
+			entries += nodes[i].data.node.childCount;
+	}
+
+	if (entries == 1)
+		return;
+
+	storage->sortedIndices = (unsigned int*)storage->CreateBlock(sizeof(unsigned int) * entries, alignof(unsigned int));
+
+	unsigned int offset = 1;
+	SortChildren(*this, storage->sortedIndices, offset);
+	for (size_t i = 0; i < nodeCount; i++)
+		SortChildren(nodes[i], storage->sortedIndices, offset);
+}
+
+void KeyValueRoot::SortKeys(const std::vector<KeyValue*>& nodes)
+{
+	size_t entries = 1;
+	for (const KeyValue* node : nodes)
+	{
+		if (node->isNode && node->data.node.childCount >= SORTED_KEYS_MIN_CHILDREN)
+			entries += node->data.node.childCount;
+	}
+
+	if (entries == 1)
+		return;
+
+	storage->sortedIndices = (unsigned int*)storage->CreateBlock(sizeof(unsigned int) * entries, alignof(unsigned int));
+
+	unsigned int offset = 1;
+	for (KeyValue* node : nodes)
+		SortChildren(*node, storage->sortedIndices, offset);
+}
+
+// Walks the tree for the stats that aren't kept anywhere
+static void MeasureTree(const KeyValue& kv, size_t depth, KeyValueStats& stats)
+{
+	stats.largestChildCount = std::max(stats.largestChildCount, kv.ChildCount());
+	if (kv.ChildCount() > 0)
+		stats.maxDepth = std::max(stats.maxDepth, depth);
+
+	for (const KeyValue& child : kv)
+	{
+		stats.nodeCount++;
+		if (child.HasChildren())
+			MeasureTree(child, depth + 1, stats);
+	}
+}
+
+KeyValueStats KeyValueRoot::GetStats() const
+{
+	KeyValueStats stats = {};
+	if (!storage)
+		return stats;
+
+#if KEYVALUE_STATS
+	stats.parseSeconds = storage->parseSeconds;
+	stats.poolGrowthSeconds = storage->poolGrowthSeconds;
+	stats.buildDataSeconds = storage->buildDataSeconds;
+	stats.solidifySeconds = storage->solidifySeconds;
+#endif
+
+	MeasureTree(*this, 1, stats);
+
+	stats.bufferSize = storage->bufferSize;
+	stats.dedupStrings = storage->dedupStrings;
+	stats.dedupBytes = storage->dedupBytes;
+	stats.bufferCapacity = storage->bufferCapacity;
+	stats.lazyStringBytes = storage->lazyStringBytes;
+
+	storage->readPool.Measure(stats.poolChunks, stats.readPoolBytes);
+	storage->writePool.Measure(stats.poolChunks, stats.writePoolBytes);
+	storage->writePoolStrings.Measure(stats.poolChunks, stats.writePoolStringsBytes);
+	stats.writePoolStringsBytes += storage->copiedStringBytes;
+
+	size_t solidArraySlotBytes = 0;
+	storage->solidArrays.Measure(stats.poolChunks, solidArraySlotBytes);
+	stats.solidBytes = storage->solidBytes - storage->lazyStringBytes + solidArraySlotBytes;
+
+	return stats;
+}
+
+KeyValueError KeyValueRoot::LastError() const
+{
+	if (!storage)
+		return KeyValueError();
+	return storage->parseError;
+}
+
+KeyValueErrorCode KeyValueRoot::LazyError() const
+{
+	if (!storage)
+		return KeyValueErrorCode::NONE;
+
+	std::lock_guard<std::mutex> lock(storage->lazyMutex);
+	return storage->lazyError;
+}
+
+void KeyValueRoot::Reset()
+{
+	if (storage)
+		storage->Reset();
+	else
+		storage = KeyValueStorage::Create(*allocator);
+
+	data.node = { nullptr, nullptr, 0, 0 };
+}
+
+
+///////////////////////
+// Key Value Storage //
+///////////////////////
+
+KeyValueStorage::KeyValueStorage(KeyValueAllocator& allocator) :
+	allocator(&allocator), invalid(true),
+	readPool(allocator), writePool(allocator), writePoolStrings(allocator), solidArrays(allocator)
+{
+	stringBuffer = nullptr;
+	bufferSize = 0;
+	bufferCapacity = 0;
+
+	deduplicateStrings = false;
+	dedupStrings = 0;
+	dedupBytes = 0;
+
+	lazyEscapes = false;
+	hasLazySymbols = false;
+	lazySymbols.clear();
+	lazyError = KeyValueErrorCode::NONE;
+
+	parseError = KeyValueError();
+	parseStart = nullptr;
+	parseErrors = nullptr;
+
+	solidified = false;
+
+	sortedIndices = nullptr;
+	sortedKeys = false;
+
+	packPosition = nullptr;
+	packRemaining = 0;
+
+	solidBytes = 0;
+	copiedStringBytes = 0;
+	lazyStringBytes = 0;
+
+#if KEYVALUE_STATS
+	parseSeconds = 0;
+	poolGrowthSeconds = 0;
+	buildDataSeconds = 0;
+	solidifySeconds = 0;
+#endif
+
+	chainLength = 0;
+	chainBytes = 0;
+	flatBytes = 0;
+
+	hasSerialText = false;
+	serialEscapes = false;
+	serialChanged = false;
+}
+
+KeyValueStorage::~KeyValueStorage()
+{
+	if (stringBuffer)
+		allocator->Free(stringBuffer, bufferCapacity);
+
+	// writePoolStrings are allocated on creation of a node.. We have to clean all of these up manually :(
+	FreeBlocks(writePoolStrings);
+
+	// Same goes for the solid arrays
+	FreeBlocks(solidArrays);
+}
+
+KeyValueStorage* KeyValueStorage::Create(KeyValueAllocator& allocator)
+{
+	void* memory = allocator.Allocate(sizeof(KeyValueStorage), alignof(KeyValueStorage));
+	return new (memory) KeyValueStorage(allocator);
+}
+
+void KeyValueStorage::Destroy(KeyValueStorage* storage)
+{
+	KeyValueAllocator& allocator = *storage->allocator;
+	storage->~KeyValueStorage();
+	allocator.Free(storage, sizeof(KeyValueStorage));
+}
+
+void KeyValueStorage::FreeBlocks(KeyValuePool<KeyValueBlock>& pool)
+{
+	for (KeyValuePool<KeyValueBlock>::PoolChunk* current = pool.firstPool; current != pool.currentPool; current = current->next)
+	{
+		for (size_t i = 0; i < current->length; i++)
+		{
+			allocator->Free(current->pool[i].memory, current->pool[i].size);
+		}
+	}
+
+	// The last pool might not be totally filled out...
+	for (size_t i = 0; i < pool.position; i++)
+	{
+		allocator->Free(pool.currentPool->pool[i].memory, pool.currentPool->pool[i].size);
+	}
+}
+
+void KeyValueStorage::Reset()
+{
+	FreeBlocks(writePoolStrings);
+	FreeBlocks(solidArrays);
+
+	writePoolStrings.Reset();
+	solidArrays.Reset();
+	readPool.Reset();
+	writePool.Reset();
+
+	// The string buffer's capacity sticks around for the next parse
+	bufferSize = 0;
+
+	deduplicateStrings = false;
+	dedupStrings = 0;
+	dedupBytes = 0;
+
+	lazyEscapes = false;
+	hasLazySymbols = false;
+	lazySymbols.clear();
+	lazyError = KeyValueErrorCode::NONE;
+
+	parseError = KeyValueError();
+	parseStart = nullptr;
+	parseErrors = nullptr;
+
+	solidified = false;
+
+	sortedIndices = nullptr;
+	sortedKeys = false;
+
+	packPosition = nullptr;
+	packRemaining = 0;
+
+	solidBytes = 0;
+	copiedStringBytes = 0;
+	lazyStringBytes = 0;
+
+	baseVersion.reset();
+	includes.clear();
+	chainLength = 0;
+	chainBytes = 0;
+	flatBytes = 0;
+
+	DropSerialText();
+}
+
+void KeyValueStorage::DropSerialText()
+{
+	hasSerialText = false;
+	serialChanged = false;
+	serialText.clear();
+	serialSpans.clear();
+}
+
+void KeyValueStorage::ReserveBuffer(size_t size)
+{
+	if (size <= bufferCapacity)
+		return;
+
+	if (stringBuffer)
+		allocator->Free(stringBuffer, bufferCapacity);
+
+	stringBuffer = (char*)allocator->Allocate(sizeof(char) * size, alignof(char));
+	bufferCapacity = size;
+}
+
+void KeyValueStorage::ShrinkBuffer(KeyValue& kv, size_t size)
+{
+	char* oldBuffer = stringBuffer;
+	size_t oldCapacity = bufferCapacity;
+
+	stringBuffer = (char*)allocator->Allocate(sizeof(char) * size, alignof(char));
+	bufferSize = size;
+	bufferCapacity = size;
+
+	memcpy(stringBuffer, oldBuffer, size);
+	kv.RebaseStrings(oldBuffer, stringBuffer);
+
+	allocator->Free(oldBuffer, oldCapacity);
+}
+
+char* KeyValueStorage::CopyString(const char* str, size_t length)
+{
+	char* copied = (char*)allocator->Allocate(sizeof(char) * (length + 1), alignof(char));
+	*writePoolStrings.Create() = { copied, length + 1 };
+	copiedStringBytes += length + 1;
+
+	memcpy(copied, str, length);
+	copied[length] = '\0';
+
+	return copied;
+}
+
+char* KeyValueStorage::PackString(const char* str, size_t length)
+{
+	char* packed = AllocatePacked(length + 1);
+	memcpy(packed, str, length);
+	packed[length] = '\0';
+	return packed;
+}
+
+char* KeyValueStorage::AllocatePacked(size_t size)
+{
+	if (size > packRemaining)
+	{
+		// Big ones would waste most of a block, so they get their own
+		if (size > PACKED_BLOCK_SIZE / 4)
+			return (char*)CreateBlock(sizeof(char) * size, alignof(char));
+
+		packPosition = (char*)CreateBlock(sizeof(char) * PACKED_BLOCK_SIZE, alignof(char));
+		packRemaining = PACKED_BLOCK_SIZE;
+	}
+
+	char* packed = packPosition;
+	packPosition += size;
+	packRemaining -= size;
+	return packed;
+}
+
+KeyValue* KeyValueStorage::CreateSolidArray(size_t count)
+{
+	// Everything in here gets copied over, so there's no point in constructing any of it
+	return (KeyValue*)CreateBlock(sizeof(KeyValue) * count, alignof(KeyValue));
+}
+
+void* KeyValueStorage::CreateBlock(size_t size, size_t alignment)
+{
+	void* block = allocator->Allocate(size, alignment);
+	*solidArrays.Create() = { block, size };
+	solidBytes += size;
+	return block;
+}
+
+
+///////////////
+// Key Value //
+///////////////
+
+// An invalid KV for use in returns with references
+// It's shared by every thread, so it's only ever handed out const
+const KeyValue& KeyValue::GetInvalid()
+{
+	static const KeyValue invalid(true);
+
+	return invalid;
+}
+
+// Anything that modifies a kv still has to check IsValid first, but a writer that doesn't can only reach its own root's.
+// Kvs without storage are invalid or moved from roots, and get one per thread
+KeyValue& KeyValue::GetMissing() const
+{
+	if (storage)
+		return storage->invalid;
+
+	thread_local KeyValue invalid(true);
+	return invalid;
+}
+
+
+// Moves every child, and every child of a child, into one array laid out so that each set of children sits side by side.
+// When copyStrings is set, every key and value gets copied out into strings too
+template<bool copyStrings>
+void KeyValue::Flatten(KeyValue*& nodes, char*& strings, KeyValueStringTable* table)
+{
+	KeyValue* newArray = nodes;
+	size_t cc = data.node.childCount;
+	nodes += cc;
+
+	KeyValue* current = data.node.children;
+
+	data.node.children = newArray;
+	// Any sorted list we had went with the old children
+	data.node.sortedOffset = 0;
+
+	for (size_t i = 0; i < cc; i++)
+	{
+		KeyValue& kv = newArray[i];
+		kv = *current;
+		kv.storage = storage;
+
+		if (copyStrings)
+		{
+			CopyTerminatedString(strings, kv.key);
+			if (table)
+				table->Intern(strings, kv.key);
+
+			if (!kv.isNode)
+			{
+				CopyTerminatedString(strings, kv.data.leaf.value);
+				if (table)
+					table->Intern(strings, kv.data.leaf.value);
+			}
+		}
+
+		// The kid still points at its old children, so it can flatten them itself
+		if (kv.isNode && kv.data.node.childCount > 0)
+			kv.Flatten<copyStrings>(nodes, strings, table);
+
+		// Maintains compatibility with linked list code
+		kv.next = &newArray[i + 1];
+
+		current = current->next;
+	}
+
+	newArray[cc - 1].next = nullptr;
+	data.node.lastChild = &newArray[cc - 1];
+
+}
+
+void KeyValue::MaterializeLazy()
+{
+	// Lazy blocks can be reached from many threads at once, and they all share the pools
+	std::lock_guard<std::mutex> lock(storage->lazyMutex);
+
+	// Someone else might've parsed it while we were waiting
+	if (!lazy.load(std::memory_order_relaxed))
+		return;
+
+	const char* str = data.lazy.source;
+	data.node = { nullptr, nullptr, 0, 0 };
+
+	const std::vector<std::string>* symbols = storage->hasLazySymbols ? &storage->lazySymbols : nullptr;
+	size_t bufferSize = storage->bufferSize;
+
+	KeyValueErrorCode err;
+	if (storage->lazyEscapes)
+		err = Parse<false, true>(str, symbols, true);
+	else
+		err = Parse<false, false>(str, symbols, true);
+
+	if (err != KeyValueErrorCode::NONE)
+	{
+		// The first pass only made sure the braces matched up. Anything else wrong in here leaves the block empty
+		data.node = { nullptr, nullptr, 0, 0 };
+		if (storage->lazyError == KeyValueErrorCode::NONE)
+			storage->lazyError = err;
+	}
+	else if (data.node.childCount > 0)
+	{
+		// The strings go in a buffer of their own, since the main one was sized for the first pass
+		size_t stringBytes = storage->bufferSize - bufferSize;
+		char* strings = (char*)storage->CreateBlock(sizeof(char) * stringBytes, alignof(char));
+		storage->lazyStringBytes += stringBytes;
+		if (storage->lazyEscapes)
+			BuildData<true>(strings, nullptr);
+		else
+			BuildData<false>(strings, nullptr);
+	}
+
+	// Parse tallied the block's strings up as if they were going in the main buffer
+	storage->bufferSize = bufferSize;
+
+	lazy.store(false, std::memory_order_release);
+}
+
+void KeyValue::RebaseStrings(const char* oldBuffer, char* newBuffer)
+{
+	for (KeyValue* current = data.node.children; current; current = current->next)
+	{
+		current->key.string = newBuffer + (current->key.string - oldBuffer);
+
+		if (!current->isNode)
+			current->data.leaf.value.string = newBuffer + (current->data.leaf.value.string - oldBuffer);
+		else if (current->data.node.childCount > 0)
+			current->RebaseStrings(oldBuffer, newBuffer);
+	}
+}
+
+void KeyValue::CountTree(size_t& nodes, size_t& stringBytes) const
+{
+	// Everything below gets copied after this, so every lazy block has to be parsed now
+	Materialize();
+
+	nodes += data.node.childCount;
+	for (KeyValue* current = data.node.children; current; current = current->next)
+	{
+		stringBytes += current->key.length + 1;
+
+		if (!current->isNode)
+			stringBytes += current->data.leaf.value.length + 1;
+		else
+			current->CountTree(nodes, stringBytes);
+	}
+}
+
+
+KeyValue& KeyValue::InternalGet(const char* keyName) const
+{
+	Materialize();
+
+	if (!isNode || data.node.childCount <= 0 || !IsValid())
+		return GetMissing();
+
+
+	// If we're solid, we can use a quicker route
+	if (storage->solidified)
+	{
+		if (storage->sortedKeys && data.node.sortedOffset)
+		{
+			// Our sorted list lives with our kids, which might not be in the same storage as us
+			const KeyValue* children = data.node.children;
+			const unsigned int* sorted = children->storage->sortedIndices + data.node.sortedOffset;
+			const unsigned int* found = std::lower_bound(sorted, sorted + data.node.childCount, keyName, [children](unsigned int i, const char* name)
+			{
+				return strcasecmp(children[i].key.string, name) < 0;
+			});
+
+			if (found != sorted + data.node.childCount && strcasecmp(children[*found].key.string, keyName) == 0)
+				return data.node.children[*found];
+
+			return GetMissing();
+		}
+
+		size_t cc = data.node.childCount;
+		for (size_t i = 0; i < cc; i++)
+		{
+			if (strcasecmp(data.node.children[i].key.string, keyName) == 0)
+			{
+				return data.node.children[i];
+			}
+		}
+	}
+	else
+	{
+		for (KeyValue* current = data.node.children; current; current = current->next)
+		{
+			if (strcasecmp(current->key.string, keyName) == 0)
+			{
+				return *current;
+			}
+		}
+	}
+
+	return GetMissing();
+}
+
+KeyValue& KeyValue::InternalAt(size_t index) const
+{
+	Materialize();
+
+	// If we cant get something, return invalid
+	if(!isNode || data.node.childCount <= 0 || index < 0 || index >= data.node.childCount || !IsValid())
+		return GetMissing();
+
+	if (storage->solidified)
+	{
+		return data.node.children[index];
+	}
+	else
+	{
+		KeyValue* current = data.node.children;
+		for (int i = 0; i != index; i++)
+		{
+			current = current->next;
+		}
+		return *current;
+	}
+}
+
+KeyValueRange KeyValue::GetAll(const char* keyName) const
+{
+	Materialize();
+
+	KeyValueRange range;
+	if (!isNode || data.node.childCount <= 0 || !IsValid())
+		return range;
+
+	if (storage->solidified && data.node.sortedOffset)
+	{
+		// Ties were sorted by position, so everything with our key sits side by side, still in order
+		KeyValue* children = data.node.children;
+		const unsigned int* sorted = children->storage->sortedIndices + data.node.sortedOffset;
+		const unsigned int* sortedEnd = sorted + data.node.childCount;
+		const unsigned int* first = std::lower_bound(sorted, sortedEnd, keyName, [children](unsigned int i, const char* name)
+		{
+			return strcasecmp(children[i].key.string, name) < 0;
+		});
+		const unsigned int* last = std::upper_bound(first, sortedEnd, keyName, [children](const char* name, unsigned int i)
+		{
+			return strcasecmp(name, children[i].key.string) < 0;
+		});
+
+		if (first != last)
+		{
+			range.first.children = children;
+			range.first.sorted = first;
+			range.first.sortedEnd = last;
+			range.first.current = children + *first;
+		}
+		return range;
+	}
+
+	range.first.key = keyName;
+	range.first.current = range.first.Find(data.node.children);
+	return range;
+}
+
+KeyValue* KeyValueIterator::Find(KeyValue* start) const
+{
+	for (; start; start = start->Next())
+	{
+		if (strcasecmp(start->Key().string, key) == 0)
+			return start;
+	}
+	return nullptr;
+}
+
+size_t KeyValueRange::Count() const
+{
+	if (first.sorted)
+		return first.sortedEnd - first.sorted;
+
+	size_t count = 0;
+	for (KeyValueIterator it = first; it != end(); ++it)
+		count++;
+	return count;
+}
+
+// Where Visit is up to in one node's children
+struct KeyValueVisitEntry
+{
+	const KeyValue* parent;
+	// The next child to visit. Null once they've all been done
+	const KeyValue* child;
+	// Of the children, not the parent
+	size_t depth;
+};
+
+void KeyValue::Visit(KeyValueVisitor& visitor, KeyValueVisitOrder order) const
+{
+	if (!IsValid() || !HasChildren())
+		return;
+
+	// Never recursion, which is a function call and a stack frame per node that the visitor's already paying for once.
+	// Depth first only ever has one entry per level, so it stays tiny. Breadth first queues a node per entry, leaves never
+	std::vector<KeyValueVisitEntry> work;
+	work.push_back({ this, Children(), 0 });
+
+	if (order == KeyValueVisitOrder::BREADTH_FIRST)
+	{
+		// Consecutive nodes in the queue can be anywhere in memory, so instead of waiting on each one as it comes up, the
+		// first children of the ones a little further along get asked for, then their strings once they've likely shown up
+		size_t head = 0;
+		while (head < work.size())
+		{
+			if (head + VISIT_PREFETCH_DISTANCE * 2 < work.size())
+				Prefetch(work[head + VISIT_PREFETCH_DISTANCE * 2].child);
+			if (head + VISIT_PREFETCH_DISTANCE < work.size() && work[head + VISIT_PREFETCH_DISTANCE].child)
+			{
+				const KeyValue* upcoming = work[head + VISIT_PREFETCH_DISTANCE].child;
+				Prefetch(upcoming->key.string);
+				Prefetch(upcoming->isNode ? nullptr : upcoming->data.leaf.value.string);
+			}
+
+			KeyValueVisitEntry entry = work[head++];
+			for (const KeyValue* kv = entry.child; kv; kv = kv->next)
+			{
+				Prefetch(kv->next);
+				if (visitor.Visit(*kv, entry.depth) && kv->isNode)
+					work.push_back({ kv, kv->Children(), entry.depth + 1 });
+			}
+
+			// A queue is just the front of the vector moving forward. Done entries get dropped once they're half of it
+			if (head >= VISIT_PREFETCH_DISTANCE * 2 && head * 2 >= work.size())
+			{
+				work.erase(work.begin(), work.begin() + head);
+				head = 0;
+			}
+		}
+		return;
+	}
+
+	bool postOrder = order == KeyValueVisitOrder::POST_ORDER;
+	while (!work.empty())
+	{
+		KeyValueVisitEntry& entry = work.back();
+		const KeyValue* kv = entry.child;
+		if (!kv)
+		{
+			// Post order gets to a node once everything under it is done, which is now
+			const KeyValue* parent = entry.parent;
+			size_t depth = entry.depth;
+			work.pop_back();
+			if (postOrder && !work.empty())
+				visitor.Visit(*parent, depth - 1);
+			continue;
+		}
+
+		// The next sibling's wanted as soon as everything under this kv is done, so it may as well be on its way now
+		entry.child = kv->next;
+		Prefetch(kv->next);
+		size_t depth = entry.depth;
+
+		if (postOrder)
+		{
+			if (!kv->isNode)
+				visitor.Visit(*kv, depth);
+			else
+			{
+				const KeyValue* children = kv->Children();
+				Prefetch(children);
+				work.push_back({ kv, children, depth + 1 });
+			}
+			continue;
+		}
+
+		if (visitor.Visit(*kv, depth) && kv->isNode)
+		{
+			const KeyValue* children = kv->Children();
+			Prefetch(children);
+			work.push_back({ kv, children, depth + 1 });
+		}
+	}
+}
+
+KeyValue* KeyValue::Add(const char* keyName, const char* value)
+{
+	// Can't add to a solid kv or a kv without kids!
+	if (!IsValid() || storage->solidified || !isNode)
+		return nullptr;
+
+	Materialize();
+	MarkDirty();
+
+
+	size_t keyLength = strlen(keyName);
+	char* copiedKey = storage->CopyString(keyName, keyLength);
+
+	size_t valueLength = strlen(value);
+	char* copiedValue = storage->CopyString(value, valueLength);
+
+	KeyValue* newKV = CreateKVPair({ copiedKey, keyLength }, { copiedValue, valueLength }, storage->writePool);
 	newKV->next = nullptr;
 
-	if (data.node.children)
+	if (data.node.children)
+	{
+		data.node.lastChild->next = newKV;
+	}
+	else
+	{
+		data.node.children = newKV;
+	}
+	data.node.lastChild = newKV;
+	data.node.childCount++;
+
+	return newKV;
+}
+
+KeyValue* KeyValue::AddNode(const char* keyName)
+{
+	// Can't add to a solid kv or a kv without kids!
+	if (!IsValid() || storage->solidified || !isNode)
+		return nullptr;
+
+	Materialize();
+	MarkDirty();
+
+	KeyValue* node = storage->writePool.Create();
+
+	size_t keyLength = strlen(keyName);
+	char* copiedKey = storage->CopyString(keyName, keyLength);
+
+	node->key = { copiedKey, keyLength };
+
+	node->isNode = true;
+	node->lazy.store(false, std::memory_order_relaxed);
+	node->dirty = true;
+	node->data.node = { nullptr, nullptr, 0, 0 };
+
+	node->storage = storage;
+	node->next = nullptr;
+
+	if (data.node.childCount == 0)
+	{
+		data.node.children = node;
+	}
+	else
+	{
+		data.node.lastChild->next = node;
+	}
+	data.node.lastChild = node;
+	data.node.childCount++;
+	
+	return node;
+}
+
+bool KeyValue::IsValid() const
+{
+	// The invalid KV is always invalid, and infinite loops are invalid 
+	// Moved from roots have no storage, and are invalid until they get some
+	return this != &GetInvalid() && storage
+		&& next != this && data.node.children != this && data.node.lastChild != this;
+}
+
+KeyValue::KeyValue(bool invalid) : data({}), lazy(false), dirty(true)
+{
+	if (invalid)
+	{
+		// Zero the key and root
+		key = { nullptr, 0 };
+		storage = nullptr;
+		
+		// Explicitly invalid data
+		next = this;
+		isNode = true;
+		data.node.children = this;
+		data.node.lastChild = this;
+		data.node.childCount = 0;
+	}
+}
+
+KeyValue::~KeyValue()
+{
+	// Solid arrays belong to the root, which frees them all at once
+}
+
+KeyValue* KeyValue::CreateKVPair(kvString_t keyName, kvString_t string, KeyValuePool<KeyValue>& pool)
+{
+	KeyValue* kv = pool.Create();
+	kv->key = keyName;
+	kv->data.leaf.value = string;
+	kv->isNode = false;
+	kv->lazy.store(false, std::memory_order_relaxed);
+	kv->dirty = true;
+	kv->storage = storage;
+	return kv;
+}
+
+template<bool isRoot, bool useEscapeSequences>
+KeyValueErrorCode KeyValue::Parse(const char*& str, const std::vector<std::string>* symbols, bool lazy)
+{
+	KeyValue* lastKV = nullptr;
+	KeyValueErrorCode result = KeyValueErrorCode::NONE;
+	char c;
+	for (;;)
+	{
+		SkipWhitespace(str);
+
+		c = *str;
+		const char* keyStart = str;
+
+		kvString_t pairkey;
+
+		// Parse the key out
+		switch (c)
+		{
+
+		case STRING_CONTAINER:
+		{
+			KeyValueErrorCode error = ReadQuotedString<useEscapeSequences>( str, pairkey );
+
+			// Strings that never close run to the end of the file, so there's nothing left to recover
+			if (error != KeyValueErrorCode::NONE)
+			{
+				ParseError(error, keyStart);
+				result = error;
+				goto end;
+			}
+
+			break;
+		}
+		case BLOCK_END:
+
+			// Make sure we skip a char here so that the above layer doesn't read it!
+			str++;
+
+			// If we hit a block end as root, we've got a syntax error on our hands... Let's skedaddle!
+			if (isRoot)
+			{
+				// Unless we're recovering, in which case we act like it wasn't there
+				if (ParseError(KeyValueErrorCode::UNEXPECTED_END_OF_BLOCK, keyStart))
+					continue;
+
+				result = KeyValueErrorCode::UNEXPECTED_END_OF_BLOCK;
+			}
+
+			// Otherwise, we should be totally fine to just return at this point
+			goto end;
+
+
+			// Did we hit the end of the file?
+		case 0:
+			// If we're root and at the end of the file after this whitespace skip, that means there's no next kv pair. End now
+			if (isRoot)
+				goto end;
+
+			// If we're not root and at the end of the file after this whitespace skip, we've failed to find the block end
+			ParseError(KeyValueErrorCode::INCOMPLETE_BLOCK, str);
+			result = KeyValueErrorCode::INCOMPLETE_BLOCK;
+			goto end;
+
+		case BLOCK_BEGIN:
+		{
+			if (!ParseError(KeyValueErrorCode::UNEXPECTED_START_OF_BLOCK, keyStart))
+			{
+				result = KeyValueErrorCode::UNEXPECTED_START_OF_BLOCK;
+				goto end;
+			}
+
+			// A block without a key gets skipped over whole
+			str++;
+			KeyValueErrorCode error = SkipBlock<useEscapeSequences>(str, lazy);
+			if (error != KeyValueErrorCode::NONE)
+			{
+				ParseError(error, str);
+				result = error;
+				goto end;
+			}
+			continue;
+		}
+
+#if ALLOW_QUOTELESS_STRINGS
+			// It's gotta be a quoteless string
+		default:
+
+			pairkey = ReadQuotelessString(str);
+
+			break;
+#endif
+		}
+
+		// We've got our key, so let's find its value
+
+		SkipWhitespace(str);
+
+		c = *str;
+
+		// A conditional in front of the value decides whether we keep it. Dead blocks get skipped without parsing them
+		if (symbols && c == CONDITIONAL_BEGIN)
+		{
+			const char* conditionalStart = str;
+			kvString_t conditional;
+			KeyValueErrorCode error = ReadConditional(str, conditional);
+			if (error != KeyValueErrorCode::NONE)
+			{
+				if (!ParseError(error, conditionalStart))
+				{
+					result = error;
+					goto end;
+				}
+
+				// There's no telling what the pair was meant to be, so everything up to the next block boundary goes
+				error = SkipToBlockBoundary<useEscapeSequences>(str, lazy);
+				if (error != KeyValueErrorCode::NONE)
+				{
+					ParseError(error, str);
+					result = error;
+					goto end;
+				}
+				continue;
+			}
+
+			SkipWhitespace(str);
+			c = *str;
+
+			if (!EvaluateConditional(conditional, *symbols))
+			{
+				const char* valueStart = str;
+				if (c == BLOCK_BEGIN)
+				{
+					str++;
+					error = SkipBlock<useEscapeSequences>(str, lazy);
+				}
+				else if (c == STRING_CONTAINER)
+				{
+					kvString_t skipped;
+					error = ReadQuotedString<useEscapeSequences>(str, skipped);
+				}
+				else if (c == '\0')
+					error = KeyValueErrorCode::INCOMPLETE_PAIR;
+				else if (c == BLOCK_END)
+				{
+					// The block ends early, and that's all there is to recovering from it. Root has no block to end, so the } goes
+					if (ParseError(KeyValueErrorCode::UNEXPECTED_END_OF_BLOCK, valueStart))
+					{
+						if (isRoot)
+							str++;
+						continue;
+					}
+					error = KeyValueErrorCode::UNEXPECTED_END_OF_BLOCK;
+				}
+#if ALLOW_QUOTELESS_STRINGS
+				else
+					ReadQuotelessString(str);
+#endif
+
+				// Anything else means we're at the end of the file
+				if (error != KeyValueErrorCode::NONE)
+				{
+					if (error != KeyValueErrorCode::UNEXPECTED_END_OF_BLOCK)
+						ParseError(error, c == STRING_CONTAINER ? valueStart : str);
+					result = error;
+					goto end;
+				}
+				continue;
+			}
+		}
+
+
+		KeyValue* pair;
+		kvString_t stringValue;
+		const char* valueStart = str;
+		KeyValueErrorCode blockError = KeyValueErrorCode::NONE;
+
+
+		// Same kinda stuff as earlier but a bit different for the value
+		switch (c)
+		{
+
+		case STRING_CONTAINER:
+		{
+			KeyValueErrorCode error = ReadQuotedString<useEscapeSequences>(str, stringValue);
+
+			if (error != KeyValueErrorCode::NONE)
+			{
+				ParseError(error, valueStart);
+				result = error;
+				goto end;
+			}
+
+			pair = nullptr;
+			break;
+		}
+		case BLOCK_BEGIN:
+		{
+			pair = storage->readPool.Create();
+			pair->storage = storage;
+
+			//skip over the BLOCK_BEGIN
+			str++;
+			pair->isNode = true;
+			pair->data.node = { nullptr, nullptr, 0, 0 };
+
+			if (lazy)
+			{
+				// Just remember where it starts. It gets parsed when something asks for it
+				pair->data.lazy.source = str;
+				pair->lazy.store(true, std::memory_order_relaxed);
+				pair->dirty = true;
+
+				KeyValueErrorCode error = SkipBlock<useEscapeSequences>(str, true);
+				if (error != KeyValueErrorCode::NONE)
+				{
+					ParseError(error, str);
+					result = error;
+					goto end;
+				}
+			}
+			else
+			{
+				// Whatever the block got through before it stopped is kept, so it gets linked in like any other first
+				pair->lazy.store(false, std::memory_order_relaxed);
+				pair->dirty = true;
+				blockError = pair->Parse<false, useEscapeSequences>(str, symbols, false);
+			}
+
+			pair->key = pairkey;
+
+			break;
+		}
+		case 0:
+			// Hit EOF before the value
+			ParseError(KeyValueErrorCode::INCOMPLETE_PAIR, str);
+			result = KeyValueErrorCode::INCOMPLETE_PAIR;
+			goto end;
+
+		case BLOCK_END:
+			// Same as a } in place of a dead value
+			if (ParseError(KeyValueErrorCode::UNEXPECTED_END_OF_BLOCK, valueStart))
+			{
+				if (isRoot)
+					str++;
+				continue;
+			}
+
+			result = KeyValueErrorCode::UNEXPECTED_END_OF_BLOCK;
+			goto end;
+
+#if ALLOW_QUOTELESS_STRINGS
+			// It's gotta be a quoteless string
+		default:
+		{
+
+			stringValue = ReadQuotelessString(str);
+			pair = nullptr;
+
+			break;
+		}
+#endif
+		}
+
+		// Pairs can have a conditional after their value too. We look ahead for it before making the pair, so dead ones cost nothing
+		if (!pair)
+		{
+			if (symbols)
+			{
+				SkipWhitespace(str);
+				if (*str == CONDITIONAL_BEGIN)
+				{
+					const char* conditionalStart = str;
+					kvString_t conditional;
+					KeyValueErrorCode error = ReadConditional(str, conditional);
+					if (error != KeyValueErrorCode::NONE)
+					{
+						if (!ParseError(error, conditionalStart))
+						{
+							result = error;
+							goto end;
+						}
+
+						error = SkipToBlockBoundary<useEscapeSequences>(str, lazy);
+						if (error != KeyValueErrorCode::NONE)
+						{
+							ParseError(error, str);
+							result = error;
+							goto end;
+						}
+						continue;
+					}
+
+					if (!EvaluateConditional(conditional, *symbols))
+						continue;
+				}
+			}
+
+			pair = CreateKVPair(pairkey, stringValue, storage->readPool);
+
+			storage->bufferSize += stringValue.length + 1; // + 1 for \0
+		}
+
+		storage->bufferSize += pairkey.length + 1; // + 1 for \0
+
+		data.node.childCount++;
+		if (lastKV)
+		{
+			lastKV->next = pair;
+		}
+		else
+		{
+			data.node.children = pair;
+		}
+		lastKV = pair;
+
+		// The block already noted down where it went wrong
+		if (blockError != KeyValueErrorCode::NONE)
+		{
+			result = blockError;
+			goto end;
+		}
+	}
+end:
+	// Even when something went wrong, everything up to it stays in one piece
+	if (lastKV)
+	{
+		lastKV->next = nullptr;
+		data.node.lastChild = lastKV;
+	}
+
+	return result;
+}
+
+bool KeyValue::ParseError(KeyValueErrorCode err, const char* at)
+{
+	// Lazy blocks get parsed long after Parse is done with. Their errors go to LazyError instead
+	KeyValueStorage* s = storage;
+	if (!s->parseStart)
+		return false;
+
+	KeyValueError error;
+	error.code = err;
+	error.offset = at - s->parseStart;
+
+	if (s->parseError.code == KeyValueErrorCode::NONE)
+		s->parseError = error;
+
+	if (!s->parseErrors)
+		return false;
+
+	s->parseErrors->push_back(error);
+	return true;
+}
+
+template<bool useEscapeSequences>
+static void KVCopyString( char *&destBuffer, kvString_t &str );
+
+template<>
+void KVCopyString<true>( char*& destBuffer, kvString_t& str )
+{
+	char *cur = str.string;
+	char *end = str.string + str.length;
+	char *oStart = destBuffer;
+	char *o = oStart;
+	while ( cur < end )
+	{
+		if ( *cur == ESCAPE_CHAR )
+		{
+			cur++;
+			switch ( *cur )
+			{
+			case 'n': *o = '\n'; break;
+			case 't': *o = '\t'; break;
+			case 'v': *o = '\v'; break;
+			case 'b': *o = '\b'; break;
+			case 'r': *o = '\r'; break;
+			case 'f': *o = '\f'; break;
+			case 'a': *o = '\a'; break;
+			case '\\': *o = '\\'; break;
+			case '\?': *o = '\?'; break;
+			case '\'': *o = '\''; break;
+			case '\"': *o = '\"'; break;
+			default: *o = *cur; break;
+			}
+			o++;
+			cur++;
+		}
+		else
+		{
+			*o = *cur;
+			o++;
+			cur++;
+		}
+	}
+	*o = '\0';
+
+	str.string = oStart;
+	str.length = o - oStart;
+	destBuffer = o + 1;
+}
+
+template<>
+void KVCopyString<false>( char*& destBuffer, kvString_t& str )
+{
+	// Copy the string in, null terminate it, and increment the destBuffer
+	memcpy( destBuffer, str.string, str.length );
+	destBuffer[str.length] = '\0';
+	str.string = destBuffer;
+	destBuffer += str.length + 1;
+}
+
+// Copies all of the keys and values out of the input string and copies them all into a massive buffer.
+template<bool useEscapeSequences>
+void KeyValue::BuildData(char*& destBuffer, KeyValueStringTable* strings)
+{
+	KeyValue* current = data.node.children;
+	for (size_t i = 0; i < data.node.childCount; i++)
+	{
+		KVCopyString<useEscapeSequences>(destBuffer, current->key);
+		if (strings)
+			strings->Intern(destBuffer, current->key);
+
+		if (current->isNode)
+		{
+			if (current->data.node.childCount > 0)
+			{
+				current->BuildData<useEscapeSequences>(destBuffer, strings);
+			}
+		}
+		else
+		{
+			KVCopyString<useEscapeSequences>( destBuffer, current->data.leaf.value );
+			if (strings)
+				strings->Intern(destBuffer, current->data.leaf.value);
+		}
+
+		current = current->next;
+	}
+}
+
+// Copies memory and shifts the inputs
+static void CopyAndShift(char*& dest, char* src, size_t& destLength, size_t srcLength)
+{
+	size_t minLength = std::min(destLength, srcLength);
+	memcpy(dest, src, minLength);
+	destLength -= minLength;
+	dest += minLength;
+}
+
+void CopyAndShift(char*& dest, const char* src, size_t& destLength, size_t srcLength)
+{
+	return CopyAndShift(dest, const_cast<char*>(src), destLength, srcLength);
+}
+
+static void TabFill(char*& str, size_t& maxLength, int tabCount)
+{
+	for (int i = 0; i < tabCount; i++)
+	{
+		CopyAndShift(str, TAB_STYLE, maxLength, sizeof(TAB_STYLE) - 1); // - 1 due to null terminator
+	}
+}
+
+static void WriteString(char*& dest, size_t& destLength, kvString_t str, bool useEscapeSequences)
+{
+	if (useEscapeSequences)
+	{
+		char* start = dest;
+		for ( int i = 0; i < str.length && destLength >= 2; i++ )
+		{
+			switch ( str.string[i] )
+			{
+			case '\n': *(dest++) = '\\'; *(dest++) = 'n'; break;
+			case '\t': *(dest++) = '\\'; *(dest++) = 't'; break;
+			case '\v': *(dest++) = '\\'; *(dest++) = 'v'; break;
+			case '\b': *(dest++) = '\\'; *(dest++) = 'b'; break;
+			case '\r': *(dest++) = '\\'; *(dest++) = 'r'; break;
+			case '\f': *(dest++) = '\\'; *(dest++) = 'f'; break;
+			case '\a': *(dest++) = '\\'; *(dest++) = 'a'; break;
+			case '\\': *(dest++) = '\\'; *(dest++) = '\\'; break;
+			case '\?': *(dest++) = '\\'; *(dest++) = '\?'; break;
+			case '\'': *(dest++) = '\\'; *(dest++) = '\''; break;
+			case '\"': *(dest++) = '\\'; *(dest++) = '\"'; break;
+			default: *( dest++ ) = str.string[i]; break;
+			}
+		}
+		destLength -= ( dest - start );
+	}
+	else
+	{
+		CopyAndShift(dest, str.string, destLength, str.length);
+	}
+}
+
+void KeyValue::ToString(char*& str, size_t& maxLength, int tabCount, bool useEscapeSequences) const
+{
+	// Make a solidified version?
+	Materialize();
+
+	for (KeyValue* current = data.node.children; current; current = current->next)
+	{
+
+		TabFill(str, maxLength, tabCount);
+
+		// Copy in the key
+		CopyAndShift(str, "\"", maxLength, 1);
+		WriteString(str, maxLength, current->key, useEscapeSequences);
+		CopyAndShift(str, "\"", maxLength, 1);
+
+		if (current->isNode)
+		{
+			CopyAndShift(str, "\n", maxLength, 1);
+			TabFill(str, maxLength, tabCount);
+			CopyAndShift(str, "{\n", maxLength, 2);
+
+			current->ToString(str, maxLength, tabCount + 1, useEscapeSequences);
+
+			TabFill(str, maxLength, tabCount);
+			CopyAndShift(str, "}\n", maxLength, 2);
+		}
+		else
+		{
+			// Copy in the value
+			CopyAndShift(str, " \"", maxLength, 2);
+			WriteString(str, maxLength, current->data.leaf.value, useEscapeSequences);
+			CopyAndShift(str, "\"\n", maxLength, 2);
+		}
+	}
+}
+
+char* KeyValue::ToString(bool useEscapeSequences) const
+{
+	// Length of all kvs + 1 for the null terminator
+	size_t length = ToStringLength(0, useEscapeSequences) + 1;
+
+	char* str = new char[length];
+	
+	ToString(str, length, useEscapeSequences);
+
+	// Null terminate it
+	str[length - 1] = 0;
+	
+	return str;
+}
+
+static size_t GetStringLength(kvString_t str, bool useEscapeSequences)
+{
+	if (!useEscapeSequences)
+		return str.length;
+
+	int n = 0;
+	for ( int i = 0; i < str.length; i++ )
+	{
+		switch ( str.string[i] )
+		{
+		case '\n':
+		case '\t':
+		case '\v':
+		case '\b':
+		case '\r':
+		case '\f':
+		case '\a':
+		case '\\':
+		case '\?':
+		case '\'':
+		case '\"':
+			n += 2;
+			break;
+		default:
+			n += 1;
+			break;
+		}
+	}
+	return n;
+}
+
+size_t KeyValue::ToStringLength(int tabCount, bool useEscapeSequences) const
+{
+	Materialize();
+
+	size_t len = 0;
+	for (KeyValue* current = data.node.children; current; current = current->next)
+	{
+		len += tabCount * sizeof(TAB_STYLE);
+
+		// String container + Key + String container 
+		len += sizeof(STRING_CONTAINER) + GetStringLength(current->key, useEscapeSequences) + sizeof( STRING_CONTAINER );
+
+		if (current->isNode)
+		{
+			// If we have kids, new line + tabs + start block + new line
+			len += 1 + tabCount * sizeof(TAB_STYLE) + sizeof(BLOCK_BEGIN) + 1;
+
+			len += current->ToStringLength(tabCount + 1, useEscapeSequences);
+
+			// End line + tabs + end block + end line
+			len += 1 + tabCount * sizeof(TAB_STYLE) + sizeof(BLOCK_END) + 1;
+		}
+		else
+		{
+			// If we don't have any children, we just have a value
+
+			// Space + string container + value + string container + new line
+			
+			len += 1 + sizeof(STRING_CONTAINER) + GetStringLength( current->data.leaf.value, useEscapeSequences ) + sizeof(STRING_CONTAINER) + 1;
+
+		}
+	}
+
+	return len;
+}
+
+void KeyValue::MarkDirty()
+{
+	// Nothing to go stale until the first Serialize
+	if (!storage->hasSerialText)
+		return;
+
+	storage->serialChanged = true;
+
+	// Anything already dirty had everything above it marked back when it was. Kvs that weren't around for the last
+	// Serialize have no span, but whatever added them marked their parent
+	KeyValue* current = this;
+	while (current && !current->dirty)
+	{
+		current->dirty = true;
+
+		std::unordered_map<const KeyValue*, KeyValueStorage::SerialSpan>::const_iterator span = storage->serialSpans.find(current);
+		current = span != storage->serialSpans.end() ? span->second.parent : nullptr;
+	}
+}
+
+// Same as WriteString, but onto the end of text
+static void AppendString(std::string& text, kvString_t str, bool useEscapeSequences)
+{
+	// WriteString wants room for a whole escape at any point, so there's one spare byte
+	size_t position = text.size();
+	size_t length = GetStringLength(str, useEscapeSequences) + 1;
+	text.resize(position + length);
+
+	char* dest = &text[position];
+	WriteString(dest, length, str, useEscapeSequences);
+	text.resize(dest - text.data());
+}
+
+static void AppendTabs(std::string& text, int tabCount)
+{
+	for (int i = 0; i < tabCount; i++)
+		text.append(TAB_STYLE, sizeof(TAB_STYLE) - 1);
+}
+
+void KeyValue::SerializeChildren(std::string& text, int tabCount, size_t oldStart, bool useEscapeSequences)
+{
+	Materialize();
+
+	const std::string& oldText = storage->serialText;
+	size_t start = text.size();
+
+	for (KeyValue* current = data.node.children; current; current = current->next)
+	{
+		AppendTabs(text, tabCount);
+		text += STRING_CONTAINER;
+		AppendString(text, current->key, useEscapeSequences);
+		text += STRING_CONTAINER;
+
+		if (!current->isNode)
+		{
+			text.append(" \"", 2);
+			AppendString(text, current->data.leaf.value, useEscapeSequences);
+			text.append("\"\n", 2);
+			continue;
+		}
+
+		text += '\n';
+		AppendTabs(text, tabCount);
+		text.append("{\n", 2);
+
+		// emplace allocates even when the kv is already in there, which is most of the time
+		std::unordered_map<const KeyValue*, KeyValueStorage::SerialSpan>::iterator found = storage->serialSpans.find(current);
+		bool hadSpan = found != storage->serialSpans.end() && oldStart != std::string::npos;
+		if (found == storage->serialSpans.end())
+			found = storage->serialSpans.emplace(current, KeyValueStorage::SerialSpan()).first;
+		KeyValueStorage::SerialSpan& span = found->second;
+
+		size_t childStart = text.size();
+		if (hadSpan && !current->dirty)
+			text.append(oldText, oldStart + span.offset, span.length);
+		else
+			current->SerializeChildren(text, tabCount + 1, hadSpan ? oldStart + span.offset : std::string::npos, useEscapeSequences);
+
+		// Serialize only ever starts at the root, so we're it when there's no tabs
+		span.parent = tabCount > 0 ? this : nullptr;
+		span.offset = childStart - start;
+		span.length = text.size() - childStart;
+		current->dirty = false;
+
+		AppendTabs(text, tabCount);
+		text.append("}\n", 2);
+	}
+}
+
+const std::string& KeyValueRoot::Serialize(bool useEscapeSequences)
+{
+	static const std::string empty;
+	if (!IsValid())
+		return empty;
+
+	// The spans are only good for text made the same way
+	bool reuse = storage->hasSerialText && storage->serialEscapes == useEscapeSequences;
+	if (reuse && !storage->serialChanged)
+		return storage->serialText;
+	if (!reuse)
+		storage->serialSpans.clear();
+
+	std::string text;
+	text.reserve(storage->serialText.size());
+	SerializeChildren(text, 0, reuse ? 0 : std::string::npos, useEscapeSequences);
+
+	storage->serialText.swap(text);
+	storage->hasSerialText = true;
+	storage->serialEscapes = useEscapeSequences;
+	storage->serialChanged = false;
+	dirty = false;
+
+	return storage->serialText;
+}
+
+
+///////////////////////
+// Key Value Merging //
+///////////////////////
+
+// Finds children by key without scanning through all of them. Keys match case insensitively, same as Get.
+// Every kv with the same key is chained together in order. Small nodes fit in the index itself, so only big ones cost an allocation
+class KeyValueKeyIndex
+{
+public:
+	struct Entry
+	{
+		// Links are numbered from 1, so that 0 can mean none
+		uint32_t first;
+		uint32_t last;
+		// The last link NextUnused handed out, and how many it's handed out
+		uint32_t cursor;
+		uint32_t used;
+		// Free for whoever's using the index to count with
+		uint32_t seen;
+		uint32_t hash;
+	};
+
+	// count is the most kvs that will ever be inserted
+	KeyValueKeyIndex(KeyValueAllocator& allocator, size_t count) : allocator(allocator)
+	{
+		capacity = KEY_INDEX_INLINE_SIZE;
+		while (capacity < count * 2)
+			capacity *= 2;
+
+		if (capacity > KEY_INDEX_INLINE_SIZE)
+		{
+			memory = allocator.Allocate(MemorySize(), alignof(Entry));
+			entries = (Entry*)memory;
+			links = (Link*)(entries + capacity);
+		}
+		else
+		{
+			memory = nullptr;
+			entries = inlineEntries;
+			links = inlineLinks;
+		}
+		memset(entries, 0, sizeof(Entry) * capacity);
+	}
+
+	~KeyValueKeyIndex()
+	{
+		if (memory)
+			allocator.Free(memory, MemorySize());
+	}
+
+	// No copying! The entries might be our own
+	KeyValueKeyIndex(const KeyValueKeyIndex&) = delete;
+
+	Entry* Find(const kvString_t& key)
+	{
+		uint32_t hash = Hash(key);
+		for (size_t i = hash & (capacity - 1);; i = (i + 1) & (capacity - 1))
+		{
+			Entry& entry = entries[i];
+			if (!entry.first)
+				return nullptr;
+
+			if (entry.hash == hash && SameKey(First(entry)->Key(), key))
+				return &entry;
+		}
+	}
+
+	void Insert(KeyValue* kv)
+	{
+		links[linkCount] = { kv, 0 };
+		uint32_t link = (uint32_t)++linkCount;
+
+		uint32_t hash = Hash(kv->Key());
+		for (size_t i = hash & (capacity - 1);; i = (i + 1) & (capacity - 1))
+		{
+			Entry& entry = entries[i];
+			if (!entry.first)
+			{
+				entry = { link, link, 0, 0, 0, hash };
+				return;
+			}
+
+			if (entry.hash == hash && SameKey(First(entry)->Key(), kv->Key()))
+			{
+				links[entry.last - 1].next = link;
+				entry.last = link;
+				return;
+			}
+		}
+	}
+
+	KeyValue* First(const Entry& entry) const
+	{
+		return links[entry.first - 1].kv;
+	}
+
+	// The kv that's occurrence kvs after the first with its key, or null if there aren't that many
+	KeyValue* Occurrence(const Entry& entry, size_t occurrence) const
+	{
+		uint32_t link = entry.first;
+		for (; link && occurrence > 0; occurrence--)
+			link = links[link - 1].next;
+		return link ? links[link - 1].kv : nullptr;
+	}
+
+	// Hands out every kv with the entry's key in order, one per call. Null once they've all been handed out
+	KeyValue* NextUnused(Entry& entry)
+	{
+		uint32_t link = entry.cursor ? links[entry.cursor - 1].next : entry.first;
+		if (!link)
+			return nullptr;
+
+		entry.cursor = link;
+		entry.used++;
+		return links[link - 1].kv;
+	}
+
+	static bool SameKey(const kvString_t& a, const kvString_t& b)
+	{
+		return a.length == b.length && strncasecmp(a.string, b.string, a.length) == 0;
+	}
+
+private:
+
+	struct Link
+	{
+		KeyValue* kv;
+		uint32_t next;
+	};
+
+	size_t MemorySize() const
+	{
+		// Half as many links as entries, as the table's never more than half full
+		return sizeof(Entry) * capacity + sizeof(Link) * (capacity / 2);
+	}
+
+	// Folds ASCII to lower case as it goes, so that keys that only differ in case land together
+	static uint32_t Hash(const kvString_t& key)
+	{
+		uint64_t hash = 0xCBF29CE484222325ull;
+		for (size_t i = 0; i < key.length; i++)
+		{
+			unsigned char c = (unsigned char)key.string[i];
+			if ((unsigned)(c - 'A') < 26u)
+				c |= 0x20;
+			hash = (hash ^ c) * 0x100000001B3ull;
+		}
+
+		// Same finisher as the string table, since the low bits pick the slot
+		hash ^= hash >> 33;
+		hash *= 0xFF51AFD7ED558CCDull;
+		hash ^= hash >> 33;
+		hash *= 0xC4CEB9FE1A85EC53ull;
+		hash ^= hash >> 33;
+		return (uint32_t)hash;
+	}
+
+	KeyValueAllocator& allocator;
+	void* memory;
+	Entry* entries;
+	Link* links;
+	size_t capacity;
+	size_t linkCount = 0;
+
+	Entry inlineEntries[KEY_INDEX_INLINE_SIZE];
+	Link inlineLinks[KEY_INDEX_INLINE_SIZE / 2];
+};
+
+// Splits a patch operation like "~2" into its operation and occurrence. Returns false if it isn't one
+static bool ReadPatchOp(const kvString_t& key, char& op, size_t& occurrence)
+{
+	if (key.length == 0)
+		return false;
+
+	op = key.string[0];
+	if (op != PATCH_ADD && op != PATCH_REMOVE && op != PATCH_REPLACE && op != PATCH_EDIT)
+		return false;
+
+	occurrence = 0;
+	for (size_t i = 1; i < key.length; i++)
+	{
+		char c = key.string[i];
+		if (c < '0' || c > '9')
+			return false;
+		occurrence = occurrence * 10 + (c - '0');
+	}
+
+	return true;
+}
+
+KeyValue* KeyValue::AppendChild()
+{
+	MarkDirty();
+
+	KeyValue* kv = storage->writePool.Create();
+	kv->storage = storage;
+	kv->next = nullptr;
+	kv->lazy.store(false, std::memory_order_relaxed);
+	kv->dirty = true;
+
+	if (data.node.childCount == 0)
+		data.node.children = kv;
+	else
+		data.node.lastChild->next = kv;
+	data.node.lastChild = kv;
+	data.node.childCount++;
+
+	return kv;
+}
+
+void KeyValue::CopyFrom(const KeyValue& source)
+{
+	// Tally up first so that every string can be copied into one stretch, and every kv into one array
+	size_t nodeCount = 0, stringBytes = source.key.length + 1;
+	if (source.isNode)
+		source.CountTree(nodeCount, stringBytes);
+	else
+		stringBytes += source.data.leaf.value.length + 1;
+
+	KeyValueStorage* owner = storage;
+	KeyValue* sibling = next;
+	*this = source;
+	storage = owner;
+	next = sibling;
+
+	// Nothing we serialized last time is any good now. Whoever holds us marks the rest of the way up
+	dirty = true;
+
+	char* strings = storage->AllocatePacked(stringBytes);
+	CopyTerminatedString(strings, key);
+
+	if (!isNode)
+		CopyTerminatedString(strings, data.leaf.value);
+	else if (data.node.childCount > 0)
+	{
+		KeyValue* nodes = storage->CreateSolidArray(nodeCount);
+		Flatten<true>(nodes, strings, nullptr);
+	}
+	else
+		data.node = { nullptr, nullptr, 0, 0 };
+}
+
+bool KeyValue::Merge(const KeyValue& overlay, KeyValueMergePolicy policy)
+{
+	// Can't merge into a solid kv or a kv without kids!
+	if (!IsValid() || storage->solidified || !isNode || !overlay.IsValid())
+		return false;
+
+	// A pair has no children to bring in
+	if (overlay.isNode)
+		MergeChildren(overlay, policy);
+
+	return true;
+}
+
+void KeyValue::MergeChildren(const KeyValue& overlay, KeyValueMergePolicy policy)
+{
+	Materialize();
+	MarkDirty();
+
+	// Counted up front, in case the overlay is us and we're about to add to it
+	size_t overlayCount = overlay.ChildCount();
+	const KeyValue* child = overlay.Children();
+
+	if (policy == KeyValueMergePolicy::APPEND)
+	{
+		for (size_t i = 0; i < overlayCount; i++, child = child->next)
+			AppendChild()->CopyFrom(*child);
+		return;
+	}
+
+	KeyValueKeyIndex index(*storage->allocator, data.node.childCount + overlayCount);
+	for (KeyValue* current = data.node.children; current; current = current->next)
+		index.Insert(current);
+
+	for (size_t i = 0; i < overlayCount; i++, child = child->next)
+	{
+		KeyValueKeyIndex::Entry* entry = index.Find(child->key);
+		if (!entry)
+		{
+			// Later children of the overlay with the same key land on this one
+			KeyValue* added = AppendChild();
+			added->CopyFrom(*child);
+			index.Insert(added);
+			continue;
+		}
+
+		KeyValue& existing = *index.First(*entry);
+		if (policy == KeyValueMergePolicy::DEEP && existing.isNode && child->isNode)
+			existing.MergeChildren(*child, policy);
+		else
+			existing.CopyFrom(*child);
+	}
+}
+
+bool KeyValue::ApplyPatch(const KeyValue& patch)
+{
+	// Can't patch a solid kv or a kv without kids!
+	if (!IsValid() || storage->solidified || !isNode || !patch.IsValid() || !patch.isNode)
+		return false;
+
+	return PatchChildren(patch);
+}
+
+bool KeyValue::PatchChildren(const KeyValue& patch)
+{
+	Materialize();
+	MarkDirty();
+
+	KeyValueKeyIndex index(*storage->allocator, data.node.childCount);
+	for (KeyValue* current = data.node.children; current; current = current->next)
+		index.Insert(current);
+
+	// Everything gets aimed before anything changes, so that occurrences count the children from before the patch
+	size_t opCount = patch.ChildCount();
+	std::vector<KeyValue*> targets(opCount, nullptr);
+
+	const KeyValue* op = patch.Children();
+	for (size_t i = 0; i < opCount; i++, op = op->next)
+	{
+		char type;
+		size_t occurrence;
+		if (!ReadPatchOp(op->key, type, occurrence) || type == PATCH_ADD)
+			continue;
+
+		kvString_t key;
+		if (type == PATCH_REMOVE && !op->isNode)
+			key = op->data.leaf.value;
+		else if (type != PATCH_REMOVE && op->ChildCount() == 1)
+			key = op->data.node.children->key;
+		else
+			continue;
+
+		KeyValueKeyIndex::Entry* entry = index.Find(key);
+		if (entry)
+			targets[i] = index.Occurrence(*entry, occurrence);
+	}
+
+	bool applied = true;
+	std::vector<KeyValue*> removed;
+
+	op = patch.Children();
+	for (size_t i = 0; i < opCount; i++, op = op->next)
+	{
+		char type;
+		size_t occurrence;
+		if (!ReadPatchOp(op->key, type, occurrence))
+		{
+			applied = false;
+			continue;
+		}
+
+		KeyValue* target = targets[i];
+		switch (type)
+		{
+		case PATCH_ADD:
+			if (op->ChildCount() == 1)
+				AppendChild()->CopyFrom(*op->data.node.children);
+			else
+				applied = false;
+			break;
+
+		case PATCH_REPLACE:
+			if (target)
+				target->CopyFrom(*op->data.node.children);
+			else
+				applied = false;
+			break;
+
+		case PATCH_EDIT:
+			if (target && target->isNode && op->data.node.children->isNode)
+				applied &= target->PatchChildren(*op->data.node.children);
+			else
+				applied = false;
+			break;
+
+		case PATCH_REMOVE:
+			if (target)
+				removed.push_back(target);
+			else
+				applied = false;
+			break;
+		}
+	}
+
+	// Unlinked all in one go, so that each one doesn't have to hunt down whatever's before it
+	if (!removed.empty())
+	{
+		std::sort(removed.begin(), removed.end());
+
+		KeyValue* previous = nullptr;
+		for (KeyValue* current = data.node.children; current; current = current->next)
+		{
+			if (!std::binary_search(removed.begin(), removed.end(), current))
+			{
+				previous = current;
+				continue;
+			}
+
+			if (previous)
+				previous->next = current->next;
+			else
+				data.node.children = current->next;
+
+			if (data.node.lastChild == current)
+				data.node.lastChild = previous;
+			data.node.childCount--;
+		}
+	}
+
+	return applied;
+}
+
+KeyValueRoot KeyValueRoot::Diff(const KeyValue& from, const KeyValue& to)
+{
+	if (!from.IsValid() || !to.IsValid())
+		return KeyValueRoot();
+
+	KeyValueRoot patch(*to.storage->allocator);
+
+	KeyValue* spare = nullptr;
+	patch.DiffChildren(from, to, spare);
+
+	return patch;
+}
+
+KeyValue* KeyValue::AppendPatchOp(char op, size_t occurrence)
+{
+	char opKey[32];
+	size_t length = 1;
+	opKey[0] = op;
+	if (occurrence > 0)
+		length += snprintf(opKey + 1, sizeof(opKey) - 1, "%zu", occurrence);
+
+	KeyValue* kv = AppendChild();
+	kv->key = { storage->PackString(opKey, length), length };
+	kv->isNode = true;
+	kv->data.node = { nullptr, nullptr, 0, 0 };
+	return kv;
+}
+
+void KeyValue::DiffChildren(const KeyValue& from, const KeyValue& to, KeyValue*& spare)
+{
+	KeyValueKeyIndex index(*storage->allocator, from.ChildCount());
+	for (KeyValue* current = from.Children(); current; current = current->next)
+		index.Insert(current);
+
+	for (KeyValue* child = to.Children(); child; child = child->next)
+	{
+		// Each child of to pairs up with the next unmatched child of from that has the same key
+		KeyValueKeyIndex::Entry* entry = index.Find(child->key);
+		KeyValue* match = entry ? index.NextUnused(*entry) : nullptr;
+
+		if (!match)
+		{
+			AppendPatchOp(PATCH_ADD, 0)->AppendChild()->CopyFrom(*child);
+			continue;
+		}
+
+		size_t occurrence = entry->used - 1;
+		bool sameKey = match->key.length == child->key.length && memcmp(match->key.string, child->key.string, child->key.length) == 0;
+
+		if (sameKey && match->isNode && child->isNode)
+		{
+			// Most nodes don't change, so the edit is worked out on the side and only kept if there's something in it
+			KeyValue* edit = spare;
+			if (edit)
+				spare = edit->next;
+			else
+				edit = storage->writePool.Create();
+
+			edit->storage = storage;
+			edit->next = nullptr;
+			edit->isNode = true;
+			edit->lazy.store(false, std::memory_order_relaxed);
+			edit->dirty = true;
+			edit->data.node = { nullptr, nullptr, 0, 0 };
+			edit->DiffChildren(*match, *child, spare);
+
+			if (edit->data.node.childCount == 0)
+			{
+				edit->next = spare;
+				spare = edit;
+				continue;
+			}
+
+			edit->key = { storage->PackString(child->key.string, child->key.length), child->key.length };
+
+			KeyValue* op = AppendPatchOp(PATCH_EDIT, occurrence);
+			op->data.node = { edit, edit, 1, 0 };
+		}
+		else if (!sameKey || match->isNode != child->isNode
+			|| match->data.leaf.value.length != child->data.leaf.value.length
+			|| memcmp(match->data.leaf.value.string, child->data.leaf.value.string, child->data.leaf.value.length) != 0)
+		{
+			AppendPatchOp(PATCH_REPLACE, occurrence)->AppendChild()->CopyFrom(*child);
+		}
+	}
+
+	// Whatever nothing matched up with is gone. Matches were made in order, so the leftovers are the occurrences after them
+	for (KeyValue* current = from.Children(); current; current = current->next)
+	{
+		KeyValueKeyIndex::Entry* entry = index.Find(current->key);
+		size_t occurrence = entry->seen++;
+		if (occurrence < entry->used)
+			continue;
+
+		KeyValue* op = AppendPatchOp(PATCH_REMOVE, occurrence);
+		op->isNode = false;
+		op->data.leaf.value = { storage->PackString(current->key.string, current->key.length), current->key.length };
+	}
+}
+
+
+///////////////////////
+// Key Value Queries //
+///////////////////////
+
+// Reads a name or value out of a path. Stops on any of stops, unless it's quoted
+static bool ReadQueryString(const char*& str, const char* stops, std::string& out)
+{
+	out.clear();
+
+	if (*str == STRING_CONTAINER)
+	{
+		for (str++; *str != STRING_CONTAINER; str++)
+		{
+			if (*str == ESCAPE_CHAR && str[1])
+				str++;
+			if (*str == '\0')
+				return false;
+			out += *str;
+		}
+		str++;
+		return true;
+	}
+
+	for (; *str && !strchr(stops, *str); str++)
+		out += *str;
+	return true;
+}
+
+KeyValueQuery::KeyValueQuery(const char* path)
+{
+	AddPath(path);
+}
+
+bool KeyValueQuery::AddPath(const char* path)
+{
+	if (!path || !*path)
+		return false;
+
+	// Built on the side so that nothing gets added if the path turns out to be bad
+	std::vector<Step> parsed;
+	const char* c = path;
+
+	for (;;)
+	{
+		Step step;
+		step.path = pathCount;
+
+		if (c[0] == '*' && c[1] == '*')
+		{
+			step.type = StepType::DESCENDANTS;
+			c += 2;
+
+			// It's already matching everything, so there's nothing to test
+			if (*c != PATH_SEPARATOR && *c != '\0')
+				return false;
+		}
+		else if (c[0] == '*')
+		{
+			step.type = StepType::ANY;
+			c++;
+		}
+		else
+		{
+			step.type = StepType::NAME;
+			if (!ReadQueryString(c, "/[", step.name) || step.name.empty())
+				return false;
+		}
+
+		while (*c == '[')
+		{
+			c++;
+
+			Predicate predicate;
+			if (!ReadQueryString(c, "=!<>]", predicate.key))
+				return false;
+
+			// Two character operators go first, so that <= isn't read as <
+			static const struct { const char* text; Comparison comparison; } operators[] =
+			{
+				{ "]",  Comparison::EXISTS },
+				{ "!=", Comparison::NOT_EQUAL },
+				{ "<=", Comparison::LESS_EQUAL },
+				{ ">=", Comparison::GREATER_EQUAL },
+				{ "=",  Comparison::EQUAL },
+				{ "<",  Comparison::LESS },
+				{ ">",  Comparison::GREATER },
+			};
+
+			size_t op = 0;
+			size_t opCount = sizeof(operators) / sizeof(operators[0]);
+			while (op < opCount && strncmp(c, operators[op].text, strlen(operators[op].text)) != 0)
+				op++;
+			if (op == opCount)
+				return false;
+
+			predicate.comparison = operators[op].comparison;
+
+			if (predicate.comparison == Comparison::EXISTS)
+			{
+				if (predicate.key.empty())
+					return false;
+			}
+			else
+			{
+				c += strlen(operators[op].text);
+				if (!ReadQueryString(c, "]", predicate.value))
+					return false;
+			}
+
+			if (*c != ']')
+				return false;
+			c++;
+
+			predicate.number = 0;
+			if (predicate.comparison >= Comparison::LESS)
+			{
+				char* end;
+				predicate.number = strtod(predicate.value.c_str(), &end);
+				if (predicate.value.empty() || *end != '\0')
+					return false;
+			}
+
+			step.predicates.push_back(predicate);
+		}
+
+		parsed.push_back(step);
+
+		if (*c == '\0')
+			break;
+		if (*c != PATH_SEPARATOR)
+			return false;
+		c++;
+	}
+
+	Step match;
+	match.type = StepType::MATCH;
+	match.path = pathCount;
+	parsed.push_back(match);
+
+	starts.push_back(steps.size());
+	steps.insert(steps.end(), parsed.begin(), parsed.end());
+	pathCount++;
+	return true;
+}
+
+bool KeyValueQuery::Test(const Predicate& predicate, const KeyValue& kv)
+{
+	const KeyValue* tested = &kv;
+	if (!predicate.key.empty())
+	{
+		tested = &kv.Get(predicate.key.c_str());
+		if (!tested->IsValid())
+			return false;
+		if (predicate.comparison == Comparison::EXISTS)
+			return true;
+	}
+
+	// Nodes have no value to compare against
+	if (tested->HasChildren())
+		return false;
+
+	kvString_t value = tested->Value();
+	switch (predicate.comparison)
+	{
+	case Comparison::EQUAL:
+		return value.length == predicate.value.size() && memcmp(value.string, predicate.value.data(), value.length) == 0;
+	case Comparison::NOT_EQUAL:
+		return value.length != predicate.value.size() || memcmp(value.string, predicate.value.data(), value.length) != 0;
+	default:
+		break;
+	}
+
+	// Only values that are a number and nothing else get compared. Trailing whitespace is all that's let through
+	char* end;
+	double number = strtod(value.string, &end);
+	if (end == value.string)
+		return false;
+	while (isspace((unsigned char)*end))
+		end++;
+	if (*end != '\0')
+		return false;
+
+	switch (predicate.comparison)
+	{
+	case Comparison::LESS:          return number < predicate.number;
+	case Comparison::LESS_EQUAL:    return number <= predicate.number;
+	case Comparison::GREATER:       return number > predicate.number;
+	case Comparison::GREATER_EQUAL: return number >= predicate.number;
+	default:                        return false;
+	}
+}
+
+// Everything one Run needs as it goes. Each level of the walk has the set of steps its kvs have reached
+struct KeyValueQuery::Walk
+{
+	// Which steps are in the set being built. A step is in it if its mark is the current stamp
+	std::vector<size_t> marks;
+	size_t stamp = 0;
+
+	std::vector<std::vector<uint32_t>> levels;
+
+	std::vector<std::vector<KeyValue*>>* perPath = nullptr;
+	std::vector<KeyValue*>* combined = nullptr;
+
+	void Reach(std::vector<uint32_t>& states, uint32_t step)
+	{
+		if (marks[step] == stamp)
+			return;
+		marks[step] = stamp;
+		states.push_back(step);
+	}
+
+	// ** can also match no levels at all, so whatever's after it is reached wherever it is
+	void Close(std::vector<uint32_t>& states, const std::vector<Step>& steps)
+	{
+		for (size_t i = 0; i < states.size(); i++)
+		{
+			if (steps[states[i]].type == StepType::DESCENDANTS)
+				Reach(states, states[i] + 1);
+		}
+	}
+
+	// Every path starts at the kv the query's run on
+	void Begin(const KeyValueQuery& query)
+	{
+		marks.resize(query.steps.size(), 0);
+		levels.resize(1);
+
+		stamp++;
+		for (size_t start : query.starts)
+			Reach(levels[0], (uint32_t)start);
+		Close(levels[0], query.steps);
+	}
+};
+
+void KeyValueQuery::WalkChildren(const KeyValue& node, size_t depth, Walk& walk) const
+{
+	if (walk.levels.size() <= depth + 1)
+		walk.levels.resize(depth + 2);
+
+	for (const KeyValue* child = node.Children(); child; child = child->Next())
+	{
+		// Indexed every time, since walking the children below can grow levels out from under us
+		const std::vector<uint32_t>& states = walk.levels[depth];
+		std::vector<uint32_t>& next = walk.levels[depth + 1];
+		next.clear();
+		walk.stamp++;
+
+		const kvString_t& key = child->Key();
+		for (uint32_t state : states)
+		{
+			const Step& step = steps[state];
+			switch (step.type)
+			{
+			case StepType::DESCENDANTS:
+				// ** can eat this level and keep going
+				walk.Reach(next, state);
+				continue;
+			case StepType::NAME:
+				if (key.length != step.name.size() || strncasecmp(key.string, step.name.data(), key.length) != 0)
+					continue;
+				break;
+			case StepType::ANY:
+				break;
+			case StepType::MATCH:
+				continue;
+			}
+
+			bool passed = true;
+			for (const Predicate& predicate : step.predicates)
+			{
+				if (!Test(predicate, *child))
+				{
+					passed = false;
+					break;
+				}
+			}
+
+			if (passed)
+				walk.Reach(next, state + 1);
+		}
+
+		if (next.empty())
+			continue;
+
+		walk.Close(next, steps);
+
+		bool matched = false, goesDeeper = false;
+		for (uint32_t state : next)
+		{
+			if (steps[state].type != StepType::MATCH)
+			{
+				goesDeeper = true;
+				continue;
+			}
+
+			matched = true;
+			if (walk.perPath)
+				(*walk.perPath)[steps[state].path].push_back(const_cast<KeyValue*>(child));
+		}
+
+		if (matched && walk.combined)
+			walk.combined->push_back(const_cast<KeyValue*>(child));
+
+		if (goesDeeper && child->HasChildren())
+			WalkChildren(*child, depth + 1, walk);
+	}
+}
+
+std::vector<KeyValue*> KeyValueQuery::Run(const KeyValue& root) const
+{
+	std::vector<KeyValue*> results;
+	if (pathCount == 0 || !root.IsValid())
+		return results;
+
+	Walk walk;
+	walk.combined = &results;
+	walk.Begin(*this);
+	WalkChildren(root, 0, walk);
+	return results;
+}
+
+void KeyValueQuery::Run(const KeyValue& root, std::vector<std::vector<KeyValue*>>& results) const
+{
+	results.assign(pathCount, std::vector<KeyValue*>());
+	if (pathCount == 0 || !root.IsValid())
+		return;
+
+	Walk walk;
+	walk.perPath = &results;
+	walk.Begin(*this);
+	WalkChildren(root, 0, walk);
+}
+
+
+//////////////////////////
+// Key Value Extraction //
+//////////////////////////
+
+// Powers of ten that doubles hold exactly
+static const double exactPowersOfTen[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+// Reads all of str as a number. Plain decimals like "-12.5" are worked out here, and anything fancier goes to strtod
+static bool ParseNumber(const kvString_t& str, double& number)
+{
+	const char* c = str.string;
+	const char* end = c + str.length;
+
+	bool negative = c < end && *c == '-';
+	if (c < end && (*c == '-' || *c == '+'))
+		c++;
+
+	uint64_t mantissa = 0;
+	size_t digits = 0, fractionDigits = 0;
+	for (; c < end && *c >= '0' && *c <= '9'; c++, digits++)
+		mantissa = mantissa * 10 + (*c - '0');
+	if (c < end && *c == '.')
+	{
+		for (c++; c < end && *c >= '0' && *c <= '9'; c++, digits++, fractionDigits++)
+			mantissa = mantissa * 10 + (*c - '0');
+	}
+
+	// Up to 15 digits fit in a double exactly, and so does the power of ten, so the one division rounds the same as strtod would
+	if (c == end && digits > 0 && digits <= 15)
+	{
+		number = (double)mantissa / exactPowersOfTen[fractionDigits];
+		if (negative)
+			number = -number;
+		return true;
+	}
+
+	if (str.length == 0)
+		return false;
+
+	char* stop;
+	number = strtod(str.string, &stop);
+	return stop == end;
+}
+
+// Reads all of str as a whole number that fits in a long long
+static bool ParseInteger(const kvString_t& str, long long& integer)
+{
+	const char* c = str.string;
+	const char* end = c + str.length;
+
+	bool negative = c < end && *c == '-';
+	if (c < end && (*c == '-' || *c == '+'))
+		c++;
+
+	uint64_t magnitude = 0;
+	size_t digits = 0;
+	for (; c < end && *c >= '0' && *c <= '9'; c++, digits++)
+		magnitude = magnitude * 10 + (*c - '0');
+
+	if (c != end || digits == 0)
+		return false;
+
+	// 18 digits can't overflow. Past that, strtoll can work out whether it did
+	if (digits <= 18)
+	{
+		integer = negative ? -(long long)magnitude : (long long)magnitude;
+		return true;
+	}
+
+	char* stop;
+	errno = 0;
+	integer = strtoll(str.string, &stop, 10);
+	return stop == end && errno == 0;
+}
+
+size_t KeyValueColumn::ValidCount() const
+{
+	size_t count = 0;
+	for (uint64_t word : valid)
+		count += PopCount(word);
+	return count;
+}
+
+size_t KeyValueExtractor::AddColumn(const char* path, KeyValueColumnType type)
+{
+	size_t segment = 0;
+	while (path && *path)
+	{
+		const char* separator = strchr(path, PATH_SEPARATOR);
+		size_t length = separator ? separator - path : strlen(path);
+
+		size_t next = 0;
+		for (size_t child : segments[segment].children)
+		{
+			const std::string& key = segments[child].key;
+			if (key.size() == length && strncasecmp(key.c_str(), path, length) == 0)
+			{
+				next = child;
+				break;
+			}
+		}
+
+		if (!next)
+		{
+			next = segments.size();
+			segments[segment].children.push_back(next);
+			segments.emplace_back();
+			segments[next].key.assign(path, length);
+		}
+
+		segment = next;
+		path = separator ? separator + 1 : path + length;
+	}
+
+	segments[segment].columns.push_back(types.size());
+	types.push_back(type);
+	return types.size() - 1;
+}
+
+void KeyValueExtractor::Run(const std::vector<const KeyValue*>& roots, KeyValueColumns& columns, size_t threadCount) const
+{
+	size_t rows = roots.size();
+	size_t words = (rows + 63) / 64;
+
+	// Columns left over from the last run keep their memory
+	columns.rows = rows;
+	columns.columns.resize(types.size());
+	for (size_t i = 0; i < types.size(); i++)
+	{
+		KeyValueColumn& column = columns.columns[i];
+		column.type = types[i];
+		column.valid.assign(words, 0);
+		column.numbers.assign(column.type == KeyValueColumnType::NUMBER ? rows : 0, 0.0);
+		column.integers.assign(column.type == KeyValueColumnType::INTEGER ? rows : 0, 0);
+		column.strings.assign(column.type == KeyValueColumnType::STRING ? rows : 0, kvString_t());
+	}
+
+	if (threadCount == 0)
+		threadCount = std::thread::hardware_concurrency();
+	threadCount = std::min(threadCount, (rows + EXTRACT_ROWS_PER_THREAD - 1) / EXTRACT_ROWS_PER_THREAD);
+	if (threadCount == 0)
+		threadCount = 1;
+
+	// Rows get handed out 64 at a time, one bitmap word each, so that no two threads ever write to the same word
+	std::atomic<size_t> nextWord(0);
+	auto work = [&]()
+	{
+		for (;;)
+		{
+			size_t word = nextWord.fetch_add(1, std::memory_order_relaxed);
+			if (word >= words)
+				break;
+
+			size_t end = std::min(rows, (word + 1) * 64);
+			for (size_t row = word * 64; row < end; row++)
+			{
+				if (roots[row] && roots[row]->IsValid())
+					ExtractChildren(*roots[row], segments[0], row, columns);
+			}
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < threadCount; i++)
+		threads.emplace_back(work);
+	work();
+	for (std::thread& thread : threads)
+		thread.join();
+}
+
+void KeyValueExtractor::ExtractChildren(const KeyValue& node, const Segment& segment, size_t row, KeyValueColumns& columns) const
+{
+	node.Materialize();
+	if (!node.isNode || node.data.node.childCount == 0)
+		return;
+
+	const std::vector<size_t>& wanted = segment.children;
+	const KeyValue* children = node.data.node.children;
+
+	if (node.storage->solidified && node.storage->sortedKeys && node.data.node.sortedOffset)
+	{
+		// Same binary search as Get
+		size_t cc = node.data.node.childCount;
+		const unsigned int* sorted = children->storage->sortedIndices + node.data.node.sortedOffset;
+		for (size_t want : wanted)
+		{
+			const char* key = segments[want].key.c_str();
+			const unsigned int* found = std::lower_bound(sorted, sorted + cc, key, [children](unsigned int i, const char* name)
+			{
+				return strcasecmp(children[i].key.string, name) < 0;
+			});
+
+			if (found != sorted + cc && strcasecmp(children[*found].key.string, key) == 0)
+				Fill(children[*found], segments[want], row, columns);
+		}
+		return;
+	}
+
+	// Looks for up to 64 keys per walk over the children, which is almost always all of them.
+	// Like Get, the first child with a key is the one that counts
+	for (size_t base = 0; base < wanted.size(); base += 64)
+	{
+		size_t count = std::min(wanted.size() - base, (size_t)64);
+		uint64_t remaining = count == 64 ? ~0ull : (1ull << count) - 1;
+
+		for (const KeyValue* child = children; child && remaining; child = child->next)
+		{
+			for (uint64_t bits = remaining; bits; bits &= bits - 1)
+			{
+				size_t i = CountTrailingZeros(bits);
+				const Segment& want = segments[wanted[base + i]];
+				if (want.key.size() == child->key.length && strncasecmp(want.key.c_str(), child->key.string, child->key.length) == 0)
+				{
+					remaining &= ~(1ull << i);
+					Fill(*child, want, row, columns);
+					break;
+				}
+			}
+		}
+	}
+}
+
+void KeyValueExtractor::Fill(const KeyValue& kv, const Segment& segment, size_t row, KeyValueColumns& columns) const
+{
+	if (kv.isNode)
+	{
+		if (!segment.children.empty())
+			ExtractChildren(kv, segment, row, columns);
+		return;
+	}
+
+	for (size_t index : segment.columns)
+	{
+		KeyValueColumn& column = columns.columns[index];
+		const kvString_t& value = kv.data.leaf.value;
+
+		bool valid = true;
+		switch (column.type)
+		{
+		case KeyValueColumnType::NUMBER:
+			valid = ParseNumber(value, column.numbers[row]);
+			if (!valid)
+				column.numbers[row] = 0.0;
+			break;
+		case KeyValueColumnType::INTEGER:
+			valid = ParseInteger(value, column.integers[row]);
+			if (!valid)
+				column.integers[row] = 0;
+			break;
+		case KeyValueColumnType::STRING:
+			column.strings[row] = value;
+			break;
+		}
+
+		if (valid)
+			column.valid[row >> 6] |= 1ull << (row & 63);
+	}
+}
+
+
+////////////////////
+// Key Value JSON //
+////////////////////
+
+// Collects output into one buffer, and hands it to the writer whenever it fills up
+class KeyValueOutput
+{
+public:
+	KeyValueOutput(KeyValueWriter& writer, size_t size) : writer(writer)
+	{
+		this->size = size < JSON_MIN_BUFFER_SIZE ? JSON_MIN_BUFFER_SIZE : size;
+		buffer = new char[this->size];
+	}
+
+	~KeyValueOutput()
+	{
+		delete[] buffer;
+	}
+
+	// No copying! We own the buffer
+	KeyValueOutput(const KeyValueOutput&) = delete;
+
+	inline void Put(char c)
+	{
+		if (used == size)
+			Flush();
+		buffer[used++] = c;
+	}
+
+	void Put(const char* str, size_t length)
+	{
+		while (length > 0)
+		{
+			if (used == size)
+				Flush();
+
+			size_t count = std::min(size - used, length);
+			memcpy(buffer + used, str, count);
+			used += count;
+			str += count;
+			length -= count;
+		}
+	}
+
+	void Flush()
+	{
+		// Once the writer's said no, everything else just gets dropped
+		if (used > 0 && !failed)
+			failed = !writer.Write(buffer, used);
+		used = 0;
+	}
+
+	bool failed = false;
+
+private:
+	KeyValueWriter& writer;
+	char* buffer;
+	size_t size;
+	size_t used = 0;
+};
+
+enum class KeyValueToken
+{
+	STRING,
+	OPEN,
+	CLOSE,
+	END,
+};
+
+// Reads a key or value the same way Parse does, and says what it was
+template<bool useEscapeSequences>
+static KeyValueErrorCode ReadKeyValueToken(const char*& str, kvString_t& string, KeyValueToken& token)
+{
+	SkipWhitespace(str);
+
+	switch (*str)
+	{
+	case STRING_CONTAINER:
+		token = KeyValueToken::STRING;
+		return ReadQuotedString<useEscapeSequences>(str, string);
+
+	case BLOCK_BEGIN:
+		str++;
+		token = KeyValueToken::OPEN;
+		return KeyValueErrorCode::NONE;
+
+	case BLOCK_END:
+		str++;
+		token = KeyValueToken::CLOSE;
+		return KeyValueErrorCode::NONE;
+
+	case '\0':
+		token = KeyValueToken::END;
+		return KeyValueErrorCode::NONE;
+
+#if ALLOW_QUOTELESS_STRINGS
+	default:
+		token = KeyValueToken::STRING;
+		string = ReadQuotelessString(str);
+		return KeyValueErrorCode::NONE;
+#else
+	default:
+		return KeyValueErrorCode::INCOMPLETE_PAIR;
+#endif
+	}
+}
+
+// The character a kv escape sequence stands for. Same table as KVCopyString
+static char KvUnescape(char c)
+{
+	switch (c)
+	{
+	case 'n': return '\n';
+	case 't': return '\t';
+	case 'v': return '\v';
+	case 'b': return '\b';
+	case 'r': return '\r';
+	case 'f': return '\f';
+	case 'a': return '\a';
+	default:  return c;
+	}
+}
+
+// Streams one document into the other. ToJson and FromJson each get a fresh one
+class KeyValueJsonTranscoder
+{
+public:
+	KeyValueJsonTranscoder(KeyValueWriter& writer, const KeyValueJsonOptions& options) :
+		output(writer, options.bufferSize), options(options) {}
+
+	template<bool useEscapeSequences>
+	KeyValueErrorCode ToJson(const char* str)
+	{
+		KeyValueErrorCode err = KeyValueErrorCode::NONE;
+		if (options.duplicates == KeyValueJsonDuplicates::ARRAYS)
+		{
+			const char* scan = str;
+			err = FindDuplicates<useEscapeSequences>(scan, true, 0);
+		}
+
+		if (err == KeyValueErrorCode::NONE)
+			err = WriteBlock<useEscapeSequences>(str, true);
+
+		output.Flush();
+		if (err == KeyValueErrorCode::NONE && output.failed)
+			err = KeyValueErrorCode::WRITE_FAILED;
+		return err;
+	}
+
+	template<bool useEscapeSequences>
+	KeyValueErrorCode FromJson(const char* str)
+	{
+		SkipJsonWhitespace(str);
+
+		KeyValueErrorCode err;
+		if (*str == '{')
+			err = ReadObject<useEscapeSequences>(++str, 0);
+		else if (*str == '[' && options.duplicates == KeyValueJsonDuplicates::ORDERED_PAIRS)
+			err = ReadPairs<useEscapeSequences>(++str, 0);
+		else
+			err = KeyValueErrorCode::INVALID_JSON;
+
+		if (err == KeyValueErrorCode::NONE)
+		{
+			SkipJsonWhitespace(str);
+			if (*str != '\0')
+				err = KeyValueErrorCode::INVALID_JSON;
+		}
+
+		output.Flush();
+		if (err == KeyValueErrorCode::NONE && unwritableString)
+			err = KeyValueErrorCode::NEEDS_ESCAPE_SEQUENCES;
+		if (err == KeyValueErrorCode::NONE && output.failed)
+			err = KeyValueErrorCode::WRITE_FAILED;
+		return err;
+	}
+
+private:
+
+	// Writes a kv string out as a JSON string, runs of plain characters at a time
+	template<bool useEscapeSequences>
+	void WriteJsonString(const kvString_t& str)
+	{
+		output.Put('"');
+
+		const char* run = str.string;
+		const char* end = str.string + str.length;
+		for (const char* c = str.string; c < end; c++)
+		{
+			unsigned char ch = (unsigned char)*c;
+			if (ch >= 0x20 && ch != '"' && ch != '\\')
+				continue;
+
+			output.Put(run, c - run);
+
+			if (useEscapeSequences && ch == ESCAPE_CHAR && c + 1 < end)
+				ch = (unsigned char)KvUnescape(*++c);
+			WriteJsonChar(ch);
+
+			run = c + 1;
+		}
+		output.Put(run, end - run);
+
+		output.Put('"');
+	}
+
+	void WriteJsonChar(unsigned char c)
+	{
+		switch (c)
+		{
+		case '"':  output.Put("\\\"", 2); return;
+		case '\\': output.Put("\\\\", 2); return;
+		case '\n': output.Put("\\n", 2); return;
+		case '\t': output.Put("\\t", 2); return;
+		case '\r': output.Put("\\r", 2); return;
+		case '\b': output.Put("\\b", 2); return;
+		case '\f': output.Put("\\f", 2); return;
+		}
+
+		if (c >= 0x20)
+		{
+			output.Put((char)c);
+			return;
+		}
+
+		char escaped[7];
+		snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+		output.Put(escaped, 6);
+	}
+
+	template<bool useEscapeSequences>
+	KeyValueErrorCode WriteValue(const char*& str)
+	{
+		kvString_t value;
+		KeyValueToken token;
+		KeyValueErrorCode err = ReadKeyValueToken<useEscapeSequences>(str, value, token);
+		if (err != KeyValueErrorCode::NONE)
+			return err;
+
+		switch (token)
+		{
+		case KeyValueToken::STRING:
+			WriteJsonString<useEscapeSequences>(value);
+			return KeyValueErrorCode::NONE;
+		case KeyValueToken::OPEN:
+			return WriteBlock<useEscapeSequences>(str, false);
+		case KeyValueToken::CLOSE:
+			return KeyValueErrorCode::UNEXPECTED_END_OF_BLOCK;
+		default:
+			return KeyValueErrorCode::INCOMPLETE_PAIR;
+		}
+	}
+
+	// str is just after the {, or at the start of the document for the root
+	template<bool useEscapeSequences>
+	KeyValueErrorCode WriteBlock(const char*& str, bool isRoot)
+	{
+		bool pairs = options.duplicates == KeyValueJsonDuplicates::ORDERED_PAIRS;
+		bool grouped = !duplicateBlocks.empty() && duplicateBlocks.count(str) > 0;
+
+		output.Put(pairs ? '[' : '{');
+
+		bool first = true;
+		for (;;)
+		{
+			SkipWhitespace(str);
+			const char* keyStart = str;
+
+			kvString_t key;
+			KeyValueToken token;
+			KeyValueErrorCode err = ReadKeyValueToken<useEscapeSequences>(str, key, token);
+			if (err != KeyValueErrorCode::NONE)
+				return err;
+
+			if (token == KeyValueToken::END)
+			{
+				if (!isRoot)
+					return KeyValueErrorCode::INCOMPLETE_BLOCK;
+				break;
+			}
+			if (token == KeyValueToken::CLOSE)
+			{
+				if (isRoot)
+					return KeyValueErrorCode::UNEXPECTED_END_OF_BLOCK;
+				break;
+			}
+			if (token == KeyValueToken::OPEN)
+				return KeyValueErrorCode::UNEXPECTED_START_OF_BLOCK;
+
+			const Duplicate* duplicate = nullptr;
+			if (grouped)
+			{
+				std::unordered_map<const char*, Duplicate>::const_iterator found = duplicates.find(keyStart);
+				if (found != duplicates.end())
+					duplicate = &found->second;
+			}
+
+			// Later duplicates were already written out along with the first one
+			if (duplicate && duplicate->later)
+			{
+				str = duplicate->end;
+				continue;
+			}
+
+			if (!first)
+				output.Put(',');
+			first = false;
+
+			if (pairs)
+				output.Put('[');
+
+			WriteJsonString<useEscapeSequences>(key);
+			output.Put(pairs ? ',' : ':');
+
+			if (duplicate)
+			{
+				output.Put('[');
+				err = WriteValue<useEscapeSequences>(str);
+
+				// Jump ahead to each of the others. WriteBlock skips straight past them when it gets there
+				for (const char* next = duplicate->next; next && err == KeyValueErrorCode::NONE; next = duplicates[next].next)
+				{
+					const char* other = next;
+					err = ReadKeyValueToken<useEscapeSequences>(other, key, token);
+					if (err == KeyValueErrorCode::NONE)
+					{
+						output.Put(',');
+						err = WriteValue<useEscapeSequences>(other);
+					}
+				}
+				output.Put(']');
+			}
+			else
+				err = WriteValue<useEscapeSequences>(str);
+
+			if (err != KeyValueErrorCode::NONE)
+				return err;
+
+			if (pairs)
+				output.Put(']');
+		}
+
+		output.Put(pairs ? ']' : '}');
+		return KeyValueErrorCode::NONE;
+	}
+
+	// Keys seen so far in one block. There's one of these per depth, reused by every block at that depth
+	class KeyTable
+	{
+	public:
+		// Forgets everything without having to clear anything out
+		void Begin()
+		{
+			generation++;
+			count = 0;
+			if (entries.empty())
+				entries.resize(JSON_MIN_KEY_TABLE_SIZE);
+		}
+
+		// Returns where the last kv with key was, and remembers that it's at position now. Null if it's new
+		const char* Swap(const kvString_t& key, const char* position)
+		{
+			uint32_t hash = KeyValueStringTable::Hash(key.string, key.length);
+			size_t mask = entries.size() - 1;
+			for (size_t i = hash & mask;; i = (i + 1) & mask)
+			{
+				Entry& entry = entries[i];
+				if (entry.generation != generation)
+				{
+					entry = { key, position, hash, generation };
+					if (++count * 2 > entries.size())
+						Grow();
+					return nullptr;
+				}
+
+				if (entry.hash == hash && entry.key.length == key.length && memcmp(entry.key.string, key.string, key.length) == 0)
+				{
+					const char* last = entry.last;
+					entry.last = position;
+					return last;
+				}
+			}
+		}
+
+	private:
+		struct Entry
+		{
+			kvString_t key;
+			const char* last;
+			uint32_t hash;
+			size_t generation;
+		};
+
+		void Grow()
+		{
+			std::vector<Entry> old;
+			old.swap(entries);
+			entries.resize(old.size() * 2);
+
+			size_t mask = entries.size() - 1;
+			for (const Entry& entry : old)
+			{
+				if (entry.generation != generation)
+					continue;
+
+				size_t i = entry.hash & mask;
+				while (entries[i].generation == generation)
+					i = (i + 1) & mask;
+				entries[i] = entry;
+			}
+		}
+
+		std::vector<Entry> entries;
+		size_t generation = 0;
+		size_t count = 0;
+	};
+
+	// The pass ARRAYS needs before anything's written. Chains every duplicated key to the next one with the same key
+	template<bool useEscapeSequences>
+	KeyValueErrorCode FindDuplicates(const char*& str, bool isRoot, size_t depth)
+	{
+		const char* blockStart = str;
+		if (keyTables.size() <= depth)
+			keyTables.resize(depth + 1);
+		keyTables[depth].Begin();
+
+		for (;;)
+		{
+			SkipWhitespace(str);
+			const char* keyStart = str;
+
+			kvString_t key;
+			KeyValueToken token;
+			KeyValueErrorCode err = ReadKeyValueToken<useEscapeSequences>(str, key, token);
+			if (err != KeyValueErrorCode::NONE)
+				return err;
+
+			if (token == KeyValueToken::END)
+			{
+				if (!isRoot)
+					return KeyValueErrorCode::INCOMPLETE_BLOCK;
+				break;
+			}
+			if (token == KeyValueToken::CLOSE)
+			{
+				if (isRoot)
+					return KeyValueErrorCode::UNEXPECTED_END_OF_BLOCK;
+				break;
+			}
+			if (token == KeyValueToken::OPEN)
+				return KeyValueErrorCode::UNEXPECTED_START_OF_BLOCK;
+
+			kvString_t value;
+			err = ReadKeyValueToken<useEscapeSequences>(str, value, token);
+			if (err != KeyValueErrorCode::NONE)
+				return err;
+
+			if (token == KeyValueToken::OPEN)
+				err = FindDuplicates<useEscapeSequences>(str, false, depth + 1);
+			else if (token == KeyValueToken::CLOSE)
+				err = KeyValueErrorCode::UNEXPECTED_END_OF_BLOCK;
+			else if (token == KeyValueToken::END)
+				err = KeyValueErrorCode::INCOMPLETE_PAIR;
+			if (err != KeyValueErrorCode::NONE)
+				return err;
+
+			// The tables can move while the block below is read, so this one's looked up again afterwards
+			const char* previous = keyTables[depth].Swap(key, keyStart);
+			if (previous)
+			{
+				duplicates[previous].next = keyStart;
+				duplicates[keyStart] = { nullptr, str, true };
+				duplicateBlocks.insert(blockStart);
+			}
+		}
+
+		return KeyValueErrorCode::NONE;
+	}
+
+	// JSON to kv from here on down
+
+	static void SkipJsonWhitespace(const char*& str)
+	{
+		while (*str == ' ' || *str == '\t' || *str == '\n' || *str == '\r')
+			str++;
+	}
+
+	static int HexDigit(char c)
+	{
+		if (c >= '0' && c <= '9')
+			return c - '0';
+		if (c >= 'a' && c <= 'f')
+			return c - 'a' + 10;
+		if (c >= 'A' && c <= 'F')
+			return c - 'A' + 10;
+		return -1;
+	}
+
+	static bool ReadHex4(const char*& str, uint32_t& value)
+	{
+		value = 0;
+		for (int i = 0; i < 4; i++)
+		{
+			int digit = HexDigit(*str++);
+			if (digit < 0)
+				return false;
+			value = value << 4 | (uint32_t)digit;
+		}
+		return true;
+	}
+
+	static void AppendUtf8(std::string& out, uint32_t code)
+	{
+		if (code < 0x80)
+			out += (char)code;
+		else if (code < 0x800)
+		{
+			out += (char)(0xC0 | code >> 6);
+			out += (char)(0x80 | (code & 0x3F));
+		}
+		else if (code < 0x10000)
+		{
+			out += (char)(0xE0 | code >> 12);
+			out += (char)(0x80 | (code >> 6 & 0x3F));
+			out += (char)(0x80 | (code & 0x3F));
+		}
+		else
+		{
+			out += (char)(0xF0 | code >> 18);
+			out += (char)(0x80 | (code >> 12 & 0x3F));
+			out += (char)(0x80 | (code >> 6 & 0x3F));
+			out += (char)(0x80 | (code & 0x3F));
+		}
+	}
+
+	// str must be on the opening quote, and ends up after the closing one. out points right into the JSON unless the string
+	// had escapes in it, in which case it's decoded into scratch
+	static KeyValueErrorCode ReadJsonString(const char*& str, std::string& scratch, kvString_t& out)
+	{
+		str++;
+
+		const char* run = str;
+		while ((unsigned char)*str >= 0x20 && *str != '"' && *str != '\\')
+			str++;
+
+		if (*str == '"')
+		{
+			out = kvString_t(const_cast<char*>(run), str - run);
+			str++;
+			return KeyValueErrorCode::NONE;
+		}
+
+		scratch.assign(run, str - run);
+
+		for (;;)
+		{
+			if (*str == '"')
+			{
+				out = kvString_t(&scratch[0], scratch.size());
+				str++;
+				return KeyValueErrorCode::NONE;
+			}
+			if (*str != '\\')
+				return KeyValueErrorCode::INVALID_JSON;
+
+			str++;
+			switch (*str++)
+			{
+			case '"':  scratch += '"'; break;
+			case '\\': scratch += '\\'; break;
+			case '/':  scratch += '/'; break;
+			case 'b':  scratch += '\b'; break;
+			case 'f':  scratch += '\f'; break;
+			case 'n':  scratch += '\n'; break;
+			case 'r':  scratch += '\r'; break;
+			case 't':  scratch += '\t'; break;
+			case 'u':
+			{
+				uint32_t code;
+				if (!ReadHex4(str, code))
+					return KeyValueErrorCode::INVALID_JSON;
+
+				// Anything past the first plane comes in two halves
+				if (code >= 0xD800 && code < 0xDC00 && str[0] == '\\' && str[1] == 'u')
+				{
+					const char* low = str + 2;
+					uint32_t second;
+					if (ReadHex4(low, second) && second >= 0xDC00 && second < 0xE000)
+					{
+						code = 0x10000 + ((code - 0xD800) << 10) + (second - 0xDC00);
+						str = low;
+					}
+				}
+
+				AppendUtf8(scratch, code);
+				break;
+			}
+			default:
+				return KeyValueErrorCode::INVALID_JSON;
+			}
+
+			run = str;
+			while ((unsigned char)*str >= 0x20 && *str != '"' && *str != '\\')
+				str++;
+			scratch.append(run, str - run);
+		}
+	}
+
+	// Numbers, true, false and null. Written out as they are, except for null
+	static KeyValueErrorCode ReadJsonLiteral(const char*& str, kvString_t& out)
+	{
+		const char* start = str;
+
+		static const char* const words[] = { "true", "false", "null" };
+		for (const char* word : words)
+		{
+			size_t length = strlen(word);
+			if (strncmp(str, word, length) == 0)
+			{
+				str += length;
+				out = kvString_t(const_cast<char*>(start), word[0] != 'n' ? length : 0);
+				return KeyValueErrorCode::NONE;
+			}
+		}
+
+		// -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+		auto isDigit = [](char c) { return c >= '0' && c <= '9'; };
+
+		if (*str == '-')
+			str++;
+
+		if (*str == '0')
+			str++;
+		else if (isDigit(*str))
+		{
+			while (isDigit(*str))
+				str++;
+		}
+		else
+			return KeyValueErrorCode::INVALID_JSON;
+
+		if (*str == '.')
+		{
+			str++;
+			if (!isDigit(*str))
+				return KeyValueErrorCode::INVALID_JSON;
+			while (isDigit(*str))
+				str++;
+		}
+
+		if (*str == 'e' || *str == 'E')
+		{
+			str++;
+			if (*str == '+' || *str == '-')
+				str++;
+			if (!isDigit(*str))
+				return KeyValueErrorCode::INVALID_JSON;
+			while (isDigit(*str))
+				str++;
+		}
+
+		// Whatever's left of things like 1-2, 01 or 1.2.3
+		if (isDigit(*str) || *str == '.' || *str == '+' || *str == '-' || *str == 'e' || *str == 'E')
+			return KeyValueErrorCode::INVALID_JSON;
+
+		out = kvString_t(const_cast<char*>(start), str - start);
+		return KeyValueErrorCode::NONE;
+	}
+
+	template<bool useEscapeSequences>
+	void WriteKvString(const kvString_t& str)
+	{
+		output.Put(STRING_CONTAINER);
+		if (useEscapeSequences)
+		{
+			const char* run = str.string;
+			const char* end = str.string + str.length;
+			for (const char* c = run; c < end; c++)
+			{
+				char escaped;
+				switch (*c)
+				{
+				case '\n': escaped = 'n'; break;
+				case '\t': escaped = 't'; break;
+				case '\v': escaped = 'v'; break;
+				case '\b': escaped = 'b'; break;
+				case '\r': escaped = 'r'; break;
+				case '\f': escaped = 'f'; break;
+				case '\a': escaped = 'a'; break;
+				case '\\': escaped = '\\'; break;
+				case '"':  escaped = '"'; break;
+				default: continue;
+				}
+
+				output.Put(run, c - run);
+				output.Put(ESCAPE_CHAR);
+				output.Put(escaped);
+				run = c + 1;
+			}
+			output.Put(run, end - run);
+		}
+		else
+		{
+			// Nothing can stand in for a " without escapes, and left in it would end the string early
+			if (memchr(str.string, STRING_CONTAINER, str.length))
+				unwritableString = true;
+			output.Put(str.string, str.length);
+		}
+		output.Put(STRING_CONTAINER);
+	}
+
+	void WriteTabs(size_t depth)
+	{
+		// Built up once, so that each line's tabs go out in one go
+		size_t length = depth * (sizeof(TAB_STYLE) - 1);
+		while (tabs.size() < length)
+			tabs += TAB_STYLE;
+		output.Put(tabs.data(), length);
+	}
+
+	template<bool useEscapeSequences>
+	void BeginKvNode(const kvString_t& key, size_t depth)
+	{
+		WriteTabs(depth);
+		WriteKvString<useEscapeSequences>(key);
+		output.Put('\n');
+		WriteTabs(depth);
+		output.Put("{\n", 2);
+	}
+
+	void EndKvNode(size_t depth)
+	{
+		WriteTabs(depth);
+		output.Put("}\n", 2);
+	}
+
+	// Writes one member of an object. Arrays turn into a pair for each element, all with the same key
+	template<bool useEscapeSequences>
+	KeyValueErrorCode ReadMember(const char*& str, const kvString_t& key, size_t depth)
+	{
+		kvString_t value;
+		KeyValueErrorCode err;
+		switch (*str)
+		{
+		case '{':
+			BeginKvNode<useEscapeSequences>(key, depth);
+			err = ReadObject<useEscapeSequences>(++str, depth + 1);
+			EndKvNode(depth);
+			return err;
+
+		case '[':
+			if (options.duplicates == KeyValueJsonDuplicates::ORDERED_PAIRS)
+			{
+				BeginKvNode<useEscapeSequences>(key, depth);
+				err = ReadPairs<useEscapeSequences>(++str, depth + 1);
+				EndKvNode(depth);
+				return err;
+			}
+			return ReadArray<useEscapeSequences>(++str, key, depth, false);
+
+		case '"':
+			err = ReadJsonString(str, valueScratch, value);
+			break;
+
+		default:
+			err = ReadJsonLiteral(str, value);
+			break;
+		}
+
+		if (err != KeyValueErrorCode::NONE)
+			return err;
+
+		WriteTabs(depth);
+		WriteKvString<useEscapeSequences>(key);
+		output.Put(' ');
+		WriteKvString<useEscapeSequences>(value);
+		output.Put('\n');
+		return KeyValueErrorCode::NONE;
+	}
+
+	// str is just after the [. When numbered is set, elements are keyed by their index instead of by key
+	template<bool useEscapeSequences>
+	KeyValueErrorCode ReadArray(const char*& str, const kvString_t& key, size_t depth, bool numbered)
+	{
+		char index[24];
+		for (size_t i = 0;; i++)
+		{
+			SkipJsonWhitespace(str);
+			if (i == 0 && *str == ']')
+			{
+				str++;
+				return KeyValueErrorCode::NONE;
+			}
+
+			kvString_t elementKey = key;
+			if (numbered)
+				elementKey = kvString_t(index, snprintf(index, sizeof(index), "%zu", i));
+
+			KeyValueErrorCode err;
+			if (*str == '[')
+			{
+				BeginKvNode<useEscapeSequences>(elementKey, depth);
+				err = ReadArray<useEscapeSequences>(++str, elementKey, depth + 1, true);
+				EndKvNode(depth);
+			}
+			else
+				err = ReadMember<useEscapeSequences>(str, elementKey, depth);
+
+			if (err != KeyValueErrorCode::NONE)
+				return err;
+
+			SkipJsonWhitespace(str);
+			if (*str == ']')
+			{
+				str++;
+				return KeyValueErrorCode::NONE;
+			}
+			if (*str++ != ',')
+				return KeyValueErrorCode::INVALID_JSON;
+		}
+	}
+
+	// str is just after the {
+	template<bool useEscapeSequences>
+	KeyValueErrorCode ReadObject(const char*& str, size_t depth)
+	{
+		std::string keyScratch;
+		kvString_t key;
+		for (bool first = true;; first = false)
+		{
+			SkipJsonWhitespace(str);
+			if (first && *str == '}')
+			{
+				str++;
+				return KeyValueErrorCode::NONE;
+			}
+
+			if (*str != '"')
+				return KeyValueErrorCode::INVALID_JSON;
+
+			KeyValueErrorCode err = ReadJsonString(str, keyScratch, key);
+			if (err != KeyValueErrorCode::NONE)
+				return err;
+
+			SkipJsonWhitespace(str);
+			if (*str++ != ':')
+				return KeyValueErrorCode::INVALID_JSON;
+			SkipJsonWhitespace(str);
+
+			err = ReadMember<useEscapeSequences>(str, key, depth);
+			if (err != KeyValueErrorCode::NONE)
+				return err;
+
+			SkipJsonWhitespace(str);
+			if (*str == '}')
+			{
+				str++;
+				return KeyValueErrorCode::NONE;
+			}
+			if (*str++ != ',')
+				return KeyValueErrorCode::INVALID_JSON;
+		}
+	}
+
+	// str is just after the [ of an array of [key, value] pairs
+	template<bool useEscapeSequences>
+	KeyValueErrorCode ReadPairs(const char*& str, size_t depth)
+	{
+		std::string keyScratch;
+		kvString_t key;
+		for (bool first = true;; first = false)
+		{
+			SkipJsonWhitespace(str);
+			if (first && *str == ']')
+			{
+				str++;
+				return KeyValueErrorCode::NONE;
+			}
+
+			if (*str++ != '[')
+				return KeyValueErrorCode::INVALID_JSON;
+			SkipJsonWhitespace(str);
+			if (*str != '"')
+				return KeyValueErrorCode::INVALID_JSON;
+
+			KeyValueErrorCode err = ReadJsonString(str, keyScratch, key);
+			if (err != KeyValueErrorCode::NONE)
+				return err;
+
+			SkipJsonWhitespace(str);
+			if (*str++ != ',')
+				return KeyValueErrorCode::INVALID_JSON;
+			SkipJsonWhitespace(str);
+
+			err = ReadMember<useEscapeSequences>(str, key, depth);
+			if (err != KeyValueErrorCode::NONE)
+				return err;
+
+			SkipJsonWhitespace(str);
+			if (*str++ != ']')
+				return KeyValueErrorCode::INVALID_JSON;
+
+			SkipJsonWhitespace(str);
+			if (*str == ']')
+			{
+				str++;
+				return KeyValueErrorCode::NONE;
+			}
+			if (*str++ != ',')
+				return KeyValueErrorCode::INVALID_JSON;
+		}
+	}
+
+	KeyValueOutput output;
+	const KeyValueJsonOptions& options;
+
+	std::string tabs;
+
+	// Set once a string with a " in it has gone out without escapes
+	bool unwritableString = false;
+
+	// Where values with escapes in them get decoded. Keys get their own, since they have to last through a whole array
+	std::string valueScratch;
+
+	// One kv out of a set with the same key
+	struct Duplicate
+	{
+		// Where the next one's key starts
+		const char* next;
+		// Just after this one's value. Only kept for the later ones, since they get skipped
+		const char* end;
+		bool later;
+	};
+
+	// What FindDuplicates turned up. Blocks are keyed by where their first kv can start, and kvs by where their key starts
+	std::vector<KeyTable> keyTables;
+	std::unordered_set<const char*> duplicateBlocks;
+	std::unordered_map<const char*, Duplicate> duplicates;
+};
+
+KeyValueErrorCode KeyValueJson::ToJson(const char* kv, KeyValueWriter& writer, const KeyValueJsonOptions& options)
+{
+	if (!kv)
+		return KeyValueErrorCode::NO_INPUT;
+
+	KeyValueJsonTranscoder transcoder(writer, options);
+	if (options.useEscapeSequences)
+		return transcoder.ToJson<true>(kv);
+	return transcoder.ToJson<false>(kv);
+}
+
+KeyValueErrorCode KeyValueJson::FromJson(const char* json, KeyValueWriter& writer, const KeyValueJsonOptions& options)
+{
+	if (!json)
+		return KeyValueErrorCode::NO_INPUT;
+
+	KeyValueJsonTranscoder transcoder(writer, options);
+	if (options.useEscapeSequences)
+		return transcoder.FromJson<true>(json);
+	return transcoder.FromJson<false>(json);
+}
+
+
+/////////////////////////
+// Key Value Snapshots //
+/////////////////////////
+
+// Finds the first child of node whose key matches the segment
+static KeyValue* FindChild(KeyValue* children, size_t childCount, const char* segment, size_t segmentLength, size_t& index)
+{
+	for (index = 0; index < childCount; index++)
+	{
+		const kvString_t& key = children[index].Key();
+		if (key.length == segmentLength && strncasecmp(key.string, segment, segmentLength) == 0)
+			return &children[index];
+	}
+	return nullptr;
+}
+
+// Splits a path into the parent's path and the last key in it
+static void SplitPath(const char* path, size_t& parentLength, const char*& last)
+{
+	const char* separator = strrchr(path, PATH_SEPARATOR);
+	if (separator)
 	{
-		data.node.lastChild->next = newKV;
+		parentLength = separator - path;
+		last = separator + 1;
 	}
 	else
 	{
-		data.node.children = newKV;
+		parentLength = 0;
+		last = path;
 	}
-	data.node.lastChild = newKV;
-	data.node.childCount++;
+}
 
-	return newKV;
+// Adds up the bytes held by every node and string of a tree
+static size_t TreeBytes(const KeyValue& kv)
+{
+	size_t bytes = kv.ChildCount() * sizeof(KeyValue);
+	for (const KeyValue& child : kv)
+	{
+		bytes += child.Key().length + 1;
+		if (child.HasChildren())
+			bytes += TreeBytes(child);
+		else
+			bytes += child.Value().length + 1;
+	}
+	return bytes;
 }
 
-KeyValue* KeyValue::AddNode(const char* keyName)
+KeyValueSnapshot::KeyValueSnapshot(std::shared_ptr<KeyValueRoot> root)
 {
-	// Can't add to a solid kv without kids!
-	if (rootNode->solidified && !isNode)
-		return nullptr;
+	if (!root)
+		return;
 
-	KeyValue* node = rootNode->writePool.Create();
+	// Moved from roots don't have storage, and hold nothing anyway. An empty root of our own stands in for them
+	if (!root->storage)
+		root = std::make_shared<KeyValueRoot>(*root->allocator);
 
-	size_t keyLength = strlen(keyName);
-	char*& copiedKey = *rootNode->writePoolStrings.Create();
-	copiedKey = new char[keyLength + 1];
-	memcpy(copiedKey, keyName, keyLength);
-	copiedKey[keyLength] = '\0';
+	root->Solidify();
 
-	node->key = { copiedKey, keyLength };
+	if (root->storage->chainLength == 0)
+		root->storage->flatBytes = TreeBytes(*root);
 
-	node->isNode = true;
-	node->data.node = { nullptr, nullptr, 0 };
+	this->root = std::move(root);
+}
 
-	node->rootNode = rootNode;
-	node->next = nullptr;
+const KeyValue& KeyValueSnapshot::Root() const
+{
+	if (!root)
+		return KeyValue::GetInvalid();
+	return *root;
+}
 
-	if (data.node.childCount == 0)
+KeyValueStore::KeyValueStore() : current(nullptr), readers(new std::atomic<Version*>[STORE_READER_SLOTS])
+{
+	for (size_t i = 0; i < STORE_READER_SLOTS; i++)
+		readers[i].store(nullptr, std::memory_order_relaxed);
+}
+
+KeyValueStore::KeyValueStore(const KeyValueSnapshot& initial) : KeyValueStore()
+{
+	current.store(new Version{ initial.root }, std::memory_order_release);
+}
+
+KeyValueStore::~KeyValueStore()
+{
+	// Nobody can be reading from us anymore
+	delete current.load(std::memory_order_acquire);
+	for (Version* version : retired)
+		delete version;
+}
+
+KeyValueStore::Version* KeyValueStore::Claimed()
+{
+	static Version claimed;
+	return &claimed;
+}
+
+KeyValueSnapshot KeyValueStore::Snapshot() const
+{
+	// Start somewhere different on each thread, so that readers don't all fight over the first slot
+	size_t start = std::hash<std::thread::id>()(std::this_thread::get_id());
+	std::atomic<Version*>* slot = nullptr;
+	for (size_t i = 0; !slot; i++)
 	{
-		data.node.children = node;
+		std::atomic<Version*>& candidate = readers[(start + i) % STORE_READER_SLOTS];
+		Version* empty = nullptr;
+		if (candidate.load(std::memory_order_relaxed) == nullptr && candidate.compare_exchange_strong(empty, Claimed()))
+			slot = &candidate;
+		else if (i % STORE_READER_SLOTS == STORE_READER_SLOTS - 1)
+			std::this_thread::yield();
 	}
-	else
+
+	// Once it's marked and still current, no Publish can free it until we let go
+	Version* version;
+	do
 	{
-		data.node.lastChild->next = node;
+		version = current.load();
+		slot->store(version);
+	} while (version != current.load());
+
+	KeyValueSnapshot snapshot;
+	if (version)
+		snapshot.root = version->root;
+
+	slot->store(nullptr, std::memory_order_release);
+	return snapshot;
+}
+
+void KeyValueStore::Install(Version* version)
+{
+	Version* old = current.exchange(version);
+	if (old)
+		retired.push_back(old);
+
+	// Anything that isn't marked by a reader now can't be anymore, since it's no longer current
+	size_t kept = 0;
+	for (Version* candidate : retired)
+	{
+		bool marked = false;
+		for (size_t i = 0; i < STORE_READER_SLOTS && !marked; i++)
+			marked = readers[i].load() == candidate;
+
+		if (marked)
+			retired[kept++] = candidate;
+		else
+			delete candidate;
 	}
-	data.node.lastChild = node;
-	data.node.childCount++;
-	
-	return node;
+	retired.resize(kept);
 }
 
-bool KeyValue::IsValid() const
+void KeyValueStore::Publish(const KeyValueSnapshot& snapshot)
 {
-	// The invalid KV is always invalid, and infinite loops are invalid 
-	return this != &GetInvalid()
-		&& next != this && data.node.children != this && data.node.lastChild != this;
+	std::lock_guard<std::mutex> lock(writeMutex);
+	Install(new Version{ snapshot.root });
 }
 
-KeyValue::KeyValue(bool invalid) : data({})
+bool KeyValueStore::Publish(const KeyValueSnapshot& expected, const KeyValueSnapshot& desired)
 {
-	if (invalid)
+	std::lock_guard<std::mutex> lock(writeMutex);
+
+	// Only writers change current, and they all hold the lock
+	Version* version = current.load();
+	if ((version ? version->root : nullptr) != expected.root)
+		return false;
+
+	Install(new Version{ desired.root });
+	return true;
+}
+
+KeyValueTransaction::KeyValueTransaction(const KeyValueSnapshot& base, KeyValueAllocator& allocator)
+{
+	copiedBytes = 0;
+
+	if (!base.root)
 	{
-		// Zero the key and root
-		key = { nullptr, 0 };
-		rootNode = nullptr;
-		
-		// Explicitly invalid data
-		next = this;
-		isNode = true;
-		data.node.children = this;
-		data.node.lastChild = this;
-		data.node.childCount = 0;
+		root = std::make_shared<KeyValueRoot>(allocator);
+		root->storage->solidified = true;
+		return;
 	}
+
+	root = std::make_shared<KeyValueRoot>(*base.root->storage->allocator);
+	root->storage->solidified = true;
+
+	// Start off as a shallow copy of the base. Its children are only copied once we need to change them
+	const KeyValueRoot& baseRoot = *base.root;
+	root->data.node = baseRoot.data.node;
+	root->storage->baseVersion = base.root;
+	root->storage->chainLength = baseRoot.storage->chainLength + 1;
+	root->storage->chainBytes = baseRoot.storage->chainBytes;
+	root->storage->flatBytes = baseRoot.storage->flatBytes;
+	root->storage->sortedKeys = baseRoot.storage->sortedKeys;
 }
 
-KeyValue::~KeyValue()
+KeyValue* KeyValueTransaction::Own(KeyValue& node)
 {
-	if (isNode && data.node.childCount > 0 && rootNode->solidified)
+	size_t cc = node.data.node.childCount;
+
+	// Nodes we own always point back at our root
+	if (cc == 0 || node.data.node.children->storage == root->storage)
+		return node.data.node.children;
+
+	KeyValue* newArray = root->storage->CreateSolidArray(cc);
+	KeyValue::CopyArray(newArray, node.data.node.children, cc);
+	for (size_t i = 0; i < cc; i++)
 	{
-		delete[] data.node.children;
+		newArray[i].storage = root->storage;
+		newArray[i].next = &newArray[i + 1];
 	}
+	newArray[cc - 1].next = nullptr;
+
+	node.data.node.children = newArray;
+	node.data.node.lastChild = &newArray[cc - 1];
+	node.data.node.sortedOffset = 0;
+
+	copiedBytes += sizeof(KeyValue) * cc;
+	return newArray;
 }
 
-KeyValue* KeyValue::CreateKVPair(kvString_t keyName, kvString_t string, KeyValuePool<KeyValue>& pool)
+void KeyValueTransaction::CollectOwned(KeyValue& node, std::vector<KeyValue*>& owned)
 {
-	KeyValue* kv = pool.Create();
-	kv->key = keyName;
-	kv->data.leaf.value = string;
-	kv->isNode = false;
-	kv->rootNode = rootNode;
-	return kv;
+	// Anything we haven't copied can't have anything under it that we have
+	if (node.data.node.childCount == 0 || node.data.node.children->storage != root->storage)
+		return;
+
+	owned.push_back(&node);
+	for (size_t i = 0; i < node.data.node.childCount; i++)
+	{
+		if (node.data.node.children[i].isNode)
+			CollectOwned(node.data.node.children[i], owned);
+	}
 }
 
-template<bool isRoot, bool useEscapeSequences>
-KeyValueErrorCode KeyValue::Parse(const char*& str)
+KeyValue* KeyValueTransaction::Walk(const char* path, size_t pathLength)
 {
-	KeyValue* lastKV = nullptr;
-	char c;
-	for (;;)
+	KeyValue* current = root.get();
+
+	const char* end = path + pathLength;
+	while (path < end)
 	{
-		SkipWhitespace(str);
+		const char* separator = (const char*)memchr(path, PATH_SEPARATOR, end - path);
+		size_t segmentLength = (separator ? separator : end) - path;
 
-		c = *str;
+		if (!current->isNode)
+			return nullptr;
 
-		kvString_t pairkey;
+		size_t index;
+		current = FindChild(Own(*current), current->data.node.childCount, path, segmentLength, index);
+		if (!current)
+			return nullptr;
 
-		// Parse the key out
-		switch (c)
-		{
+		path += segmentLength + 1;
+	}
 
-		case STRING_CONTAINER:
-		{
-			KeyValueErrorCode error = ReadQuotedString<useEscapeSequences>( str, pairkey );
+	return current;
+}
 
-			if (error != KeyValueErrorCode::NONE)
-				return error;
+KeyValue* KeyValueTransaction::Append(KeyValue& parent, const char* key)
+{
+	// Solid children are arrays, so we have to grow it into a new one
+	size_t cc = parent.data.node.childCount;
+	KeyValue* newArray = root->storage->CreateSolidArray(cc + 1);
+	if (cc > 0)
+		KeyValue::CopyArray(newArray, parent.data.node.children, cc);
 
-			break;
-		}
-		case BLOCK_END:
+	for (size_t i = 0; i <= cc; i++)
+	{
+		newArray[i].storage = root->storage;
+		newArray[i].next = &newArray[i + 1];
+	}
+	newArray[cc].next = nullptr;
 
-			// Make sure we skip a char here so that the above layer doesn't read it!
-			str++;
+	parent.data.node.children = newArray;
+	parent.data.node.lastChild = &newArray[cc];
+	parent.data.node.childCount++;
+	parent.data.node.sortedOffset = 0;
 
-			// If we hit a block end as root, we've got a syntax error on our hands... Let's skedaddle!
-			if (isRoot)
-				return KeyValueErrorCode::UNEXPECTED_END_OF_BLOCK;
+	size_t keyLength = strlen(key);
+	KeyValue* kv = &newArray[cc];
+	kv->key = { root->storage->CopyString(key, keyLength), keyLength };
+	kv->lazy.store(false, std::memory_order_relaxed);
+	kv->dirty = true;
 
-			// Otherwise, we should be totally fine to just return at this point
-			goto end;
+	copiedBytes += sizeof(KeyValue) * (cc + 1) + keyLength + 1;
+	return kv;
+}
 
+bool KeyValueTransaction::Set(const char* path, const char* value)
+{
+	if (!root)
+		return false;
 
-			// Did we hit the end of the file?
-		case 0:
-			// If we're root and at the end of the file after this whitespace skip, that means there's no next kv pair. End now
-			if (isRoot)
-				goto end;
+	size_t parentLength;
+	const char* last;
+	SplitPath(path, parentLength, last);
 
-			// If we're not root and at the end of the file after this whitespace skip, we've failed to find the block end
-			return KeyValueErrorCode::INCOMPLETE_BLOCK;
+	KeyValue* parent = Walk(path, parentLength);
+	if (!parent || !parent->isNode)
+		return false;
 
-		case BLOCK_BEGIN:
-			return KeyValueErrorCode::UNEXPECTED_START_OF_BLOCK;
+	size_t index;
+	KeyValue* kv = FindChild(Own(*parent), parent->data.node.childCount, last, strlen(last), index);
+	if (!kv)
+	{
+		kv = Append(*parent, last);
+		kv->isNode = false;
+	}
+	else if (kv->isNode)
+	{
+		// Can't give a value to a node
+		return false;
+	}
 
-#if ALLOW_QUOTELESS_STRINGS
-			// It's gotta be a quoteless string
-		default:
+	size_t valueLength = strlen(value);
+	kv->data.leaf.value = { root->storage->CopyString(value, valueLength), valueLength };
+	copiedBytes += valueLength + 1;
 
-			pairkey = ReadQuotelessString(str);
+	return true;
+}
 
-			break;
-#endif
-		}
+bool KeyValueTransaction::Add(const char* path, const char* key, const char* value)
+{
+	if (!root)
+		return false;
 
-		rootNode->bufferSize += pairkey.length + 1; // + 1 for \0
+	KeyValue* parent = Walk(path, strlen(path));
+	if (!parent || !parent->isNode)
+		return false;
 
-		// We've got our key, so let's find its value
+	KeyValue* kv = Append(*parent, key);
+	kv->isNode = false;
 
-		SkipWhitespace(str);
+	size_t valueLength = strlen(value);
+	kv->data.leaf.value = { root->storage->CopyString(value, valueLength), valueLength };
+	copiedBytes += valueLength + 1;
 
-		c = *str;
+	return true;
+}
 
+bool KeyValueTransaction::AddNode(const char* path, const char* key)
+{
+	if (!root)
+		return false;
 
-		KeyValue* pair;
+	KeyValue* parent = Walk(path, strlen(path));
+	if (!parent || !parent->isNode)
+		return false;
 
+	KeyValue* kv = Append(*parent, key);
+	kv->isNode = true;
+	kv->data.node = { nullptr, nullptr, 0, 0 };
 
-		// Same kinda stuff as earlier but a bit different for the value
-		switch (c)
-		{
+	return true;
+}
 
-		case STRING_CONTAINER:
-		{
-			kvString_t stringValue;
-			KeyValueErrorCode error = ReadQuotedString<useEscapeSequences>(str, stringValue);
+bool KeyValueTransaction::Remove(const char* path)
+{
+	if (!root)
+		return false;
 
-			if (error != KeyValueErrorCode::NONE)
-				return error;
+	size_t parentLength;
+	const char* last;
+	SplitPath(path, parentLength, last);
 
-			pair = CreateKVPair(pairkey, stringValue, rootNode->readPool);
+	KeyValue* parent = Walk(path, parentLength);
+	if (!parent || !parent->isNode)
+		return false;
 
-			rootNode->bufferSize += stringValue.length + 1; // + 1 for \0
-			break;
-		}
-		case BLOCK_BEGIN:
-		{
-			pair = rootNode->readPool.Create();
-			pair->rootNode = rootNode;
+	size_t index;
+	size_t cc = parent->data.node.childCount;
+	if (!FindChild(parent->data.node.children, cc, last, strlen(last), index))
+		return false;
 
-			//skip over the BLOCK_BEGIN
-			str++;
-			pair->isNode = true;
-			pair->data.node = { nullptr, nullptr, 0 };
-			KeyValueErrorCode error = pair->Parse<false, useEscapeSequences>(str);
-			if (error != KeyValueErrorCode::NONE)
-				return error;
+	if (cc == 1)
+	{
+		parent->data.node = { nullptr, nullptr, 0, 0 };
+		return true;
+	}
 
-			pair->key = pairkey;
+	// Shrink into a new array, leaving out the removed kv
+	KeyValue* newArray = root->storage->CreateSolidArray(cc - 1);
+	KeyValue::CopyArray(newArray, parent->data.node.children, index);
+	KeyValue::CopyArray(newArray + index, parent->data.node.children + index + 1, cc - index - 1);
 
-			break;
-		}
-		case 0:
-			// Hit EOF before the value
-			return KeyValueErrorCode::INCOMPLETE_PAIR;
+	for (size_t i = 0; i < cc - 1; i++)
+	{
+		newArray[i].storage = root->storage;
+		newArray[i].next = &newArray[i + 1];
+	}
+	newArray[cc - 2].next = nullptr;
 
-		case BLOCK_END:
-			return KeyValueErrorCode::UNEXPECTED_END_OF_BLOCK;
+	parent->data.node.children = newArray;
+	parent->data.node.lastChild = &newArray[cc - 2];
+	parent->data.node.childCount--;
+	parent->data.node.sortedOffset = 0;
 
-#if ALLOW_QUOTELESS_STRINGS
-			// It's gotta be a quoteless string
-		default:
-		{
+	copiedBytes += sizeof(KeyValue) * (cc - 1);
+	return true;
+}
 
-			kvString_t stringValue = ReadQuotelessString(str);
-			pair = CreateKVPair(pairkey, stringValue, rootNode->readPool);
+KeyValueSnapshot KeyValueTransaction::Commit()
+{
+	KeyValueSnapshot snapshot;
+	if (!root)
+		return snapshot;
 
-			rootNode->bufferSize += stringValue.length + 1; // + 1 for \0
+	root->storage->chainBytes += copiedBytes;
 
-			break;
+	// Every version keeps the one before it alive. Once the chain has piled up more edits than the tree it started from, start fresh
+	if (root->storage->chainLength > SNAPSHOT_MAX_CHAIN_LENGTH || root->storage->chainBytes > root->storage->flatBytes)
+	{
+		root = std::make_shared<KeyValueRoot>(root->Clone());
+	}
+	else
+	{
+		// Every array we copied lost its sorted list. Everything we didn't copy still has its own, in the storage it lives in
+		std::vector<KeyValue*> owned;
+		CollectOwned(*root, owned);
+		root->SortKeys(owned);
+	}
+
+	snapshot = KeyValueSnapshot(std::move(root));
+	return snapshot;
+}
+
+
+////////////////////////
+// Key Value Includes //
+////////////////////////
+
+// Every file this thread is in the middle of loading, innermost last. If one of them comes up again, it's including itself
+static thread_local std::vector<std::string> loadingFiles;
+
+KeyValueErrorCode KeyValueRoot::ResolveIncludes(const KeyValueParseOptions& options)
+{
+	// Pull all of the directives out first, so that nothing brought in gets mistaken for one
+	std::vector<const char*> includeFiles;
+	std::vector<const char*> baseFiles;
+
+	KeyValue* previous = nullptr;
+	KeyValue* current = data.node.children;
+	while (current)
+	{
+		KeyValue* next = current->next;
+
+		bool isInclude = !current->isNode && strcasecmp(current->key.string, INCLUDE_DIRECTIVE) == 0;
+		bool isBase = !current->isNode && strcasecmp(current->key.string, BASE_DIRECTIVE) == 0;
+		if (isInclude || isBase)
+		{
+			(isInclude ? includeFiles : baseFiles).push_back(current->data.leaf.value.string);
+
+			if (previous)
+				previous->next = next;
+			else
+				data.node.children = next;
+
+			if (data.node.lastChild == current)
+				data.node.lastChild = previous;
+			data.node.childCount--;
 		}
-#endif
+		else
+			previous = current;
+
+		current = next;
+	}
+
+	KeyValueErrorCode err = KeyValueErrorCode::NONE;
+
+	for (const char* path : includeFiles)
+	{
+		std::shared_ptr<const KeyValueRoot> file = options.includes->Load(options.path, path, options);
+		if (!file)
+		{
+			err = KeyValueErrorCode::INCLUDE_FAILED;
+			continue;
 		}
 
+		storage->includes.push_back(file);
+		for (const KeyValue* child = file->Children(); child; child = child->Next())
+			AppendCopy(*this, *child);
+	}
 
-		data.node.childCount++;
-		if (lastKV)
+	for (const char* path : baseFiles)
+	{
+		std::shared_ptr<const KeyValueRoot> file = options.includes->Load(options.path, path, options);
+		if (!file)
 		{
-			lastKV->next = pair;
+			err = KeyValueErrorCode::INCLUDE_FAILED;
+			continue;
 		}
-		else
+
+		storage->includes.push_back(file);
+		MergeBase(*this, *file);
+	}
+
+	return err;
+}
+
+KeyValue* KeyValueRoot::AppendCopy(KeyValue& parent, const KeyValue& source)
+{
+	KeyValue* copy = storage->writePool.Create();
+	*copy = source;
+	copy->storage = storage;
+	copy->next = nullptr;
+
+	// Everything below gets copied into one array of our own, so that it can be added to like anything else we parsed
+	if (copy->isNode && copy->data.node.childCount > 0)
+	{
+		size_t nodeCount = 0, stringBytes = 0;
+		copy->CountTree(nodeCount, stringBytes);
+
+		KeyValue* nodes = storage->CreateSolidArray(nodeCount);
+		char* strings = nullptr;
+		copy->Flatten<false>(nodes, strings, nullptr);
+	}
+
+	if (parent.data.node.childCount == 0)
+		parent.data.node.children = copy;
+	else
+		parent.data.node.lastChild->next = copy;
+	parent.data.node.lastChild = copy;
+	parent.data.node.childCount++;
+	return copy;
+}
+
+void KeyValueRoot::MergeBase(KeyValue& into, const KeyValue& base)
+{
+	into.Materialize();
+
+	// Looked up through an index, same as Merge, so that big bases don't scan through every child for every key
+	KeyValueKeyIndex index(*storage->allocator, into.data.node.childCount + base.ChildCount());
+	for (KeyValue* current = into.data.node.children; current; current = current->next)
+		index.Insert(current);
+
+	for (const KeyValue* child = base.Children(); child; child = child->Next())
+	{
+		KeyValueKeyIndex::Entry* entry = index.Find(child->key);
+		if (!entry)
 		{
-			data.node.children = pair;
+			// Later base children with the same key land on the copy
+			index.Insert(AppendCopy(into, *child));
+			continue;
 		}
-		lastKV = pair;
 
+		KeyValue& existing = *index.First(*entry);
+		if (existing.isNode && child->isNode)
+			MergeBase(existing, *child);
+	}
+}
+
+KeyValueFileResolver::KeyValueFileResolver(const char* directory) : directory(directory ? directory : "")
+{
+	if (!this->directory.empty() && this->directory.back() != '/' && this->directory.back() != '\\')
+		this->directory += '/';
+}
+
+bool KeyValueFileResolver::Resolve(const char* from, const char* path, std::string& resolved)
+{
+	if (!path || !*path)
+		return false;
+
+	bool absolute = path[0] == '/' || path[0] == '\\' || path[1] == ':';
+	if (absolute)
+	{
+		resolved = path;
 	}
-end:
-	if (lastKV)
+	else if (from)
 	{
-		lastKV->next = nullptr;
-		data.node.lastChild = lastKV;
+		// Relative to the directory the including file is in
+		const char* slash = nullptr;
+		for (const char* c = from; *c; c++)
+			if (*c == '/' || *c == '\\')
+				slash = c;
+
+		resolved.assign(from, slash ? slash + 1 - from : 0);
+		resolved += path;
+	}
+	else
+	{
+		resolved = directory + path;
 	}
 
-	return KeyValueErrorCode::NONE;
+	return true;
 }
 
-template<bool useEscapeSequences>
-static void KVCopyString( char *&destBuffer, kvString_t &str );
-
-template<>
-void KVCopyString<true>( char*& destBuffer, kvString_t& str )
+bool KeyValueFileResolver::Read(const std::string& resolved, std::string& contents)
 {
-	char *cur = str.string;
-	char *end = str.string + str.length;
-	char *oStart = destBuffer;
-	char *o = oStart;
-	while ( cur < end )
+	FILE* file = fopen(resolved.c_str(), "rb");
+	if (!file)
+		return false;
+
+	fseek(file, 0, SEEK_END);
+	long length = ftell(file);
+	fseek(file, 0, SEEK_SET);
+
+	bool read = length >= 0;
+	if (read)
 	{
-		if ( *cur == ESCAPE_CHAR )
-		{
-			cur++;
-			switch ( *cur )
-			{
-			case 'n': *o = '\n'; break;
-			case 't': *o = '\t'; break;
-			case 'v': *o = '\v'; break;
-			case 'b': *o = '\b'; break;
-			case 'r': *o = '\r'; break;
-			case 'f': *o = '\f'; break;
-			case 'a': *o = '\a'; break;
-			case '\\': *o = '\\'; break;
-			case '\?': *o = '\?'; break;
-			case '\'': *o = '\''; break;
-			case '\"': *o = '\"'; break;
-			default: *o = *cur; break;
-			}
-			o++;
-			cur++;
-		}
-		else
-		{
-			*o = *cur;
-			o++;
-			cur++;
-		}
+		contents.resize((size_t)length);
+		read = fread(&contents[0], 1, (size_t)length, file) == (size_t)length;
 	}
-	*o = '\0';
 
-	str.string = oStart;
-	str.length = o - oStart;
-	destBuffer = o + 1;
+	fclose(file);
+	return read;
 }
 
-template<>
-void KVCopyString<false>( char*& destBuffer, kvString_t& str )
+KeyValueIncludeCache::KeyValueIncludeCache(KeyValueResolver& resolver, KeyValueAllocator& allocator) : resolver(resolver), allocator(allocator)
 {
-	// Copy the string in, null terminate it, and increment the destBuffer
-	memcpy( destBuffer, str.string, str.length );
-	destBuffer[str.length] = '\0';
-	str.string = destBuffer;
-	destBuffer += str.length + 1;
 }
 
-// Copies all of the keys and values out of the input string and copies them all into a massive buffer.
-template<bool useEscapeSequences>
-void KeyValue::BuildData(char*& destBuffer)
+std::shared_ptr<const KeyValueRoot> KeyValueIncludeCache::Load(const char* from, const char* path, const KeyValueParseOptions& options)
 {
-	KeyValue* current = data.node.children;
-	for (size_t i = 0; i < data.node.childCount; i++)
+	std::string resolved;
+	if (!path || !resolver.Resolve(from, path, resolved))
+		return nullptr;
+
+	// Escape sequences and conditionals change what a file parses into, so each way gets its own copy. Symbols are matched
+	// case insensitively and in any order, so sets that only differ in those share one
+	std::string name = options.useEscapeSequences ? "1" : "0";
+	if (options.symbols)
 	{
-		KVCopyString<useEscapeSequences>(destBuffer, current->key);
+		std::vector<std::string> symbols = *options.symbols;
+		for (std::string& symbol : symbols)
+			std::transform(symbol.begin(), symbol.end(), symbol.begin(), [](char c) { return (char)tolower((unsigned char)c); });
+		std::sort(symbols.begin(), symbols.end());
+
+		name += "$";
+		for (const std::string& symbol : symbols)
+			name += symbol + "\n";
+	}
+	name += "\n" + resolved;
 
-		if (current->isNode)
-		{
-			if (current->data.node.childCount > 0)
-			{
-				current->BuildData<useEscapeSequences>(destBuffer);
-			}
-		}
-		else
-		{
-			KVCopyString<useEscapeSequences>( destBuffer, current->data.leaf.value );
-		}
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto found = files.find(name);
+		if (found != files.end())
+			return found->second;
+	}
 
-		current = current->next;
+	for (const std::string& loading : loadingFiles)
+	{
+		if (loading == name)
+			return nullptr;
 	}
+
+	std::string contents;
+	if (!resolver.Read(resolved, contents))
+		return nullptr;
+
+	KeyValueParseOptions fileOptions = options;
+	fileOptions.includes = this;
+	fileOptions.path = resolved.c_str();
+	// The list belongs to the including document, and Parse empties it before it starts. A file with errors doesn't make it
+	// into the cache either way, and the includer's Parse returns INCLUDE_FAILED for it
+	fileOptions.errors = nullptr;
+
+	// Parsing happens outside of the lock, so that files can include each other and other threads can keep reading
+	std::shared_ptr<KeyValueRoot> root = std::make_shared<KeyValueRoot>(allocator);
+	loadingFiles.push_back(name);
+	KeyValueErrorCode err = root->Parse(contents.c_str(), fileOptions);
+	loadingFiles.pop_back();
+
+	if (err != KeyValueErrorCode::NONE)
+		return nullptr;
+
+	// Every document that includes it reads from it, so it had better not change
+	root->Solidify();
+
+	std::lock_guard<std::mutex> lock(mutex);
+	return files.emplace(name, std::move(root)).first->second;
 }
 
-// Copies memory and shifts the inputs
-static void CopyAndShift(char*& dest, char* src, size_t& destLength, size_t srcLength)
+void KeyValueIncludeCache::Clear()
 {
-	size_t minLength = std::min(destLength, srcLength);
-	memcpy(dest, src, minLength);
-	destLength -= minLength;
-	dest += minLength;
+	std::lock_guard<std::mutex> lock(mutex);
+	files.clear();
 }
 
-void CopyAndShift(char*& dest, const char* src, size_t& destLength, size_t srcLength)
+size_t KeyValueIncludeCache::FileCount() const
 {
-	return CopyAndShift(dest, const_cast<char*>(src), destLength, srcLength);
+	std::lock_guard<std::mutex> lock(mutex);
+	return files.size();
 }
 
-static void TabFill(char*& str, size_t& maxLength, int tabCount)
+
+/////////////////////////
+// Key Value Reloading //
+/////////////////////////
+
+// Same idea as the string table's hash, but with all 64 bits kept. A whole file colliding with its last version would go unnoticed
+static uint64_t HashContents(const std::string& contents)
 {
-	for (int i = 0; i < tabCount; i++)
+	const char* str = contents.data();
+	size_t length = contents.size();
+
+	uint64_t hash = 0x9E3779B97F4A7C15ull ^ length;
+	uint64_t chunk;
+	for (; length >= 8; str += 8, length -= 8)
 	{
-		CopyAndShift(str, TAB_STYLE, maxLength, sizeof(TAB_STYLE) - 1); // - 1 due to null terminator
+		memcpy(&chunk, str, 8);
+		hash = (hash ^ chunk) * 0xFF51AFD7ED558CCDull;
+		hash ^= hash >> 32;
 	}
+
+	chunk = 0;
+	memcpy(&chunk, str, length);
+	hash = (hash ^ chunk) * 0xC4CEB9FE1A85EC53ull;
+	return hash ^ (hash >> 29);
 }
 
-static void WriteString(char*& dest, size_t& destLength, kvString_t str, bool useEscapeSequences)
+// Turns a patch from Diff back into the paths it touches. path is where patch applies, and gets put back how it was
+static void CollectChanges(const KeyValue& patch, std::string& path, std::vector<KeyValueChange>& changes)
 {
-	if (useEscapeSequences)
+	size_t pathLength = path.size();
+
+	for (const KeyValue& op : patch)
 	{
-		char* start = dest;
-		for ( int i = 0; i < str.length && destLength >= 2; i++ )
+		// Removals name the key in their value. Every other op wraps the one kv it's about
+		const KeyValue* target = op.HasChildren() ? op.Children() : nullptr;
+		const kvString_t& key = target ? target->Key() : op.Value();
+
+		if (pathLength > 0)
+			path += PATH_SEPARATOR;
+		path.append(key.string, key.length);
+
+		switch (op.Key().string[0])
 		{
-			switch ( str.string[i] )
-			{
-			case '\n': *(dest++) = '\\'; *(dest++) = 'n'; break;
-			case '\t': *(dest++) = '\\'; *(dest++) = 't'; break;
-			case '\v': *(dest++) = '\\'; *(dest++) = 'v'; break;
-			case '\b': *(dest++) = '\\'; *(dest++) = 'b'; break;
-			case '\r': *(dest++) = '\\'; *(dest++) = 'r'; break;
-			case '\f': *(dest++) = '\\'; *(dest++) = 'f'; break;
-			case '\a': *(dest++) = '\\'; *(dest++) = 'a'; break;
-			case '\\': *(dest++) = '\\'; *(dest++) = '\\'; break;
-			case '\?': *(dest++) = '\\'; *(dest++) = '\?'; break;
-			case '\'': *(dest++) = '\\'; *(dest++) = '\''; break;
-			case '\"': *(dest++) = '\\'; *(dest++) = '\"'; break;
-			default: *( dest++ ) = str.string[i]; break;
-			}
+		case PATCH_ADD:
+			changes.push_back({ KeyValueChangeType::ADDED, path });
+			break;
+		case PATCH_REMOVE:
+			changes.push_back({ KeyValueChangeType::REMOVED, path });
+			break;
+		case PATCH_REPLACE:
+			changes.push_back({ KeyValueChangeType::CHANGED, path });
+			break;
+		case PATCH_EDIT:
+			CollectChanges(*target, path, changes);
+			break;
 		}
-		destLength -= ( dest - start );
-	}
-	else
-	{
-		CopyAndShift(dest, str.string, destLength, str.length);
+
+		path.resize(pathLength);
 	}
 }
 
-void KeyValue::ToString(char*& str, size_t& maxLength, int tabCount, bool useEscapeSequences) const
+// Whether one path is the other, or has the other somewhere above it
+static bool PathsOverlap(const std::string& a, const std::string& b)
 {
-	// Make a solidified version?
+	size_t length = std::min(a.size(), b.size());
+	if (strncasecmp(a.c_str(), b.c_str(), length) != 0)
+		return false;
 
-	for (KeyValue* current = data.node.children; current; current = current->next)
+	if (a.size() == b.size() || length == 0)
+		return true;
+	return (a.size() > length ? a[length] : b[length]) == PATH_SEPARATOR;
+}
+
+KeyValueReloader::KeyValueReloader(const KeyValueParseOptions& options, KeyValueAllocator& allocator) : options(options), allocator(allocator), notifyFd(-1)
+{
+#ifdef __linux__
+	notifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+}
+
+KeyValueReloader::~KeyValueReloader()
+{
+#ifdef __linux__
+	if (notifyFd >= 0)
+		close(notifyFd);
+#endif
+}
+
+KeyValueStore& KeyValueReloader::Watch(const char* path)
+{
+	std::unique_ptr<File>& slot = files[path];
+	if (slot)
+		return slot->store;
+
+	slot.reset(new File());
+	File& file = *slot;
+	file.path = path;
+	file.watch = -1;
+	file.pending = false;
+	file.hashed = false;
+	file.hash = 0;
+	file.length = 0;
+	file.error = KeyValueErrorCode::NONE;
+
+	const char* separator = strrchr(path, PATH_SEPARATOR);
+	file.name = separator ? separator + 1 : path;
+
+#ifdef __linux__
+	if (notifyFd >= 0)
 	{
+		// Editors tend to save by writing a new file and renaming it over the old one, which a watch on the file itself would
+		// lose track of. Watching the directory catches both. Watching one twice hands back the same watch
+		std::string directory = separator ? std::string(path, separator == path ? 1 : separator - path) : std::string(".");
+		file.watch = inotify_add_watch(notifyFd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE);
+	}
+#endif
 
-		TabFill(str, maxLength, tabCount);
+	Load(file);
+	return file.store;
+}
 
-		// Copy in the key
-		CopyAndShift(str, "\"", maxLength, 1);
-		WriteString(str, maxLength, current->key, useEscapeSequences);
-		CopyAndShift(str, "\"", maxLength, 1);
+KeyValueStore* KeyValueReloader::Store(const char* path)
+{
+	auto found = files.find(path);
+	return found != files.end() ? &found->second->store : nullptr;
+}
 
-		if (current->isNode)
-		{
-			CopyAndShift(str, "\n", maxLength, 1);
-			TabFill(str, maxLength, tabCount);
-			CopyAndShift(str, "{\n", maxLength, 2);
+KeyValueErrorCode KeyValueReloader::Error(const char* path) const
+{
+	auto found = files.find(path);
+	return found != files.end() ? found->second->error : KeyValueErrorCode::NO_INPUT;
+}
 
-			current->ToString(str, maxLength, tabCount + 1, useEscapeSequences);
+void KeyValueReloader::Subscribe(const char* path, const char* keyPath, KeyValueListener& listener)
+{
+	subscriptions.push_back({ path, keyPath ? keyPath : "", &listener });
+}
 
-			TabFill(str, maxLength, tabCount);
-			CopyAndShift(str, "}\n", maxLength, 2);
-		}
-		else
-		{
-			// Copy in the value
-			CopyAndShift(str, " \"", maxLength, 2);
-			WriteString(str, maxLength, current->data.leaf.value, useEscapeSequences);
-			CopyAndShift(str, "\"\n", maxLength, 2);
-		}
-	}
+void KeyValueReloader::Unsubscribe(KeyValueListener& listener)
+{
+	subscriptions.erase(std::remove_if(subscriptions.begin(), subscriptions.end(),
+		[&listener](const Subscription& subscription) { return subscription.listener == &listener; }), subscriptions.end());
 }
 
-char* KeyValue::ToString(bool useEscapeSequences) const
+bool KeyValueReloader::Load(File& file)
 {
-	// Length of all kvs + 1 for the null terminator
-	size_t length = ToStringLength(0, useEscapeSequences) + 1;
+	std::string contents;
+	if (!disk.Read(file.path, contents))
+	{
+		file.error = KeyValueErrorCode::NO_INPUT;
+		return false;
+	}
 
-	char* str = new char[length];
-	
-	ToString(str, length, useEscapeSequences);
+	// Kept even when the parse fails, so that a broken file isn't parsed again until it changes again
+	uint64_t hash = HashContents(contents);
+	if (file.hashed && file.hash == hash && file.length == contents.size())
+		return false;
 
-	// Null terminate it
-	str[length - 1] = 0;
-	
-	return str;
+	file.hashed = true;
+	file.hash = hash;
+	file.length = contents.size();
+
+	KeyValueParseOptions fileOptions = options;
+	fileOptions.path = file.path.c_str();
+
+	std::shared_ptr<KeyValueRoot> root = std::make_shared<KeyValueRoot>(allocator);
+	file.error = root->Parse(contents.c_str(), fileOptions);
+	if (file.error != KeyValueErrorCode::NONE)
+		return false;
+
+	file.store.Publish(KeyValueSnapshot(std::move(root)));
+	return true;
 }
 
-static size_t GetStringLength(kvString_t str, bool useEscapeSequences)
+bool KeyValueReloader::ReadEvents()
 {
-	if (!useEscapeSequences)
-		return str.length;
+	bool overflowed = false;
 
-	int n = 0;
-	for ( int i = 0; i < str.length; i++ )
+#ifdef __linux__
+	alignas(struct inotify_event) char buffer[RELOAD_EVENT_BUFFER_COUNT * (sizeof(struct inotify_event) + NAME_MAX + 1)];
+
+	for (;;)
 	{
-		switch ( str.string[i] )
+		ssize_t length = read(notifyFd, buffer, sizeof(buffer));
+		if (length <= 0)
 		{
-		case 'n':
-		case 't':
-		case 'v':
-		case 'b':
-		case 'r':
-		case 'f':
-		case 'a':
-		case '\\':
-		case '\?':
-		case '\'':
-		case '\"':
-			n += 2;
-			break;
-		default:
-			n += 1;
+			// EAGAIN means we've had everything. Anything else, and there's no telling what we missed
+			if (length < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				overflowed = true;
+			if (length < 0 && errno == EINTR)
+				continue;
 			break;
 		}
+
+		for (char* position = buffer; position < buffer + length; )
+		{
+			const struct inotify_event* event = (const struct inotify_event*)position;
+			position += sizeof(struct inotify_event) + event->len;
+
+			if (event->mask & IN_Q_OVERFLOW)
+			{
+				overflowed = true;
+				continue;
+			}
+			if (event->len == 0)
+				continue;
+
+			// Only a few dozen files, so a scan beats keeping another map up to date
+			for (auto& entry : files)
+			{
+				File& file = *entry.second;
+				if (file.watch == event->wd && file.name == event->name)
+					file.pending = true;
+			}
+		}
 	}
-	return n;
+#endif
+
+	return overflowed;
 }
 
-size_t KeyValue::ToStringLength(int tabCount, bool useEscapeSequences) const
+size_t KeyValueReloader::Poll()
 {
-	size_t len = 0;
-	for (KeyValue* current = data.node.children; current; current = current->next)
+	bool everything = notifyFd >= 0 && ReadEvents();
+
+	struct Reload
 	{
-		len += tabCount * sizeof(TAB_STYLE);
+		File* file;
+		KeyValueSnapshot previous;
+	};
+	std::vector<Reload> reloads;
 
-		// String container + Key + String container 
-		len += sizeof(STRING_CONTAINER) + GetStringLength(current->key, useEscapeSequences) + sizeof( STRING_CONTAINER );
+	for (auto& entry : files)
+	{
+		File& file = *entry.second;
+		if (file.watch >= 0 && !file.pending && !everything)
+			continue;
+		file.pending = false;
+
+		KeyValueSnapshot previous = file.store.Snapshot();
+		if (Load(file))
+			reloads.push_back({ &file, previous });
+	}
 
-		if (current->isNode)
-		{
-			// If we have kids, new line + tabs + start block + new line
-			len += 1 + tabCount * sizeof(TAB_STYLE) + sizeof(BLOCK_BEGIN) + 1;
+	// Nobody hears anything until every file is in, so listeners that look at other files see them all at their newest
+	for (const Reload& reload : reloads)
+	{
+		KeyValueSnapshot snapshot = reload.file->store.Snapshot();
 
-			len += current->ToStringLength(tabCount + 1, useEscapeSequences);
+		// A file that had never loaded is diffed against nothing, so everything in it counts as added
+		KeyValueRoot nothing;
+		const KeyValue& before = reload.previous.IsValid() ? reload.previous.Root() : nothing;
+		KeyValueRoot patch = KeyValueRoot::Diff(before, snapshot.Root());
 
-			// End line + tabs + end block + end line
-			len += 1 + tabCount * sizeof(TAB_STYLE) + sizeof(BLOCK_END) + 1;
-		}
-		else
+		std::string path;
+		std::vector<KeyValueChange> changes;
+		CollectChanges(patch, path, changes);
+		if (changes.empty())
+			continue;
+
+		std::vector<KeyValueChange> matching;
+		for (const Subscription& subscription : subscriptions)
 		{
-			// If we don't have any children, we just have a value
+			if (subscription.file != reload.file->path)
+				continue;
 
-			// Space + string container + value + string container + new line
-			
-			len += 1 + sizeof(STRING_CONTAINER) + GetStringLength( current->data.leaf.value, useEscapeSequences ) + sizeof(STRING_CONTAINER) + 1;
+			matching.clear();
+			for (const KeyValueChange& change : changes)
+			{
+				if (PathsOverlap(change.path, subscription.path))
+					matching.push_back(change);
+			}
 
+			if (!matching.empty())
+				subscription.listener->OnReload(reload.file->path, snapshot, matching);
 		}
 	}
 
-	return len;
+	return reloads.size();
 }
@@ -18,18 +18,79 @@
 //
 // // Optimizing speeds
 // kv.Solidify(); // Use this if you have a big file and need quicker access times. Warning: It will make the kv read-only!
+// kv.Solidify(KeyValueSolidifyMode::SORT_KEYS); // Same, but Get binary searches big nodes. Good for registries and lookup tables
 //
 // // Reading from the KeyValue
 // printf(kv["AwesomeNode"]["Taco"].Value().string); // Accesses the node AwesomeNode's child, Taco, and prints Taco's value
 // printf(kv[2].Value().string); // Accesses the third pair, CoolKey, and prints its value, CoolValue
+// for (KeyValue& input : kv["Inputs"].GetAll("input")) // Every child keyed "input", in order. Keys can repeat!
+// for (KeyValue& child : kv) // Every child
 //
 // // Printing the KeyValue
 // char printBuffer[1024];
 // kv.ToString(printBuffer, 1024); // Prints 1024 characters of the KeyValue to the buffer for printing
 // printf(printBuffer);
 //
+// // Saving over and over
+// const std::string& text = kv.Serialize(); // Same text as ToString. The root remembers it, so saving again after a few
+//                                           // Adds only re-renders the blocks that changed
+//
+// // Reusing the KeyValue
+// kv.Reset(); // Empties the kv, but keeps its pools and string buffer so the next Parse doesn't have to allocate
+// kv.Parse("Another RadKv");
+//
+// // Parsing with options
+// KeyValueParseOptions options;
+// options.deduplicateStrings = true; // Repeated keys and values share one copy. Great for files that say "0" a million times
+// KeyValueRoot deduped;
+// deduped.Parse("Another RadKv", options);
+//
+// // Finding mistakes
+// KeyValueError error = deduped.LastError(); // error.line and error.column say where Parse gave up
+// std::vector<KeyValueError> errors;
+// options.errors = &errors; // Parse keeps going after errors instead, and collects every one of them
+//
+// // Parsing lazily
+// options.lazy = true; // Parse only skims the document. Blocks get parsed when something reaches into them
+//
+// // Conditionals
+// std::vector<std::string> symbols = { "WIN32" };
+// options.symbols = &symbols; // "Key" "Value" [$WIN32] stays in, and "Node" [!$WIN32] { ... } never even gets parsed
+//
+// // Following #include and #base
+// KeyValueFileResolver resolver("scripts/"); // Or your own KeyValueResolver, for packed files and the like
+// KeyValueIncludeCache includes(resolver);   // Share this between documents. Each included file only gets parsed once
+// options.includes = &includes;
+// options.path = "scripts/items.txt";
+// KeyValueRoot items;
+// items.Parse(itemsText, options);
+//
+// // Layering. See Key Value Merging for diffs and patches too
+// kv.Merge(overrides); // Keys overrides has win, and nodes you both have get merged the same way
+//
+// // Instrumentation
+// KeyValueStats stats = kv.GetStats(); // Node counts, depth and pool memory. Build with KEYVALUE_STATS=1 for Parse and Solidify timings too
+//
+// // Threading
+// // Once solidified, every const function can be called from any number of threads at once without locking.
+// // Nothing may be built lazily on a solid tree unless it's published through an atomic or std::call_once.
+// // Solidify, Parse, Add and AddNode must never overlap with anything else on the same root.
+// // Lazy blocks are parsed under a lock, so reading a lazy tree from many threads is fine too, as long as nothing adds to it.
+//
 
 #include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+
+// Define this as 1 to have Parse and Solidify time themselves for GetStats. When it's 0, none of the timing code gets built
+#ifndef KEYVALUE_STATS
+#define KEYVALUE_STATS 0
+#endif
 
 enum class KeyValueErrorCode
 {
@@ -41,6 +102,114 @@ enum class KeyValueErrorCode
 	UNEXPECTED_END_OF_BLOCK,
 	INCOMPLETE_STRING,
 	NO_INPUT,
+	// An #include or #base couldn't be found, read or parsed. Everything else in the document is still there
+	INCLUDE_FAILED,
+	// A [$CONDITIONAL] was missing its ]
+	INCOMPLETE_CONDITIONAL,
+	// What KeyValueJson::FromJson was given isn't JSON, or isn't shaped like a kv
+	INVALID_JSON,
+	// A KeyValueWriter turned down some output
+	WRITE_FAILED,
+	// KeyValueJson::FromJson came across a string with a " in it, which kv text can only hold with useEscapeSequences
+	NEEDS_ESCAPE_SEQUENCES,
+};
+
+// Where Parse ran into an error. Lines and columns both count from 1, and columns are in bytes
+struct KeyValueError
+{
+	KeyValueErrorCode code = KeyValueErrorCode::NONE;
+	// From the start of the document
+	size_t offset = 0;
+	size_t line = 0;
+	size_t column = 0;
+};
+
+enum class KeyValueSolidifyMode
+{
+	// Get scans through the children in order. Big nodes still get a list of their children sorted by key, which GetAll
+	// binary searches through
+	DOCUMENT_ORDER,
+	// Get binary searches the sorted lists too. At and Next still go in document order
+	SORT_KEYS,
+};
+
+// How Merge treats children of the overlay that have the same key as one of ours
+enum class KeyValueMergePolicy
+{
+	// The overlay's child replaces ours outright
+	OVERRIDE,
+	// Every child of the overlay gets added on the end, even when we already have its key
+	APPEND,
+	// Like OVERRIDE, except that when both are nodes, the overlay's node gets merged into ours the same way
+	DEEP,
+};
+
+// Which order KeyValue::Visit goes through a tree in
+enum class KeyValueVisitOrder
+{
+	// Each kv, then everything under it. The same order as the document
+	PRE_ORDER,
+	// Everything under a kv, then the kv. Good for adding things up from the bottom
+	POST_ORDER,
+	// Everything one level down, then everything two levels down, and so on
+	BREADTH_FIRST,
+};
+
+class KeyValueIncludeCache;
+
+// Everything Parse can be told to do differently
+struct KeyValueParseOptions
+{
+	// Turns \n, \t, \" and friends into the characters they stand for
+	bool useEscapeSequences = false;
+	// Repeated keys and values all point at one copy in the string buffer. Costs a hash per string, but files
+	// full of "0", "1" and the same few paths end up with a much smaller buffer. Clones of the root dedup too.
+	// Lazy blocks don't, as their strings are copied out one block at a time when they're reached
+	bool deduplicateStrings = false;
+
+	// Set this to follow #include and #base at the top level of the document. Without it, they're just more keys
+	KeyValueIncludeCache* includes = nullptr;
+	// Where the document came from, so that its includes can be found relative to it. Can be null
+	const char* path = nullptr;
+
+	// Symbols that are set for [$CONDITIONAL] tags, like "WIN32" or "X360", without the $. Matched case insensitively.
+	// Anything tagged false gets skipped without being parsed. When this is null, tags are read as plain keys like always
+	const std::vector<std::string>* symbols = nullptr;
+
+	// Only parses the top level up front. Every block gets skipped over, and is parsed the first time Get, At, Children or
+	// ChildCount reaches it. Parse keeps its own copy of the document for this. Errors inside of a block only turn up once
+	// it's reached, which leaves it empty. See KeyValueRoot::LazyError
+	bool lazy = false;
+
+	// Set this to have Parse keep going after errors, so a whole file's worth of mistakes can be found at once. Every error
+	// goes in here, in the order they're in the document. A pair that can't be read is dropped and a block that's missing its
+	// key is skipped, but otherwise Parse carries on from the next block boundary. Parse still returns the first error
+	std::vector<KeyValueError>* errors = nullptr;
+};
+
+// What a root is made of, and how long it took to make. See KeyValueRoot::GetStats
+struct KeyValueStats
+{
+	// These are only filled in when built with KEYVALUE_STATS. They cover the last Parse and Solidify
+	double parseSeconds;        // Reading the input into kvs
+	double poolGrowthSeconds;   // How much of parseSeconds went to allocating pool chunks
+	double buildDataSeconds;    // Copying the parsed strings into the string buffer
+	double solidifySeconds;
+
+	size_t nodeCount;           // Every kv under the root
+	size_t maxDepth;            // 1 if nothing has children, 2 if something does, and so on
+	size_t largestChildCount;   // The most children any one kv has, root included
+
+	size_t bufferSize;          // Bytes of parsed strings in the string buffer. Never more than bufferCapacity
+	size_t dedupStrings;        // Parsed strings that point at an earlier copy instead of their own
+	size_t dedupBytes;          // Bytes of string buffer those strings would've taken
+	size_t bufferCapacity;      // Bytes the string buffer can hold
+	size_t lazyStringBytes;     // Bytes of strings from lazy blocks, which each get a buffer of their own once they're reached
+	size_t readPoolBytes;       // Bytes of kvs allocated for parsing
+	size_t writePoolBytes;      // Bytes of kvs allocated for Add and AddNode
+	size_t writePoolStringsBytes; // Bytes of strings copied by Add and AddNode, and the slots pointing at them
+	size_t solidBytes;          // Bytes of solid kv arrays and sorted key lists
+	size_t poolChunks;          // Chunks across every pool
 };
 
 // Little helper struct for keeping track of strings
@@ -55,7 +224,39 @@ struct kvString_t
 	size_t length;
 };
 
+// Where a root gets the memory for its kvs and strings from. Hand one to a root to put it on your own arenas or budgets.
+// What KeyValueRoot::Serialize keeps around is the exception, and comes off the regular heap
+class KeyValueAllocator
+{
+public:
+	virtual ~KeyValueAllocator() {}
+
+	// alignment is never more than alignof(std::max_align_t)
+	virtual void* Allocate(size_t size, size_t alignment) = 0;
+	// size is the same size the block was allocated with
+	virtual void Free(void* block, size_t size) = 0;
+
+	// Just malloc and free. Used by any root that isn't given an allocator
+	static KeyValueAllocator& Default();
+};
+
+// A block of memory from an allocator, and how big it was
+struct KeyValueBlock
+{
+	void* memory;
+	size_t size;
+};
+
 class KeyValueRoot;
+class KeyValueStorage;
+class KeyValueSnapshot;
+class KeyValueStore;
+class KeyValueTransaction;
+class KeyValueStringTable;
+class KeyValueIterator;
+class KeyValueRange;
+class KeyValueExtractor;
+class KeyValueVisitor;
 
 template<typename T>
 class KeyValuePool;
@@ -76,13 +277,28 @@ public:
 	inline KeyValue& operator[](size_t index) { return At(index); }
 	inline const KeyValue& operator[](size_t index) const { return At(index); }
 
+	// Every child with this key, not just the first. Big nodes of solid trees find them with one binary search, whichever
+	// mode they were solidified with. Anything that isn't solid walks all of the children once as the range is iterated.
+	// keyName has to last as long as the range does
+	KeyValueRange GetAll(const char* keyName) const;
+
+	// Hands every kv under this one to visitor, this one not included. No recursion, so there's no limit on how deep the
+	// tree can go, and the kvs coming up get prefetched while the visitor's busy with the current one
+	void Visit(KeyValueVisitor& visitor, KeyValueVisitOrder order = KeyValueVisitOrder::PRE_ORDER) const;
+
 
 	// These two only work for classes with children!
 	KeyValue* Add(const char* key, const char* value);
 	KeyValue* AddNode(const char* key);
 
+	// Same goes for these. They return false if there's nothing they can change. See Key Value Merging
+	bool Merge(const KeyValue& overlay, KeyValueMergePolicy policy = KeyValueMergePolicy::DEEP);
+	// Returns false if any part of the patch didn't line up. Everything else still gets applied
+	bool ApplyPatch(const KeyValue& patch);
+
 
 	void ToString(char* str, size_t maxLength, bool useEscapeSequences = false) const { ToString(str, maxLength, 0, useEscapeSequences); if (maxLength > 0) str[0] = '\0'; }
+	// The returned string is yours to delete[]. It doesn't come from the root's allocator
 	char* ToString(bool useEscapeSequences = false) const;
 
 	bool IsValid() const;
@@ -91,20 +307,43 @@ public:
 	const kvString_t& Key() const { return key; }
 
 	bool HasChildren() const { return isNode; }
-	size_t ChildCount() const { return isNode ? data.node.childCount : 0; }
-	KeyValue* Children() const { return isNode ? data.node.children : nullptr; }
+	size_t ChildCount() const { Materialize(); return isNode ? data.node.childCount : 0; }
+	KeyValue* Children() const { Materialize(); return isNode ? data.node.children : nullptr; }
 
 	kvString_t Value() const { return isNode ? kvString_t(nullptr, 0u) : data.leaf.value; }
 	
-	KeyValue* LastChild() { return data.node.lastChild; }
-	const KeyValue* LastChild() const { return data.node.lastChild; }
+	KeyValue* LastChild() { Materialize(); return data.node.lastChild; }
+	const KeyValue* LastChild() const { Materialize(); return data.node.lastChild; }
 
 	KeyValue* Next() { return next; }
 	const KeyValue* Next() const { return next; }
 
+	// For range-based for loops over the children
+	KeyValueIterator begin() const;
+	KeyValueIterator end() const;
+
 protected:
 
-	KeyValue() : data( {} ) {}
+	KeyValue() : data( {} ), lazy( false ), dirty( true ) {}
+
+	// Copies every field over, which memcpy can't do with lazy being atomic. Only for kvs no other thread can see yet
+	KeyValue& operator=(const KeyValue& other)
+	{
+		storage = other.storage;
+		next = other.next;
+		key = other.key;
+		data = other.data;
+		isNode = other.isNode;
+		lazy.store(other.lazy.load(std::memory_order_relaxed), std::memory_order_relaxed);
+		dirty = other.dirty;
+		return *this;
+	}
+	// Same, for count kvs in a row
+	static void CopyArray(KeyValue* dest, const KeyValue* source, size_t count)
+	{
+		for (size_t i = 0; i < count; i++)
+			dest[i] = source[i];
+	}
 
 	// This is used for creating the invalid kv
 	// Could be better?
@@ -118,21 +357,54 @@ protected:
 
 	KeyValue* CreateKVPair(kvString_t keyName, kvString_t string, KeyValuePool<KeyValue>& pool);
 
+	// When lazy is set, blocks get skipped over instead of parsed
 	template<bool isRoot, bool useEscapeSequences>
-	KeyValueErrorCode Parse(const char*& str);
+	KeyValueErrorCode Parse(const char*& str, const std::vector<std::string>* symbols, bool lazy);
+	// Notes down where Parse went wrong. Returns true if it should recover and keep going
+	bool ParseError(KeyValueErrorCode err, const char* at);
+
+	// Parses a lazy block, if this is one. Cheap enough to call before anything that looks at children
+	inline void Materialize() const { if (lazy.load(std::memory_order_acquire)) const_cast<KeyValue*>(this)->MaterializeLazy(); }
+	void MaterializeLazy();
+	// When strings is set, repeats of a string already in the buffer point at that one instead
 	template<bool useEscapeSequences>
-	void BuildData(char*& destBuffer);
-	void Solidify();
+	void BuildData(char*& destBuffer, KeyValueStringTable* strings);
+	template<bool copyStrings>
+	void Flatten(KeyValue*& nodes, char*& strings, KeyValueStringTable* table);
+	// Moves every string below this kv from one buffer to another at the same offsets
+	void RebaseStrings(const char* oldBuffer, char* newBuffer);
+	// Adds up how many kvs are below this one and how many bytes their strings take
+	void CountTree(size_t& nodes, size_t& stringBytes) const;
+
+	// Flags us, and every block above us, as changed since the root's last Serialize
+	void MarkDirty();
+	// Writes our children out for Serialize. Blocks that haven't changed get copied out of the last text instead, where our
+	// own insides started at oldStart. That's npos if we weren't in it
+	void SerializeChildren(std::string& text, int tabCount, size_t oldStart, bool useEscapeSequences);
+
+	// Links a new kv from the write pool onto the end of our children. Whoever asked for it fills it in
+	KeyValue* AppendChild();
+	// Turns this kv into a deep copy of source, without moving it from its place among its siblings
+	void CopyFrom(const KeyValue& source);
+	void MergeChildren(const KeyValue& overlay, KeyValueMergePolicy policy);
+	bool PatchChildren(const KeyValue& patch);
+	// Adds operations to this patch for turning the children of from into the children of to.
+	// spare is a list, linked through next, of kvs that comparisons made and didn't end up needing
+	void DiffChildren(const KeyValue& from, const KeyValue& to, KeyValue*& spare);
+	// Adds an operation to this patch, aimed at the given occurrence of a key
+	KeyValue* AppendPatchOp(char op, size_t occurrence);
 
 
 	void ToString(char*& str, size_t& maxLength, int tabCount, bool useEscapeSequences) const;
 	size_t ToStringLength(int tabCount, bool useEscapeSequences) const;
 
-	// An invalid KV for use in returns with references
-	static KeyValue& GetInvalid();
+	// An invalid KV for use in returns with references. Shared by every thread, so it's only ever handed out const
+	static const KeyValue& GetInvalid();
+	// The invalid kv to hand back from Get and At on us. Our root's if we have one
+	KeyValue& GetMissing() const;
 
-	// Top level root parent node
-	KeyValueRoot* rootNode;
+	// Everything owned by the root this kv belongs to. The root itself can move, so we can't point at it directly
+	KeyValueStorage* storage;
 
 	// Next sibling pair
 	KeyValue* next;
@@ -153,33 +425,139 @@ protected:
 			KeyValue* children;
 			KeyValue* lastChild;
 			unsigned int  childCount;
+			// Where this node's sorted children start in its children's storage. 0 if they aren't sorted
+			unsigned int  sortedOffset;
 		} node;
+
+		struct
+		{
+			// Always null, so anything that walks a lazy block without materializing it just sees an empty one
+			KeyValue* children;
+			// Just after the block's {, in the root's copy of the document
+			const char* source;
+		} lazy;
 	
 	} data;
 
 	// Determines whether we should be using data.node or data.leaf
 	bool isNode;
 
+	// Set on nodes whose block hasn't been parsed yet, in which case data.lazy is in use
+	std::atomic<bool> lazy;
+
+	// Set when something in or below us has changed since the root last serialized us. Fits in what would be padding
+	bool dirty;
+
+	friend KeyValueRoot;
+	friend KeyValueStorage;
+	friend KeyValueSnapshot;
+	friend KeyValueTransaction;
+	friend KeyValueExtractor;
+};
+
+// Steps through children, either all of them or just the ones with one key
+class KeyValueIterator
+{
+public:
+	KeyValue& operator*() const { return *current; }
+	KeyValue* operator->() const { return current; }
+
+	KeyValueIterator& operator++()
+	{
+		if (sorted)
+			current = ++sorted != sortedEnd ? children + *sorted : nullptr;
+		else if (key)
+			current = Find(current->Next());
+		else
+			current = current->Next();
+		return *this;
+	}
+
+	bool operator==(const KeyValueIterator& other) const { return current == other.current; }
+	bool operator!=(const KeyValueIterator& other) const { return current != other.current; }
+
+private:
+	KeyValueIterator() {}
+
+	// The first kv from start on that has our key
+	KeyValue* Find(KeyValue* start) const;
+
+	// Null once we're done
+	KeyValue* current = nullptr;
+
+	// Only kvs with this key get stepped on. Null for all of them
+	const char* key = nullptr;
+
+	// Sorted nodes step through the span of their sorted list that has our key instead
+	KeyValue* children = nullptr;
+	const unsigned int* sorted = nullptr;
+	const unsigned int* sortedEnd = nullptr;
+
+	friend KeyValue;
+	friend KeyValueRange;
+};
+
+// What GetAll hands back. Only good for as long as the kv it came from is
+class KeyValueRange
+{
+public:
+	KeyValueIterator begin() const { return first; }
+	KeyValueIterator end() const { return KeyValueIterator(); }
+
+	bool Empty() const { return first.current == nullptr; }
+	size_t Count() const;
+
+private:
+	KeyValueIterator first;
+
+	friend KeyValue;
+};
+
+// Gets handed every kv in a tree by KeyValue::Visit
+class KeyValueVisitor
+{
+public:
+	virtual ~KeyValueVisitor() {}
+
+	// depth is 0 for the children of the kv Visit was called on. Return false to skip everything under kv.
+	// Post order has already been through it by then, so it doesn't matter what that returns
+	virtual bool Visit(const KeyValue& kv, size_t depth) = 0;
 };
 
+inline KeyValueIterator KeyValue::begin() const
+{
+	KeyValueIterator it;
+	it.current = Children();
+	return it;
+}
+
+inline KeyValueIterator KeyValue::end() const
+{
+	return KeyValueIterator();
+}
+
 template<typename T>
 class KeyValuePool
 {
 private:
-	KeyValuePool();
+	KeyValuePool(KeyValueAllocator& allocator);
 	~KeyValuePool();
 
 	void Drain();
+	// Rewinds the pool so that its chunks get filled again, without freeing any of them
+	void Reset();
 
 	T* Create();
 
 	inline bool IsFull() { return position >= currentPool->length; }
 
+	// Adds up how many chunks and bytes this pool holds
+	void Measure(size_t& chunks, size_t& bytes) const;
+
 	class PoolChunk
 	{
 	public:
-		PoolChunk(size_t length);
-		PoolChunk(size_t length, PoolChunk* last);
+		PoolChunk(size_t length, T* pool);
 
 		T* pool;
 		size_t length;
@@ -187,14 +565,162 @@ private:
 		PoolChunk* next;
 	};
 
+	// Chunks and their contents share one allocation
+	PoolChunk* CreateChunk(size_t length, PoolChunk* last);
+	static size_t ChunkHeaderSize();
+
 	size_t position;
 
 	PoolChunk* firstPool;
 	PoolChunk* currentPool;
 
-	// Nothing other than KeyValue and KeyValueRoot should touch this!
+	KeyValueAllocator* allocator;
+
+#if KEYVALUE_STATS
+	// Time spent allocating chunks since the pool was made
+	double growthSeconds;
+#endif
+
+	// Nothing other than KeyValue, KeyValueRoot and KeyValueStorage should touch this!
+	friend KeyValue;
+	friend KeyValueRoot;
+	friend KeyValueStorage;
+};
+
+// Everything a root owns. Lives on the heap so that every kv can point at it, no matter where the root moves to
+class KeyValueStorage
+{
+private:
+	KeyValueStorage(KeyValueAllocator& allocator);
+	~KeyValueStorage();
+
+	// Storage is allocated with its root's allocator too
+	static KeyValueStorage* Create(KeyValueAllocator& allocator);
+	static void Destroy(KeyValueStorage* storage);
+
+	// Frees every kv and string, but keeps the pools and string buffer around to be filled again
+	void Reset();
+
+	// Copies a string into memory owned by this root
+	char* CopyString(const char* str, size_t length);
+	// Same, but strings share blocks instead of getting an allocation each. For when whole trees get copied at once
+	char* PackString(const char* str, size_t length);
+	// Room for size bytes of strings, from the same blocks PackString uses
+	char* AllocatePacked(size_t size);
+
+	// Creates an array of count solid kvs that lives as long as this root does
+	KeyValue* CreateSolidArray(size_t count);
+	// Allocates a block that lives as long as this root does
+	void* CreateBlock(size_t size, size_t alignment);
+
+	// Makes sure the string buffer can hold at least size bytes
+	void ReserveBuffer(size_t size);
+	// Swaps the string buffer for one of exactly size bytes, and moves the strings of everything below kv over to it
+	void ShrinkBuffer(KeyValue& kv, size_t size);
+
+	// Frees every block handed out by a pool of blocks
+	void FreeBlocks(KeyValuePool<KeyValueBlock>& pool);
+	// Forgets the last Serialize. For when nodes move or go away
+	void DropSerialText();
+
+	KeyValueAllocator* allocator;
+
+	// What Get and At hand back from this root's kvs when there's nothing to find. Kept per root instead of shared
+	// between every thread, so that nothing written to it by mistake can reach another root
+	KeyValue invalid;
+
+	// This string buffer exists to hold *all parsed* key and value strings. 
+	char* stringBuffer;
+	// bufferSize is tallied up during the parse as the total length of all parsed strings, and stringBuffer is allocated using it.
+	// Once the strings are in, it's how much of the buffer they use, which is less than the tally if any got deduplicated
+	size_t bufferSize;
+	// How much stringBuffer can hold. Kept across resets so that the next parse doesn't need to allocate
+	size_t bufferCapacity;
+
+	// Whether strings get deduplicated as they're copied into this root
+	bool deduplicateStrings;
+	// How many strings dedup caught, and how many bytes of buffer it saved. Only used for stats
+	size_t dedupStrings;
+	size_t dedupBytes;
+
+	KeyValuePool<KeyValue> readPool;
+	KeyValuePool<KeyValue> writePool;
+	KeyValuePool<KeyValueBlock> writePoolStrings;
+
+	// Arrays of kvs made by Solidify, Clone and transactions, and sorted key lists. Freed with the root
+	KeyValuePool<KeyValueBlock> solidArrays;
+
+	// What's left of the last block handed out to PackString
+	char* packPosition;
+	size_t packRemaining;
+
+	// Bytes held by solidArrays, and by the strings in writePoolStrings. Only used for stats
+	size_t solidBytes;
+	size_t copiedStringBytes;
+	// How much of solidBytes went to the strings of lazy blocks. Only used for stats
+	size_t lazyStringBytes;
+
+#if KEYVALUE_STATS
+	double parseSeconds;
+	double poolGrowthSeconds;
+	double buildDataSeconds;
+	double solidifySeconds;
+#endif
+
+	bool solidified;
+
+	// Sorted children of every big node, by index into its children. The first entry is never used, so an offset of 0 can mean unsorted
+	unsigned int* sortedIndices;
+	// Whether this root was solidified with SORT_KEYS, so that Get uses the sorted lists too
+	bool sortedKeys;
+
+	// Snapshot versions made by a transaction borrow every node they didn't change from the version before them
+	std::shared_ptr<const KeyValueRoot> baseVersion;
+	// Files pulled in by #include and #base. Their kvs were copied in, but the strings still live in there
+	std::vector<std::shared_ptr<const KeyValueRoot>> includes;
+
+	// Everything a lazy block needs to be parsed later. The document itself lives in a block
+	std::mutex lazyMutex;
+	bool lazyEscapes;
+	bool hasLazySymbols;
+	std::vector<std::string> lazySymbols;
+	// The first error any lazy block ran into
+	KeyValueErrorCode lazyError;
+	// The first error the last Parse ran into
+	KeyValueError parseError;
+	// Only set while Parse is running. Offsets are counted from parseStart, and parseErrors is KeyValueParseOptions::errors
+	const char* parseStart;
+	std::vector<KeyValueError>* parseErrors;
+	// How many versions are chained up through baseVersion, and how many bytes all of their edits have taken
+	size_t chainLength;
+	size_t chainBytes;
+	// Size of the last fully owned version in the chain. Once the edits outweigh it, the chain gets flattened
+	size_t flatBytes;
+
+	// Where the insides of a block, everything between its braces, landed in serialText
+	struct SerialSpan
+	{
+		// Whoever holds the block. Null when that's the root, since the root can move
+		KeyValue* parent;
+		// Counted from the start of the parent's insides, so that it stays right when the parent gets copied somewhere else
+		size_t offset;
+		size_t length;
+	};
+
+	// What the root's last Serialize wrote, and where every block ended up in it. Both are on the regular heap, outside of
+	// allocator's budget, since Serialize hands the text back as a std::string
+	bool hasSerialText;
+	bool serialEscapes;
+	// Whether anything's been marked dirty since
+	bool serialChanged;
+	std::string serialText;
+	std::unordered_map<const KeyValue*, SerialSpan> serialSpans;
+
 	friend KeyValue;
 	friend KeyValueRoot;
+	friend KeyValueSnapshot;
+	friend KeyValueTransaction;
+	friend KeyValueExtractor;
 };
 
 class KeyValueRoot : public KeyValue
@@ -202,30 +728,666 @@ class KeyValueRoot : public KeyValue
 public:
 	KeyValueRoot(const char* str);
 	KeyValueRoot();
+	// Every allocation the root makes goes through allocator, which has to outlive the root
+	explicit KeyValueRoot(KeyValueAllocator& allocator);
 	~KeyValueRoot();
 
 	// No copying! It'll be very expensive!
 	KeyValueRoot( const KeyValueRoot& ) = delete;
-	// No moving! It'll require us to update many references and be expensive!
-	KeyValueRoot( KeyValueRoot&& ) = delete;
+	// Moving only swaps a few pointers. A moved from root is invalid until it's Reset or assigned to
+	KeyValueRoot( KeyValueRoot&& other ) noexcept;
+	KeyValueRoot& operator=( KeyValueRoot&& other ) noexcept;
 
 
 	// Makes access times faster and decreases memory usage at the cost of irreversibly making the kv read-only and slowing down delete time
-	void Solidify();
+	void Solidify(KeyValueSolidifyMode mode = KeyValueSolidifyMode::DOCUMENT_ORDER);
+	// Parse expects an empty root. To parse into a root that's been used already, Reset it first
 	KeyValueErrorCode Parse(const char* str, bool useEscapeSequences = false);
+	KeyValueErrorCode Parse(const char* str, const KeyValueParseOptions& options);
+
+	// Empties the root, but holds onto its memory so that the next Parse can reuse it without allocating
+	// A moved from root gets new memory from the allocator it was made with
+	void Reset();
+
+	// Where the last Parse went wrong, or the first error it got past when collecting errors. code is NONE if nothing did.
+	// Everything Parse read before an error is kept
+	KeyValueError LastError() const;
+	// The first error hit parsing a lazy block, or NONE. Blocks that hit one come out empty
+	KeyValueErrorCode LazyError() const;
+
+	// Tallies up what the root is holding onto. Walks the whole tree, lazy blocks included, so don't call it anywhere hot
+	KeyValueStats GetStats() const;
+
+	// Deep copies the whole tree into a new root. Much faster than a trip through ToString and Parse
+	// Clones use the same allocator as whatever they were cloned from
+	KeyValueRoot Clone() const;
+	// Deep copies the children of kv into a new root. kv can belong to any root
+	static KeyValueRoot CloneSubtree(const KeyValue& kv);
+
+	// Makes a patch that turns the children of from into the children of to, as far as keys and values go. New children end up
+	// on the end, so the order can differ from to's. from and to can belong to any root
+	static KeyValueRoot Diff(const KeyValue& from, const KeyValue& to);
+
+	// The same text ToString makes, kept by the root until the next Serialize, Solidify, Reset or Parse. Edits flag the blocks
+	// they touch, so the next call only re-renders those and copies everything else out of this one.
+	// The text and the table of where each block landed in it come off the regular heap, not the root's KeyValueAllocator,
+	// so they don't count towards its budget. Expect about the size of the text again, plus a map entry for every block
+	const std::string& Serialize(bool useEscapeSequences = false);
 
 private:
 
-	// This string buffer exists to hold *all parsed* key and value strings. 
-	char* stringBuffer;
-	// bufferSize is tallied up during the parse as the total length of all parsed strings, and stringBuffer is allocated using it.
-	size_t bufferSize;
+	void Swap(KeyValueRoot& other);
 
-	KeyValuePool<KeyValue> readPool;
-	KeyValuePool<KeyValue> writePool;
-	KeyValuePool<char*> writePoolStrings;
+	// Gives every big node in the solid array nodes, and the root, a sorted list of its children
+	void SortKeys(KeyValue* nodes, size_t nodeCount);
+	// Same, but only for the nodes listed, which can be anywhere. The root only gets one if it's listed too
+	void SortKeys(const std::vector<KeyValue*>& nodes);
+	// Sorts node's children into indices at offset, if it's big enough to be worth it, and moves offset past them
+	static void SortChildren(KeyValue& node, unsigned int* indices, unsigned int& offset);
 
-	bool solidified;
+	// Pulls every #include and #base out of the top level, and brings in what they point at
+	KeyValueErrorCode ResolveIncludes(const KeyValueParseOptions& options);
+	// Appends a copy of source to parent, and returns it. Only the kvs get copied. Strings stay wherever source's are
+	KeyValue* AppendCopy(KeyValue& parent, const KeyValue& source);
+	// Copies in everything from base that into doesn't have already
+	void MergeBase(KeyValue& into, const KeyValue& base);
 
-	friend KeyValue;
+	// What storage comes from. Unlike storage, it stays put when the root is moved from
+	KeyValueAllocator* allocator;
+
+	friend KeyValueSnapshot;
+	friend KeyValueTransaction;
+};
+
+
+////////////////////////
+// Key Value Includes //
+////////////////////////
+// #include "file" appends the top level of file to the top level of the document.
+// #base "file" merges file in underneath the document. Only keys the document doesn't have get added, and nodes both of them
+// have get merged the same way. Includes are applied before bases, so included keys win over base keys too.
+//
+// Included files can have their own includes. Anything that includes itself, even through other files, fails with INCLUDE_FAILED.
+//
+
+// Finds and reads the files that #include and #base point at
+class KeyValueResolver
+{
+public:
+	virtual ~KeyValueResolver() {}
+
+	// Works out which file path means, when it's written in the document at from. from is null if the document didn't give its path.
+	// The same file must always resolve to the same name, as that's what the cache goes by
+	virtual bool Resolve(const char* from, const char* path, std::string& resolved) = 0;
+	// Reads the whole of a resolved file
+	virtual bool Read(const std::string& resolved, std::string& contents) = 0;
+};
+
+// Reads files off of the disk. Paths are relative to the including file, or to directory when there isn't one
+class KeyValueFileResolver : public KeyValueResolver
+{
+public:
+	explicit KeyValueFileResolver(const char* directory = "");
+
+	bool Resolve(const char* from, const char* path, std::string& resolved) override;
+	bool Read(const std::string& resolved, std::string& contents) override;
+
+private:
+	std::string directory;
+};
+
+// Every file included through it, parsed once per escape setting and symbol set and solidified. Safe to share between threads
+// and documents.
+// Two threads asking for the same new file at once might both parse it, but only one of them makes it into the cache
+class KeyValueIncludeCache
+{
+public:
+	// Files are parsed with allocator, which has to outlive the cache and every document that included anything through it
+	explicit KeyValueIncludeCache(KeyValueResolver& resolver, KeyValueAllocator& allocator = KeyValueAllocator::Default());
+
+	// No copying! Share the cache itself
+	KeyValueIncludeCache( const KeyValueIncludeCache& ) = delete;
+
+	// Hands back the file path points at, parsing it the first time it's asked for. Null if it couldn't be loaded
+	std::shared_ptr<const KeyValueRoot> Load(const char* from, const char* path, const KeyValueParseOptions& options);
+
+	// Forgets every file. Documents that included them keep what they already have
+	void Clear();
+	size_t FileCount() const;
+
+private:
+	KeyValueResolver& resolver;
+	KeyValueAllocator& allocator;
+
+	mutable std::mutex mutex;
+	std::unordered_map<std::string, std::shared_ptr<const KeyValueRoot>> files;
+};
+
+
+///////////////////////
+// Key Value Merging //
+///////////////////////
+// Usage:
+//
+// config.Merge(site);                                 // Keys site has win, and nodes that both have get merged too
+// config.Merge(host, KeyValueMergePolicy::OVERRIDE);  // host's nodes replace ours whole instead
+//
+// KeyValueRoot patch = KeyValueRoot::Diff(before, after); // Just what changed. Send patch.ToString() wherever it needs to go
+// replica.ApplyPatch(patch);                              // replica has after's keys and values now, as long as it matched before
+//
+// Keys are matched case insensitively, same as Get. If there's more than one child with a key, Merge only goes for the first.
+// A patch is a kv too. Each of its children is one operation on the children of whatever it's applied to:
+//   "+" { "Key" ... }       Adds a copy of Key on the end
+//   "=" { "Key" ... }       Replaces the first child named Key with a copy of this one
+//   "~" { "Key" { ... } }   Applies the patch inside to the first child named Key
+//   "-" "Key"               Removes the first child named Key
+// A number after the operation picks a later child with the same key, counting from 0, so "-2" "Key" removes the third Key.
+// Children are counted as they were before the patch. New children always go on the end, and moves aren't kept track of, so
+// a patched kv has the same children as the one it was diffed against, but not always in the same order. Children with the
+// same key do stay in the same order as each other.
+//
+// Strings get copied into shared blocks, so a big merge costs a handful of allocations instead of one per string.
+// Whatever gets replaced or removed stays in the root's memory until the root is Reset.
+//
+
+
+///////////////////////
+// Key Value Queries //
+///////////////////////
+// Usage:
+//
+// KeyValueQuery query("entities/*[team=2]/model"); // Compile once...
+// std::vector<KeyValue*> models = query.Run(kv);   // ...and run it against as many trees as you like
+//
+// KeyValueQuery batch;
+// batch.AddPath("entities/*[classname=npc_combine_s]");
+// batch.AddPath("**/sound");
+// std::vector<std::vector<KeyValue*>> found;
+// batch.Run(kv, found); // Both paths in one walk over kv. found[0] and found[1] get what each of them matched
+//
+// A path is steps separated by '/'. Each step matches one level down:
+//   name       Children named name, matched case insensitively like Get. Quote it, "like/this", if it has any of /[]*" in it
+//   *          Any child
+//   **         Any number of levels, none included. "**/model" finds model anywhere, and "a/**" is a and everything in it
+// Steps other than ** can be followed by predicates, which all have to hold:
+//   [key]          Has a child named key
+//   [key=value]    Has a child named key with exactly this value. != works too. Quote the value if it has a ] in it
+//   [key<10]       Has a child named key whose value is a number less than 10. <=, > and >= work too
+//   [=value]       Leave out the key to test the kv's own value
+//
+// Matches come back in document order, and never include the kv the query was run on. Only walks as far down as a path
+// could still match, so anchored paths are cheap even on huge trees. Queries are read-only and safe to share between threads.
+//
+
+class KeyValueQuery
+{
+public:
+	KeyValueQuery() {}
+	// If path doesn't make sense, the query comes out empty. Use AddPath to find out
+	explicit KeyValueQuery(const char* path);
+
+	// Adds another path to run in the same walk. Returns false, and adds nothing, if path doesn't make sense
+	bool AddPath(const char* path);
+	size_t PathCount() const { return pathCount; }
+
+	// Everything any of the paths matched, each only once
+	std::vector<KeyValue*> Run(const KeyValue& root) const;
+	// results[i] gets everything path i matched
+	void Run(const KeyValue& root, std::vector<std::vector<KeyValue*>>& results) const;
+
+private:
+
+	enum class StepType
+	{
+		NAME,
+		ANY,
+		DESCENDANTS,
+		// Past the last step of a path. Anything that gets here is a match
+		MATCH,
+	};
+
+	enum class Comparison
+	{
+		EXISTS,
+		EQUAL,
+		NOT_EQUAL,
+		LESS,
+		LESS_EQUAL,
+		GREATER,
+		GREATER_EQUAL,
+	};
+
+	struct Predicate
+	{
+		// Empty for the kv's own value
+		std::string key;
+		Comparison comparison;
+		std::string value;
+		// value as a number, for the comparisons that need one
+		double number;
+	};
+
+	struct Step
+	{
+		StepType type;
+		std::string name;
+		std::vector<Predicate> predicates;
+		// Which path this step is from
+		size_t path;
+	};
+
+	struct Walk;
+	void WalkChildren(const KeyValue& node, size_t depth, Walk& walk) const;
+	static bool Test(const Predicate& predicate, const KeyValue& kv);
+
+	// Every path's steps one after the other, each ending in a MATCH
+	std::vector<Step> steps;
+	// Where each path's steps start
+	std::vector<size_t> starts;
+	size_t pathCount = 0;
+};
+
+
+//////////////////////////
+// Key Value Extraction //
+//////////////////////////
+// Usage:
+//
+// KeyValueExtractor extractor;
+// size_t damage = extractor.AddColumn("stats/damage", KeyValueColumnType::NUMBER);
+// size_t model = extractor.AddColumn("model", KeyValueColumnType::STRING);
+// KeyValueColumns columns;
+// extractor.Run(roots, columns); // One row per root, spread over every core
+// for (size_t row = 0; row < columns.rows; row++)
+//     if (columns[damage].IsValid(row)) total += columns[damage].numbers[row];
+//
+// Paths are keys separated by '/', matched case insensitively like Get, and the first child with a key is the one that counts.
+// Paths that start the same way share their lookups, and each node a path goes through only has its children looked at once,
+// however many paths go through it. Solid trees sorted with SORT_KEYS get binary searched instead.
+//
+// A row's bit in a column's validity bitmap is set when its path led to a value, and for NUMBER and INTEGER columns, when all of
+// that value was a number. Rows that aren't valid are left as 0, or a null string. STRING columns point straight into the roots,
+// so they're only good for as long as the roots are. Roots are only read, so Run can share them with other readers.
+//
+
+enum class KeyValueColumnType
+{
+	// Doubles
+	NUMBER,
+	// long longs. Anything with a decimal point doesn't count
+	INTEGER,
+	// The values themselves
+	STRING,
+};
+
+struct KeyValueColumn
+{
+	KeyValueColumnType type;
+
+	// Only the one for type gets filled in, with one entry per row
+	std::vector<double> numbers;
+	std::vector<long long> integers;
+	std::vector<kvString_t> strings;
+
+	// One bit per row, 64 rows to a word
+	std::vector<uint64_t> valid;
+
+	bool IsValid(size_t row) const { return (valid[row >> 6] >> (row & 63)) & 1; }
+	size_t ValidCount() const;
+};
+
+// What KeyValueExtractor::Run fills in. Columns are in the order they were added
+struct KeyValueColumns
+{
+	size_t rows = 0;
+	std::vector<KeyValueColumn> columns;
+
+	KeyValueColumn& operator[](size_t column) { return columns[column]; }
+	const KeyValueColumn& operator[](size_t column) const { return columns[column]; }
+};
+
+// Pulls the same paths out of lots of roots at once. Safe to share between threads once every column's been added
+class KeyValueExtractor
+{
+public:
+	// Returns which column the path's values will end up in. The same path can be added more than once, as different types
+	size_t AddColumn(const char* path, KeyValueColumnType type);
+	size_t ColumnCount() const { return types.size(); }
+
+	// Row i comes from roots[i]. Nulls and invalid kvs make rows with nothing valid in them.
+	// threadCount 0 uses every core. Only big batches get split up, since threads cost more than a few small roots do
+	void Run(const std::vector<const KeyValue*>& roots, KeyValueColumns& columns, size_t threadCount = 0) const;
+
+private:
+
+	// One key of one or more paths. Paths that start with the same keys share segments
+	struct Segment
+	{
+		std::string key;
+		std::vector<size_t> children;
+		// Columns whose path ends here
+		std::vector<size_t> columns;
+	};
+
+	void ExtractChildren(const KeyValue& node, const Segment& segment, size_t row, KeyValueColumns& columns) const;
+	void Fill(const KeyValue& kv, const Segment& segment, size_t row, KeyValueColumns& columns) const;
+
+	// The first one is the root, and has no key
+	std::vector<Segment> segments = std::vector<Segment>(1);
+	std::vector<KeyValueColumnType> types;
+};
+
+
+////////////////////
+// Key Value JSON //
+////////////////////
+// Usage:
+//
+// KeyValueStringWriter json;
+// KeyValueJson::ToJson(kvText, json);        // json.output is {"AwesomeNode":{"Taco":"Time!"},"CoolKey":"CoolValue"}
+// KeyValueStringWriter kv;
+// KeyValueJson::FromJson(json.output.c_str(), kv); // And back again
+//
+// Neither direction builds a tree. The input is read straight through with the same lexer Parse uses, and the output goes
+// to the writer in pieces of bufferSize, so memory stays flat no matter how big the document is. The exception is ARRAYS,
+// which has to read the document once beforehand to find every duplicate key. It holds onto the duplicates it finds.
+//
+// Going to JSON, every value is a string. Coming from JSON, numbers, true and false are written out as they are, and null
+// becomes an empty string. Escapes are translated both ways, with useEscapeSequences deciding how the kv side is read and
+// written. [$CONDITIONAL] tags and #include are left alone, like Parse does without symbols or an include cache.
+//
+// Since output goes out as it's made, an error can turn up after some of it has already been written. Whatever the writer
+// got before an error is undefined, and should be thrown away.
+//
+
+// Where transcoded output goes
+class KeyValueWriter
+{
+public:
+	virtual ~KeyValueWriter() {}
+
+	// Returning false stops the transcode with WRITE_FAILED
+	virtual bool Write(const char* data, size_t length) = 0;
+};
+
+// Collects everything into one string
+class KeyValueStringWriter : public KeyValueWriter
+{
+public:
+	bool Write(const char* data, size_t length) override { output.append(data, length); return true; }
+
+	std::string output;
+};
+
+// What to do with keys that show up more than once in the same block. JSON objects aren't supposed to have any
+enum class KeyValueJsonDuplicates
+{
+	// Write them into the object anyway. Most JSON readers keep the last one
+	KEEP,
+	// Gather every value of a duplicated key into an array, where the first one was. Arrays become duplicates on the way back
+	ARRAYS,
+	// Blocks become arrays of [key, value] pairs instead of objects, so nothing about the order is lost
+	ORDERED_PAIRS,
+};
+
+struct KeyValueJsonOptions
+{
+	// How the kv side reads and writes backslashes, same as Parse
+	bool useEscapeSequences = false;
+	KeyValueJsonDuplicates duplicates = KeyValueJsonDuplicates::ARRAYS;
+	// How much output is collected before it's handed to the writer
+	size_t bufferSize = 65536;
+};
+
+class KeyValueJson
+{
+public:
+	// kv is a whole document, the same as Parse takes. Nothing is written if kv has a syntax error, unless it's using KEEP or
+	// ORDERED_PAIRS, in which case whatever came before the error has already gone out
+	static KeyValueErrorCode ToJson(const char* kv, KeyValueWriter& writer, const KeyValueJsonOptions& options = KeyValueJsonOptions());
+	// json has to be an object, or an array of pairs when using ORDERED_PAIRS. Arrays inside of arrays become nodes with
+	// their elements numbered from 0. Without useEscapeSequences, a key or value with a " in it makes the transcode return
+	// NEEDS_ESCAPE_SEQUENCES, since the text written for it couldn't be parsed back. Like any other error, it can turn up after
+	// part of the output has gone to the writer
+	static KeyValueErrorCode FromJson(const char* json, KeyValueWriter& writer, const KeyValueJsonOptions& options = KeyValueJsonOptions());
+};
+
+
+/////////////////////////
+// Key Value Snapshots //
+/////////////////////////
+// Usage:
+//
+// KeyValueStore store(KeyValueSnapshot(std::make_shared<KeyValueRoot>(text))); // Solidifies the root and publishes it
+//
+// // Readers, on any thread. Snapshot never takes a lock
+// KeyValueSnapshot snap = store.Snapshot(); // Holds this version alive for as long as snap exists
+// printf(snap["AwesomeNode"]["Taco"].Value().string);
+//
+// // A writer
+// KeyValueTransaction tx(store.Snapshot());
+// tx.Set("AwesomeNode/Taco", "Tuesday"); // Only AwesomeNode and its children get copied. Everything else is shared
+// tx.AddNode("", "NewNode");
+// store.Publish(tx.Commit()); // Readers pick up the new version on their next Snapshot()
+//
+// Paths are keys separated by '/', matched the same way as Get. An empty path is the root.
+//
+
+// An immutable, reference counted view of a solidified tree. Cheap to copy and safe to read from any number of threads
+class KeyValueSnapshot
+{
+public:
+	KeyValueSnapshot() {}
+	// Takes ownership of root, solidifying it if it isn't already. Nothing else may modify root after this!
+	explicit KeyValueSnapshot(std::shared_ptr<KeyValueRoot> root);
+
+	const KeyValue& Root() const;
+	bool IsValid() const { return root != nullptr; }
+
+	const KeyValue& Get(const char* keyName) const { return Root().Get(keyName); }
+	const KeyValue& At(size_t index) const { return Root().At(index); }
+	inline const KeyValue& operator[](const char* keyName) const { return Get(keyName); }
+	inline const KeyValue& operator[](size_t index) const { return At(index); }
+	KeyValueRange GetAll(const char* keyName) const { return Root().GetAll(keyName); }
+
+private:
+	std::shared_ptr<const KeyValueRoot> root;
+
+	friend KeyValueStore;
+	friend KeyValueTransaction;
+};
+
+// Holds the latest snapshot and swaps in new ones atomically. Snapshot never locks: a reader claims one of a handful of
+// slots, marks the version it's about to take a reference to in it, and lets go once it has. Publish only frees an old
+// version once no slot has it marked. Writers do lock against each other
+class KeyValueStore
+{
+public:
+	KeyValueStore();
+	explicit KeyValueStore(const KeyValueSnapshot& initial);
+	~KeyValueStore();
+
+	// No copying! Readers should share the store itself
+	KeyValueStore( const KeyValueStore& ) = delete;
+
+	KeyValueSnapshot Snapshot() const;
+
+	void Publish(const KeyValueSnapshot& snapshot);
+	// Only publishes if nobody else has published since expected was taken. Returns false if someone beat us to it
+	bool Publish(const KeyValueSnapshot& expected, const KeyValueSnapshot& desired);
+
+private:
+	// One published snapshot. Never changes once it's out, and is only freed once nothing's reading it
+	struct Version
+	{
+		std::shared_ptr<const KeyValueRoot> root;
+	};
+
+	// Swaps version in, and frees whatever old ones readers are done with. Needs writeMutex
+	void Install(Version* version);
+	// What a slot holds once a reader's claimed it, but before it's marked anything
+	static Version* Claimed();
+
+	std::atomic<Version*> current;
+	// Each is null, Claimed, or the version a reader is taking a reference to
+	std::unique_ptr<std::atomic<Version*>[]> readers;
+
+	std::mutex writeMutex;
+	// Replaced versions that a reader might still have marked
+	std::vector<Version*> retired;
+};
+
+// Builds the next version of a snapshot, copying only the nodes along the paths it changes
+class KeyValueTransaction
+{
+public:
+	// The new version uses the same allocator as base. allocator is only for when base is empty
+	explicit KeyValueTransaction(const KeyValueSnapshot& base, KeyValueAllocator& allocator = KeyValueAllocator::Default());
+
+	// No copying! Each transaction makes exactly one version
+	KeyValueTransaction( const KeyValueTransaction& ) = delete;
+
+	// Sets the value of the pair at path, adding it to its parent if it doesn't exist yet
+	bool Set(const char* path, const char* value);
+	// Appends a new pair or node to the node at path
+	bool Add(const char* path, const char* key, const char* value);
+	bool AddNode(const char* path, const char* key);
+	// Removes the first child matching path
+	bool Remove(const char* path);
+
+	// Finishes the version. The transaction can't be used after this
+	KeyValueSnapshot Commit();
+
+private:
+
+	// Makes sure node's children live in memory we own, copying them out of the base version if they don't
+	KeyValue* Own(KeyValue& node);
+	// Walks a path of keys, owning every node along the way. Returns null if any of it is missing
+	KeyValue* Walk(const char* path, size_t pathLength);
+	KeyValue* Append(KeyValue& parent, const char* key);
+	// Lists node and every node under it whose children we've copied
+	void CollectOwned(KeyValue& node, std::vector<KeyValue*>& owned);
+
+	std::shared_ptr<KeyValueRoot> root;
+
+	// Bytes of node arrays and strings this version has copied
+	size_t copiedBytes;
+};
+
+
+/////////////////////////
+// Key Value Reloading //
+/////////////////////////
+// Usage:
+//
+// KeyValueReloader reloader;
+// KeyValueStore& items = reloader.Watch("scripts/items.txt"); // Parses the file now. Readers take Snapshot()s of it like any other store
+// reloader.Subscribe("scripts/items.txt", "weapons/shotgun", listener); // listener hears about anything that changes in, at or above shotgun
+// reloader.Poll(); // Reloads whatever changed on disk since the last Poll. Call it from your main loop, or a thread of its own
+//
+// On Linux, inotify says which files were written to, so Poll only reads those. Anywhere else, or for files in directories that
+// can't be watched, every file gets read each Poll. Either way a file is only parsed when its contents hash differently than
+// last time, so saving a file without changing it costs one read. A file that fails to load keeps its last good version.
+//
+// Changes are worked out with Diff, so a block that got replaced is one change at the block's path, not one per key in it.
+// Files reached through #include and #base aren't watched, and the include cache keeps handing back the versions it already has.
+//
+// Watch, Subscribe, Unsubscribe and Poll must never overlap, and listeners mustn't call them. Snapshots of the stores can be
+// taken from any thread at any time.
+//
+
+enum class KeyValueChangeType
+{
+	ADDED,
+	REMOVED,
+	CHANGED,
+};
+
+// One difference between a file's last version and its new one
+struct KeyValueChange
+{
+	KeyValueChangeType type;
+	// Keys from the top of the file down to whatever changed, separated by '/' like snapshot paths
+	std::string path;
+};
+
+// Hears about files getting reloaded. See KeyValueReloader::Subscribe
+class KeyValueListener
+{
+public:
+	virtual ~KeyValueListener() {}
+
+	// Called from Poll, once snapshot has been published. changes only has the ones that touch the path subscribed to
+	virtual void OnReload(const std::string& file, const KeyValueSnapshot& snapshot, const std::vector<KeyValueChange>& changes) = 0;
+};
+
+// Keeps one store per file, and publishes a new snapshot to it whenever the file changes
+class KeyValueReloader
+{
+public:
+	// options get used for every file, with path set to the file being parsed. Anything they point at has to outlive the reloader.
+	// Files are parsed with allocator, which has to outlive the reloader and every snapshot taken from it
+	explicit KeyValueReloader(const KeyValueParseOptions& options = KeyValueParseOptions(), KeyValueAllocator& allocator = KeyValueAllocator::Default());
+	~KeyValueReloader();
+
+	// No copying! The stores are handed out by reference
+	KeyValueReloader( const KeyValueReloader& ) = delete;
+
+	// Starts watching file, loading it straight away. The store lives as long as the reloader does. Watching a file twice hands back
+	// the same store. If the file couldn't be loaded, the store stays empty until it can be
+	KeyValueStore& Watch(const char* file);
+	// Null if file isn't being watched
+	KeyValueStore* Store(const char* file);
+	// What went wrong the last time file was read or parsed. NO_INPUT if it couldn't be read. NONE once it loads fine again
+	KeyValueErrorCode Error(const char* file) const;
+
+	// path is keys separated by '/', matched case insensitively like Get. An empty path hears about every change to the file
+	void Subscribe(const char* file, const char* path, KeyValueListener& listener);
+	// Stops listener hearing about anything
+	void Unsubscribe(KeyValueListener& listener);
+
+	// Reloads every file that has changed, then tells listeners. Returns how many files got a new version
+	size_t Poll();
+
+private:
+
+	struct File
+	{
+		std::string path;
+		// What the file is called in its directory, which is how inotify refers to it
+		std::string name;
+		// inotify watch on the directory. -1 if there isn't one, in which case every Poll reads the file
+		int watch;
+		bool pending;
+
+		// Of the contents last read, whether or not they parsed
+		bool hashed;
+		uint64_t hash;
+		size_t length;
+
+		KeyValueErrorCode error;
+		KeyValueStore store;
+	};
+
+	struct Subscription
+	{
+		std::string file;
+		std::string path;
+		KeyValueListener* listener;
+	};
+
+	// Reads and parses file if its contents changed, publishing the result. Returns whether anything got published
+	bool Load(File& file);
+	// Flags files inotify says were written to. Returns true if events got dropped and everything should be checked
+	bool ReadEvents();
+
+	KeyValueParseOptions options;
+	KeyValueAllocator& allocator;
+	KeyValueFileResolver disk;
+
+	std::unordered_map<std::string, std::unique_ptr<File>> files;
+	std::vector<Subscription> subscriptions;
+
+	// -1 when there's no inotify
+	int notifyFd;
 };
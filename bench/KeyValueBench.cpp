@@ -0,0 +1,750 @@
+//
+// SpeedyKeyV
+// https://github.com/ozxybox/SpeedyKeyV
+//
+
+#include "KeyValue.h"
+#include "KeyValueCorpus.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+
+/////////////////////
+// Key Value Bench //
+/////////////////////
+// Usage: keyvalues_bench [--shape wide|deep|escapes|comments|quoteless] [--size bytes] [--iterations n] [--lookups n] [--threads n]
+//
+// Generates a corpus for every shape (or just the one asked for) and times each operation on it.
+// Results are printed as CSV, one line per shape and operation, so runs can be diffed between releases:
+//
+// shape,operation,bytes,iterations,mb_per_sec,ns_per_op,allocations
+//
+// bytes is what mb_per_sec is measured against, and is blank for operations that aren't about throughput.
+// allocations is per iteration, and is -1 where we can't count them.
+// get_threads_N runs lock-free lookups from N threads at once, and should scale with N.
+//
+
+#if defined(__GLIBC__)
+
+// Count every allocation by sitting in front of glibc's malloc. new and delete go through these too
+static std::atomic<size_t> allocationCount(0);
+
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* ptr, size_t size);
+
+extern "C" void* malloc(size_t size)
+{
+	allocationCount.fetch_add(1, std::memory_order_relaxed);
+	return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size)
+{
+	allocationCount.fetch_add(1, std::memory_order_relaxed);
+	return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* ptr, size_t size)
+{
+	allocationCount.fetch_add(1, std::memory_order_relaxed);
+	return __libc_realloc(ptr, size);
+}
+
+static long long Allocations() { return (long long)allocationCount.load(std::memory_order_relaxed); }
+
+#else
+
+static long long Allocations() { return -1; }
+
+#endif
+
+struct BenchOptions
+{
+	size_t size = 8 * 1024 * 1024;
+	size_t iterations = 5;
+	size_t lookups = 1000000;
+	size_t threads = 0;
+	KeyValueCorpusShape shape = KeyValueCorpusShape::COUNT;
+};
+
+// Accumulates the time and allocations of only the parts of an iteration we care about
+class BenchTimer
+{
+public:
+	void Start()
+	{
+		allocations = Allocations();
+		start = std::chrono::steady_clock::now();
+	}
+
+	void Stop()
+	{
+		seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		if (allocations >= 0)
+			totalAllocations += Allocations() - allocations;
+		else
+			totalAllocations = -1;
+	}
+
+	double seconds = 0;
+	long long totalAllocations = 0;
+
+private:
+	std::chrono::steady_clock::time_point start;
+	long long allocations = 0;
+};
+
+static void Report(KeyValueCorpusShape shape, const std::string& operation, size_t bytes, size_t iterations, size_t opsPerIteration, const BenchTimer& timer)
+{
+	printf("%s,%s,", KeyValueCorpus::ShapeName(shape), operation.c_str());
+
+	if (bytes > 0)
+		printf("%zu,%zu,%.2f,", bytes, iterations, (bytes * iterations) / timer.seconds / (1024.0 * 1024.0));
+	else
+		printf(",%zu,,", iterations);
+
+	printf("%.2f,", timer.seconds * 1e9 / (double)(iterations * opsPerIteration));
+
+	if (timer.totalAllocations >= 0)
+		printf("%lld\n", timer.totalAllocations / (long long)iterations);
+	else
+		printf("-1\n");
+
+	fflush(stdout);
+}
+
+// Throws transcoded output away, so only the transcoder gets timed
+class DiscardWriter : public KeyValueWriter
+{
+public:
+	bool Write(const char* /*data*/, size_t length) override { written += length; return true; }
+
+	size_t written = 0;
+};
+
+struct Lookup
+{
+	const KeyValue* parent;
+	const char* key;
+};
+
+// Picks lookups spread across the whole tree
+static void GatherLookups(const KeyValue& kv, std::vector<Lookup>& lookups, size_t stride, size_t& counter)
+{
+	for (const KeyValue& child : kv)
+	{
+		if (counter++ % stride == 0)
+			lookups.push_back({ &kv, child.Key().string });
+
+		if (child.HasChildren())
+			GatherLookups(child, lookups, stride, counter);
+	}
+}
+
+static void RunLookups(const std::vector<Lookup>& lookups, size_t count, size_t offset, size_t& found)
+{
+	size_t hits = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		const Lookup& lookup = lookups[(i + offset) % lookups.size()];
+		hits += lookup.parent->Get(lookup.key).IsValid();
+	}
+	found = hits;
+}
+
+// Same lookups, but every kv with the key instead of the first
+static void RunGetAll(const std::vector<Lookup>& lookups, size_t count, size_t offset, size_t& found)
+{
+	size_t hits = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		const Lookup& lookup = lookups[(i + offset) % lookups.size()];
+		for (const KeyValue& kv : lookup.parent->GetAll(lookup.key))
+			hits += kv.HasChildren() ? 2 : 1;
+	}
+	found = hits;
+}
+
+// Reads the first byte of every key and value, which is about the least any real visitor would do
+class TouchVisitor : public KeyValueVisitor
+{
+public:
+	bool Visit(const KeyValue& kv, size_t depth) override
+	{
+		touched += (unsigned char)kv.Key().string[0] + depth;
+		if (!kv.HasChildren())
+			touched += (unsigned char)kv.Value().string[0];
+		return true;
+	}
+
+	size_t touched = 0;
+};
+
+// The same thing with plain recursion through Children and Next, for comparison
+static void TouchRecursive(const KeyValue& kv, size_t depth, size_t& touched)
+{
+	for (const KeyValue* child = kv.Children(); child; child = child->Next())
+	{
+		touched += (unsigned char)child->Key().string[0] + depth;
+		if (child->HasChildren())
+			TouchRecursive(*child, depth + 1, touched);
+		else
+			touched += (unsigned char)child->Value().string[0];
+	}
+}
+
+static void BenchShape(KeyValueCorpusShape shape, const BenchOptions& options)
+{
+	std::string doc = KeyValueCorpus::Generate(shape, options.size);
+	const char* text = doc.c_str();
+	bool escapes = KeyValueCorpus::UsesEscapeSequences(shape);
+	size_t iterations = options.iterations;
+
+	// Parsing into a brand new root every time
+	{
+		BenchTimer timer;
+		for (size_t i = 0; i < iterations; i++)
+		{
+			KeyValueRoot kv;
+			timer.Start();
+			kv.Parse(text, escapes);
+			timer.Stop();
+		}
+		Report(shape, "parse", doc.size(), iterations, 1, timer);
+	}
+
+	// Same again, with repeated strings deduplicated
+	{
+		KeyValueParseOptions parseOptions;
+		parseOptions.useEscapeSequences = escapes;
+		parseOptions.deduplicateStrings = true;
+
+		BenchTimer timer;
+		for (size_t i = 0; i < iterations; i++)
+		{
+			KeyValueRoot kv;
+			timer.Start();
+			kv.Parse(text, parseOptions);
+			timer.Stop();
+		}
+		Report(shape, "parse_dedup", doc.size(), iterations, 1, timer);
+	}
+
+	// Parsing lazily, then reaching into one block the way a process that only needs one thing would
+	{
+		KeyValueParseOptions parseOptions;
+		parseOptions.useEscapeSequences = escapes;
+		parseOptions.lazy = true;
+
+		BenchTimer parseTimer, lookupTimer;
+		for (size_t i = 0; i < iterations; i++)
+		{
+			KeyValueRoot kv;
+			parseTimer.Start();
+			lookupTimer.Start();
+			kv.Parse(text, parseOptions);
+			parseTimer.Stop();
+
+			const KeyValue& last = kv.At(kv.ChildCount() - 1);
+			last.At(last.ChildCount() / 2);
+			lookupTimer.Stop();
+		}
+		Report(shape, "parse_lazy", doc.size(), iterations, 1, parseTimer);
+		Report(shape, "first_lookup_lazy", doc.size(), iterations, 1, lookupTimer);
+	}
+
+	// Parsing into the same root over and over, like a parse per request would
+	{
+		KeyValueRoot kv;
+		kv.Parse(text, escapes);
+
+		BenchTimer timer;
+		for (size_t i = 0; i < iterations; i++)
+		{
+			timer.Start();
+			kv.Reset();
+			kv.Parse(text, escapes);
+			timer.Stop();
+		}
+		Report(shape, "parse_reuse", doc.size(), iterations, 1, timer);
+	}
+
+	for (int sorted = 0; sorted < 2; sorted++)
+	{
+		KeyValueSolidifyMode mode = sorted ? KeyValueSolidifyMode::SORT_KEYS : KeyValueSolidifyMode::DOCUMENT_ORDER;
+
+		BenchTimer timer;
+		for (size_t i = 0; i < iterations; i++)
+		{
+			KeyValueRoot kv;
+			kv.Parse(text, escapes);
+			timer.Start();
+			kv.Solidify(mode);
+			timer.Stop();
+		}
+		Report(shape, sorted ? "solidify_sorted" : "solidify", doc.size(), iterations, 1, timer);
+	}
+
+	// Lookups, on a tree as it comes out of the parser and on both kinds of solid trees
+	for (int variant = 0; variant < 3; variant++)
+	{
+		static const char* const names[] = { "get", "get_solid", "get_sorted" };
+		static const char* const allNames[] = { "get_all", "get_all_solid", "get_all_sorted" };
+
+		KeyValueRoot kv;
+		kv.Parse(text, escapes);
+		if (variant == 1)
+			kv.Solidify();
+		else if (variant == 2)
+			kv.Solidify(KeyValueSolidifyMode::SORT_KEYS);
+
+		std::vector<Lookup> lookups;
+		size_t counter = 0;
+		GatherLookups(kv, lookups, 7, counter);
+		if (lookups.empty())
+			continue;
+
+		BenchTimer timer, allTimer;
+		for (size_t i = 0; i < iterations; i++)
+		{
+			size_t found;
+			timer.Start();
+			RunLookups(lookups, options.lookups, i, found);
+			timer.Stop();
+
+			allTimer.Start();
+			RunGetAll(lookups, options.lookups, i, found);
+			allTimer.Stop();
+		}
+		Report(shape, names[variant], 0, iterations, options.lookups, timer);
+		Report(shape, allNames[variant], 0, iterations, options.lookups, allTimer);
+	}
+
+	// Adding pairs onto a parsed tree
+	{
+		const size_t adds = 100000;
+		std::vector<std::string> keys;
+		for (size_t i = 0; i < adds; i++)
+			keys.push_back("added" + std::to_string(i));
+
+		BenchTimer timer;
+		for (size_t i = 0; i < iterations; i++)
+		{
+			KeyValueRoot kv;
+			kv.Parse(text, escapes);
+			KeyValue* node = kv.AddNode("bench");
+
+			timer.Start();
+			for (size_t j = 0; j < adds; j++)
+				node->Add(keys[j].c_str(), "value");
+			timer.Stop();
+		}
+		Report(shape, "add", 0, iterations, adds, timer);
+	}
+
+	{
+		KeyValueRoot kv;
+		kv.Parse(text, escapes);
+
+		size_t length = 0;
+		BenchTimer timer;
+		for (size_t i = 0; i < iterations; i++)
+		{
+			timer.Start();
+			char* str = kv.ToString(escapes);
+			timer.Stop();
+
+			length = strlen(str);
+			delete[] str;
+		}
+		Report(shape, "tostring", length, iterations, 1, timer);
+	}
+
+	// Saving again after one small edit, which only redoes the blocks on the way down to it
+	{
+		KeyValueRoot kv;
+		kv.Parse(text, escapes);
+		kv.Serialize(escapes);
+
+		KeyValue* deepest = &kv;
+		while (deepest->HasChildren())
+		{
+			KeyValue* block = nullptr;
+			for (KeyValue& child : *deepest)
+			{
+				if (child.HasChildren())
+					block = &child;
+			}
+			if (!block)
+				break;
+			deepest = block;
+		}
+
+		size_t length = 0;
+		BenchTimer timer;
+		for (size_t i = 0; i < iterations; i++)
+		{
+			deepest->Add("bench", "edited");
+			timer.Start();
+			length = kv.Serialize(escapes).size();
+			timer.Stop();
+		}
+		Report(shape, "serialize_after_edit", length, iterations, 1, timer);
+	}
+
+	{
+		KeyValueRoot kv;
+		kv.Parse(text, escapes);
+		kv.Solidify();
+
+		BenchTimer timer;
+		for (size_t i = 0; i < iterations; i++)
+		{
+			timer.Start();
+			KeyValueRoot clone = kv.Clone();
+			timer.Stop();
+		}
+		Report(shape, "clone", doc.size(), iterations, 1, timer);
+	}
+
+	// Deep merging the document over a copy of itself, so that every key matches something
+	{
+		KeyValueRoot overlay;
+		overlay.Parse(text, escapes);
+
+		BenchTimer timer;
+		for (size_t i = 0; i < iterations; i++)
+		{
+			KeyValueRoot kv;
+			kv.Parse(text, escapes);
+			timer.Start();
+			kv.Merge(overlay);
+			timer.Stop();
+		}
+		Report(shape, "merge", doc.size(), iterations, 1, timer);
+	}
+
+	// Diffing against a copy with a few changes in it, then patching a fresh parse with the result
+	{
+		KeyValueRoot from, to;
+		from.Parse(text, escapes);
+		to.Parse(text, escapes);
+
+		size_t index = 0;
+		for (KeyValue* child = to.Children(); child; child = child->Next(), index++)
+		{
+			if (index % 64 == 0 && child->HasChildren())
+				child->Add("bench", "changed");
+		}
+
+		BenchTimer diffTimer, patchTimer;
+		for (size_t i = 0; i < iterations; i++)
+		{
+			diffTimer.Start();
+			KeyValueRoot patch = KeyValueRoot::Diff(from, to);
+			diffTimer.Stop();
+
+			KeyValueRoot kv;
+			kv.Parse(text, escapes);
+			patchTimer.Start();
+			kv.ApplyPatch(patch);
+			patchTimer.Stop();
+		}
+		Report(shape, "diff", doc.size(), iterations, 1, diffTimer);
+		Report(shape, "apply_patch", 0, iterations, 1, patchTimer);
+	}
+
+	// Queries on a solid tree. A batch runs every path in one walk, which query_separate does one walk each
+	{
+		static const char* const paths[] = { "**/*[=0]", "*/*[=1]", "**/*[=-1]", "*/*[>100]" };
+		const size_t pathCount = sizeof(paths) / sizeof(paths[0]);
+
+		KeyValueRoot kv;
+		kv.Parse(text, escapes);
+		kv.Solidify();
+
+		KeyValueQuery batch;
+		std::vector<KeyValueQuery> separate;
+		for (size_t i = 0; i < pathCount; i++)
+		{
+			batch.AddPath(paths[i]);
+			separate.emplace_back(paths[i]);
+		}
+
+		BenchTimer singleTimer, batchTimer, separateTimer;
+		for (size_t i = 0; i < iterations; i++)
+		{
+			singleTimer.Start();
+			separate[0].Run(kv);
+			singleTimer.Stop();
+
+			std::vector<std::vector<KeyValue*>> found;
+			batchTimer.Start();
+			batch.Run(kv, found);
+			batchTimer.Stop();
+
+			separateTimer.Start();
+			for (const KeyValueQuery& query : separate)
+				query.Run(kv);
+			separateTimer.Stop();
+		}
+		Report(shape, "query", doc.size(), iterations, 1, singleTimer);
+		Report(shape, "query_batch", doc.size(), iterations, 1, batchTimer);
+		Report(shape, "query_separate", doc.size(), iterations, 1, separateTimer);
+	}
+
+	// The same small document parsed into lots of roots, like a directory full of item files, with the last pair of each of
+	// its blocks pulled out of all of them. extract_get is the same thing done by hand, with a Get per key and a strtod per value
+	{
+		std::string item = KeyValueCorpus::Generate(shape, 1024);
+		size_t rootCount = std::max(options.size / item.size(), (size_t)1);
+
+		std::vector<std::unique_ptr<KeyValueRoot>> roots;
+		std::vector<const KeyValue*> rootPointers;
+		for (size_t i = 0; i < rootCount; i++)
+		{
+			roots.emplace_back(new KeyValueRoot());
+			roots.back()->Parse(item.c_str(), escapes);
+			rootPointers.push_back(roots.back().get());
+		}
+
+		std::vector<std::string> paths;
+		for (const KeyValue& block : *roots[0])
+		{
+			const KeyValue* last = nullptr;
+			for (const KeyValue& child : block)
+			{
+				if (!child.HasChildren())
+					last = &child;
+			}
+			if (last)
+				paths.push_back(std::string(block.Key().string) + "/" + last->Key().string);
+		}
+
+		KeyValueExtractor extractor;
+		for (const std::string& path : paths)
+			extractor.AddColumn(path.c_str(), KeyValueColumnType::NUMBER);
+
+		BenchTimer singleTimer, threadedTimer, getTimer;
+		double sum = 0.0;
+		for (size_t i = 0; i < iterations; i++)
+		{
+			KeyValueColumns columns;
+			singleTimer.Start();
+			extractor.Run(rootPointers, columns, 1);
+			singleTimer.Stop();
+
+			threadedTimer.Start();
+			extractor.Run(rootPointers, columns);
+			threadedTimer.Stop();
+
+			getTimer.Start();
+			for (const KeyValue* root : rootPointers)
+			{
+				for (const std::string& path : paths)
+				{
+					const KeyValue* kv = root;
+					size_t start = 0;
+					while (kv->IsValid() && start <= path.size())
+					{
+						size_t separator = path.find('/', start);
+						if (separator == std::string::npos)
+							separator = path.size();
+						kv = &kv->Get(path.substr(start, separator - start).c_str());
+						start = separator + 1;
+					}
+					if (kv->IsValid() && !kv->HasChildren())
+						sum += strtod(kv->Value().string, nullptr);
+				}
+			}
+			getTimer.Stop();
+		}
+		// So the hand written version can't be optimized away
+		volatile double sink = sum;
+		(void)sink;
+
+		Report(shape, "extract", 0, iterations, rootPointers.size(), singleTimer);
+		Report(shape, "extract_threads", 0, iterations, rootPointers.size(), threadedTimer);
+		Report(shape, "extract_get", 0, iterations, rootPointers.size(), getTimer);
+	}
+
+	// Every kv in the tree, once by hand and once in each visit order. visit_added does pre order on a tree built with Add,
+	// whose kvs and strings end up spread around the pools instead of laid out in document order
+	{
+		KeyValueRoot kv;
+		kv.Parse(text, escapes);
+
+		KeyValueRoot added;
+		added.Parse("");
+		std::vector<std::pair<const KeyValue*, KeyValue*>> pending = { { &kv, &added } };
+		for (size_t i = 0; i < pending.size(); i++)
+		{
+			for (const KeyValue& child : *pending[i].first)
+			{
+				if (child.HasChildren())
+					pending.push_back({ &child, pending[i].second->AddNode(child.Key().string) });
+				else
+					pending[i].second->Add(child.Key().string, child.Value().string);
+			}
+		}
+
+		static const char* const names[] = { "visit_preorder", "visit_postorder", "visit_bfs" };
+		static const KeyValueVisitOrder orders[] = { KeyValueVisitOrder::PRE_ORDER, KeyValueVisitOrder::POST_ORDER, KeyValueVisitOrder::BREADTH_FIRST };
+
+		BenchTimer recursiveTimer, addedRecursiveTimer, addedTimer;
+		BenchTimer orderTimers[3];
+		size_t touched = 0;
+		for (size_t i = 0; i < iterations; i++)
+		{
+			recursiveTimer.Start();
+			TouchRecursive(kv, 0, touched);
+			recursiveTimer.Stop();
+
+			for (int order = 0; order < 3; order++)
+			{
+				TouchVisitor visitor;
+				orderTimers[order].Start();
+				kv.Visit(visitor, orders[order]);
+				orderTimers[order].Stop();
+				touched += visitor.touched;
+			}
+
+			addedRecursiveTimer.Start();
+			TouchRecursive(added, 0, touched);
+			addedRecursiveTimer.Stop();
+
+			TouchVisitor visitor;
+			addedTimer.Start();
+			added.Visit(visitor);
+			addedTimer.Stop();
+			touched += visitor.touched;
+		}
+		volatile size_t sink = touched;
+		(void)sink;
+
+		Report(shape, "visit_recursive", doc.size(), iterations, 1, recursiveTimer);
+		for (int order = 0; order < 3; order++)
+			Report(shape, names[order], doc.size(), iterations, 1, orderTimers[order]);
+		Report(shape, "visit_added_recursive", doc.size(), iterations, 1, addedRecursiveTimer);
+		Report(shape, "visit_added", doc.size(), iterations, 1, addedTimer);
+	}
+
+	// Straight from text to text with no tree in between. from_json reads what to_json wrote
+	{
+		KeyValueJsonOptions jsonOptions;
+		jsonOptions.useEscapeSequences = escapes;
+
+		KeyValueStringWriter json;
+		KeyValueJson::ToJson(text, json, jsonOptions);
+
+		BenchTimer toTimer, fromTimer;
+		for (size_t i = 0; i < iterations; i++)
+		{
+			DiscardWriter toOutput, fromOutput;
+			toTimer.Start();
+			KeyValueJson::ToJson(text, toOutput, jsonOptions);
+			toTimer.Stop();
+
+			fromTimer.Start();
+			KeyValueJson::FromJson(json.output.c_str(), fromOutput, jsonOptions);
+			fromTimer.Stop();
+		}
+		Report(shape, "to_json", doc.size(), iterations, 1, toTimer);
+		Report(shape, "from_json", json.output.size(), iterations, 1, fromTimer);
+	}
+
+	// Lock-free lookups from more and more threads
+	{
+		KeyValueRoot kv;
+		kv.Parse(text, escapes);
+		kv.Solidify(KeyValueSolidifyMode::SORT_KEYS);
+
+		std::vector<Lookup> lookups;
+		size_t counter = 0;
+		GatherLookups(kv, lookups, 7, counter);
+
+		size_t maxThreads = options.threads ? options.threads : std::thread::hardware_concurrency();
+		if (maxThreads == 0)
+			maxThreads = 1;
+
+		for (size_t threadCount = 1; threadCount <= maxThreads && !lookups.empty(); threadCount *= 2)
+		{
+			std::vector<size_t> found(threadCount, 0);
+
+			BenchTimer timer;
+			timer.Start();
+			std::vector<std::thread> threads;
+			for (size_t t = 0; t < threadCount; t++)
+				threads.emplace_back(RunLookups, std::cref(lookups), options.lookups, t * 7919, std::ref(found[t]));
+			for (std::thread& thread : threads)
+				thread.join();
+			timer.Stop();
+
+			// Every thread did a full set of lookups, so report the time per lookup across all of them
+			timer.seconds /= threadCount;
+			Report(shape, "get_threads_" + std::to_string(threadCount), 0, 1, options.lookups, timer);
+		}
+	}
+}
+
+int main(int argc, char** argv)
+{
+	BenchOptions options;
+
+	for (int i = 1; i < argc; i++)
+	{
+		const char* arg = argv[i];
+		const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+		if (!value)
+		{
+			fprintf(stderr, "Missing a value for %s\n", arg);
+			return 1;
+		}
+
+		if (strcmp(arg, "--shape") == 0)
+		{
+			options.shape = KeyValueCorpus::ShapeFromName(value);
+			if (options.shape == KeyValueCorpusShape::COUNT)
+			{
+				fprintf(stderr, "Unknown shape '%s'\n", value);
+				return 1;
+			}
+		}
+		else if (strcmp(arg, "--size") == 0)
+			options.size = strtoull(value, nullptr, 10);
+		else if (strcmp(arg, "--iterations") == 0)
+			options.iterations = strtoull(value, nullptr, 10);
+		else if (strcmp(arg, "--lookups") == 0)
+			options.lookups = strtoull(value, nullptr, 10);
+		else if (strcmp(arg, "--threads") == 0)
+			options.threads = strtoull(value, nullptr, 10);
+		else
+		{
+			fprintf(stderr, "Unknown option %s\n", arg);
+			return 1;
+		}
+		i++;
+	}
+
+	if (options.iterations == 0)
+		options.iterations = 1;
+
+	printf("shape,operation,bytes,iterations,mb_per_sec,ns_per_op,allocations\n");
+
+	for (int i = 0; i < (int)KeyValueCorpusShape::COUNT; i++)
+	{
+		KeyValueCorpusShape shape = (KeyValueCorpusShape)i;
+		if (options.shape == KeyValueCorpusShape::COUNT || options.shape == shape)
+			BenchShape(shape, options);
+	}
+
+	return 0;
+}
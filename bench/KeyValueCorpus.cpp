@@ -0,0 +1,182 @@
+//
+// SpeedyKeyV
+// https://github.com/ozxybox/SpeedyKeyV
+//
+
+#include "KeyValueCorpus.h"
+#include <cstring>
+
+// How many levels DEEP documents nest before coming back up
+#define DEEP_NESTING 48
+
+// Little xorshift generator. We want the same corpus on every platform, which std's distributions don't promise
+class CorpusRandom
+{
+public:
+	CorpusRandom(unsigned int seed) : state(seed ? seed : 0x9E3779B9u) {}
+
+	unsigned int Next()
+	{
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return state;
+	}
+
+	unsigned int Range(unsigned int max) { return Next() % max; }
+
+private:
+	unsigned int state;
+};
+
+static const char* const words[] =
+{
+	"default", "model", "origin", "angles", "health", "damage", "range", "team", "material", "texture",
+	"scale", "speed", "sound", "effect", "spawnflags", "targetname", "classname", "render", "color", "weight",
+};
+static const size_t wordCount = sizeof(words) / sizeof(words[0]);
+
+static const char* const values[] =
+{
+	"0", "1", "2", "default", "255 255 255", "0 90 0", "models/props/crate01.mdl",
+	"materials/concrete/wall_03a", "1.5", "-1", "weapon_shotgun", "npc_combine_s",
+};
+static const size_t valueCount = sizeof(values) / sizeof(values[0]);
+
+// Everything in here needs an escape sequence
+static const char* const escapes[] =
+{
+	"\\\"", "\\\\", "\\n", "\\t",
+};
+static const size_t escapeCount = sizeof(escapes) / sizeof(escapes[0]);
+
+static void Indent(std::string& out, int depth)
+{
+	out.append(depth, '\t');
+}
+
+static void AppendKey(std::string& out, CorpusRandom& random, bool quoted)
+{
+	if (quoted)
+		out += '"';
+	out += words[random.Range(wordCount)];
+	out += std::to_string(random.Range(1000));
+	if (quoted)
+		out += '"';
+}
+
+static void AppendPair(std::string& out, CorpusRandom& random, int depth, KeyValueCorpusShape shape)
+{
+	bool quoted = shape != KeyValueCorpusShape::QUOTELESS;
+
+	Indent(out, depth);
+	AppendKey(out, random, quoted);
+	out += ' ';
+
+	if (shape == KeyValueCorpusShape::ESCAPES)
+	{
+		out += '"';
+		for (int i = 0; i < 4; i++)
+		{
+			out += words[random.Range(wordCount)];
+			out += escapes[random.Range(escapeCount)];
+		}
+		out += '"';
+	}
+	else if (quoted)
+	{
+		out += '"';
+		out += values[random.Range(valueCount)];
+		out += '"';
+	}
+	else
+	{
+		// Quoteless strings stop at whitespace, so only single word values make sense
+		out += words[random.Range(wordCount)];
+	}
+
+	if (shape == KeyValueCorpusShape::COMMENTS)
+	{
+		out += " // ";
+		for (int i = 0; i < 6; i++)
+		{
+			out += words[random.Range(wordCount)];
+			out += ' ';
+		}
+	}
+
+	out += '\n';
+}
+
+static void AppendBlock(std::string& out, CorpusRandom& random, int depth, KeyValueCorpusShape shape)
+{
+	bool quoted = shape != KeyValueCorpusShape::QUOTELESS;
+
+	if (shape == KeyValueCorpusShape::COMMENTS)
+	{
+		Indent(out, depth);
+		out += "// A block, with a comment on top that goes on for a while, as hand written files tend to have\n";
+	}
+
+	Indent(out, depth);
+	AppendKey(out, random, quoted);
+	out += '\n';
+	Indent(out, depth);
+	out += "{\n";
+
+	unsigned int pairs = 4 + random.Range(12);
+	for (unsigned int i = 0; i < pairs; i++)
+		AppendPair(out, random, depth + 1, shape);
+
+	if (shape == KeyValueCorpusShape::DEEP && depth < DEEP_NESTING)
+		AppendBlock(out, random, depth + 1, shape);
+
+	Indent(out, depth);
+	out += "}\n";
+}
+
+namespace KeyValueCorpus
+{
+
+std::string Generate(KeyValueCorpusShape shape, size_t targetBytes, unsigned int seed)
+{
+	CorpusRandom random(seed);
+
+	std::string out;
+	out.reserve(targetBytes + 4096);
+
+	while (out.size() < targetBytes)
+		AppendBlock(out, random, 0, shape);
+
+	return out;
+}
+
+const char* ShapeName(KeyValueCorpusShape shape)
+{
+	switch (shape)
+	{
+	case KeyValueCorpusShape::WIDE: return "wide";
+	case KeyValueCorpusShape::DEEP: return "deep";
+	case KeyValueCorpusShape::ESCAPES: return "escapes";
+	case KeyValueCorpusShape::COMMENTS: return "comments";
+	case KeyValueCorpusShape::QUOTELESS: return "quoteless";
+	default: return "unknown";
+	}
+}
+
+KeyValueCorpusShape ShapeFromName(const char* name)
+{
+	for (int i = 0; i < (int)KeyValueCorpusShape::COUNT; i++)
+	{
+		if (strcmp(name, ShapeName((KeyValueCorpusShape)i)) == 0)
+			return (KeyValueCorpusShape)i;
+	}
+	return KeyValueCorpusShape::COUNT;
+}
+
+bool UsesEscapeSequences(KeyValueCorpusShape shape)
+{
+	return shape == KeyValueCorpusShape::ESCAPES;
+}
+
+}
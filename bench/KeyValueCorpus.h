@@ -0,0 +1,46 @@
+//
+// SpeedyKeyV
+// https://github.com/ozxybox/SpeedyKeyV
+//
+
+#pragma once
+
+//////////////////////
+// Key Value Corpus //
+//////////////////////
+// Generates synthetic documents for benchmarking. The same shape, size and seed always make the same document.
+//
+// std::string doc = KeyValueCorpus::Generate(KeyValueCorpusShape::WIDE, 16 * 1024 * 1024);
+//
+
+#include <cstddef>
+#include <string>
+
+enum class KeyValueCorpusShape
+{
+	// Lots of blocks side by side, each with a handful of pairs. Think item or entity registries
+	WIDE,
+	// Blocks nested dozens of levels down
+	DEEP,
+	// Quoted strings packed with escape sequences. Parse these with useEscapeSequences!
+	ESCAPES,
+	// More comment than data
+	COMMENTS,
+	// Nothing is quoted
+	QUOTELESS,
+
+	COUNT,
+};
+
+namespace KeyValueCorpus
+{
+	// Makes a document of roughly targetBytes. It'll run over by at most one block
+	std::string Generate(KeyValueCorpusShape shape, size_t targetBytes, unsigned int seed = 1);
+
+	const char* ShapeName(KeyValueCorpusShape shape);
+	// Returns COUNT if name isn't a shape
+	KeyValueCorpusShape ShapeFromName(const char* name);
+
+	// Whether documents of this shape need useEscapeSequences to round trip
+	bool UsesEscapeSequences(KeyValueCorpusShape shape);
+}
@@ -0,0 +1,33 @@
+//
+// SpeedyKeyV
+// https://github.com/ozxybox/SpeedyKeyV
+//
+
+#include "KeyValueCorpus.h"
+#include <cstdio>
+#include <cstdlib>
+
+// Usage: keyvalues_corpus <wide|deep|escapes|comments|quoteless> <bytes> [seed] > corpus.kv
+int main(int argc, char** argv)
+{
+	if (argc < 3)
+	{
+		fprintf(stderr, "Usage: %s <wide|deep|escapes|comments|quoteless> <bytes> [seed]\n", argv[0]);
+		return 1;
+	}
+
+	KeyValueCorpusShape shape = KeyValueCorpus::ShapeFromName(argv[1]);
+	if (shape == KeyValueCorpusShape::COUNT)
+	{
+		fprintf(stderr, "Unknown shape '%s'\n", argv[1]);
+		return 1;
+	}
+
+	size_t bytes = strtoull(argv[2], nullptr, 10);
+	unsigned int seed = argc > 3 ? (unsigned int)strtoul(argv[3], nullptr, 10) : 1;
+
+	std::string corpus = KeyValueCorpus::Generate(shape, bytes, seed);
+	fwrite(corpus.data(), 1, corpus.size(), stdout);
+
+	return 0;
+}
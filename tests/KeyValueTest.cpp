@@ -0,0 +1,736 @@
+//
+// SpeedyKeyV
+// https://github.com/ozxybox/SpeedyKeyV
+//
+
+#include "KeyValue.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+////////////////////
+// Key Value Test //
+////////////////////
+// Usage: keyvalues_test [name]
+//
+// Runs the test called name, or every test when there isn't one. Each is registered with CTest on its own.
+// A failed check prints where it was and fails the test, but the rest of that test still runs.
+//
+
+static int failures = 0;
+
+#define CHECK(condition) \
+	do \
+	{ \
+		if (!(condition)) \
+		{ \
+			printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+			failures++; \
+		} \
+	} while (0)
+
+// Snapshots of roots that were moved out of are just empty
+static void TestSnapshotEmptyRoot()
+{
+	KeyValueRoot parsed("a 1");
+	KeyValueRoot moved(std::move(parsed));
+
+	std::shared_ptr<KeyValueRoot> movedFrom = std::make_shared<KeyValueRoot>(std::move(parsed));
+	KeyValueSnapshot snapshot(movedFrom);
+	CHECK(snapshot.IsValid());
+	CHECK(snapshot.Root().IsValid());
+	CHECK(snapshot.Root().ChildCount() == 0);
+	CHECK(!snapshot["a"].IsValid());
+
+	// And can still be built on
+	KeyValueTransaction transaction(snapshot);
+	transaction.Set("b", "2");
+	KeyValueSnapshot next = transaction.Commit();
+	CHECK(strcmp(next["b"].Value().string, "2") == 0);
+	CHECK(strcmp(moved["a"].Value().string, "1") == 0);
+}
+
+// Everything a reader can get out of a tree, boiled down to a string that's the same no matter which thread made it
+static std::string ReadEverything(const KeyValue& kv)
+{
+	std::string out;
+	for (const KeyValue& child : kv)
+	{
+		out += child.Key().string;
+		if (child.HasChildren())
+			out += "{" + ReadEverything(child) + "}";
+		else
+			out += std::string("=") + child.Value().string;
+
+		// Lookups that hit, and ones that miss
+		out += kv.Get(child.Key().string).IsValid() ? "+" : "-";
+		out += kv.Get("missing").IsValid() ? "+" : "-";
+		out += std::to_string(kv.GetAll(child.Key().string).Count());
+		out += " ";
+	}
+	return out;
+}
+
+// Solid and lazy trees can be read from any number of threads at once
+static void TestConcurrentReads()
+{
+	std::string doc;
+	for (int i = 0; i < 200; i++)
+		doc += "block" + std::to_string(i % 50) + " { key 1 other " + std::to_string(i) + " inner { deep " + std::to_string(i) + " } key 2 } ";
+
+	for (int mode = 0; mode < 3; mode++)
+	{
+		KeyValueParseOptions options;
+		options.lazy = mode == 2;
+
+		KeyValueRoot kv;
+		kv.Parse(doc.c_str(), options);
+		if (mode == 0)
+			kv.Solidify();
+		else if (mode == 1)
+			kv.Solidify(KeyValueSolidifyMode::SORT_KEYS);
+
+		// The lazy tree gets read for the first time by every thread at once
+		std::string expected;
+		{
+			KeyValueRoot reference;
+			reference.Parse(doc.c_str());
+			expected = ReadEverything(reference);
+		}
+
+		const KeyValue& shared = kv;
+		std::vector<std::string> results(4);
+		std::vector<std::thread> threads;
+		for (size_t t = 0; t < results.size(); t++)
+		{
+			threads.emplace_back([&shared, &results, t]()
+			{
+				for (int i = 0; i < 20; i++)
+					results[t] = ReadEverything(shared);
+			});
+		}
+		for (std::thread& thread : threads)
+			thread.join();
+
+		for (const std::string& result : results)
+			CHECK(result == expected);
+	}
+
+	// Misses come back as the root's own invalid kv, which nothing can write to either
+	KeyValueRoot kv("a 1");
+	CHECK(!kv.Get("b").IsValid());
+	CHECK(!kv.Get("b").Get("c").IsValid());
+	CHECK(kv.Get("b").Add("c", "d") == nullptr);
+	CHECK(!kv.At(5).IsValid());
+}
+
+// Hands out files from memory instead of the disk
+class MemoryResolver : public KeyValueResolver
+{
+public:
+	bool Resolve(const char* from, const char* path, std::string& resolved) override
+	{
+		(void)from;
+		resolved = path;
+		return files.find(resolved) != files.end();
+	}
+
+	bool Read(const std::string& resolved, std::string& contents) override
+	{
+		contents = files[resolved];
+		return true;
+	}
+
+	std::map<std::string, std::string> files;
+};
+
+// The same include read under two symbol sets gets parsed for each
+static void TestIncludeSymbols()
+{
+	MemoryResolver resolver;
+	resolver.files["platform.kv"] = "a 1 [$WIN32] a 2 [$X360]";
+	KeyValueIncludeCache cache(resolver);
+
+	std::vector<std::string> win32 = { "WIN32" };
+	std::vector<std::string> x360 = { "X360" };
+	std::vector<std::string> x360Again = { "x360" };
+
+	KeyValueParseOptions options;
+	options.includes = &cache;
+
+	options.symbols = &win32;
+	KeyValueRoot first;
+	CHECK(first.Parse("#include platform.kv", options) == KeyValueErrorCode::NONE);
+	CHECK(strcmp(first["a"].Value().string, "1") == 0);
+
+	options.symbols = &x360;
+	KeyValueRoot second;
+	CHECK(second.Parse("#include platform.kv", options) == KeyValueErrorCode::NONE);
+	CHECK(strcmp(second["a"].Value().string, "2") == 0);
+	CHECK(cache.FileCount() == 2);
+
+	// Symbols are case insensitive, so this is the same set
+	options.symbols = &x360Again;
+	KeyValueRoot third;
+	CHECK(third.Parse("#include platform.kv", options) == KeyValueErrorCode::NONE);
+	CHECK(strcmp(third["a"].Value().string, "2") == 0);
+	CHECK(cache.FileCount() == 2);
+}
+
+// Edits after a Serialize show up in the next one, however deep they are and whatever the pools had in them before
+static void TestSerializeAfterEdit()
+{
+	std::string doc;
+	for (int i = 0; i < 50; i++)
+		doc += "block" + std::to_string(i) + " { a 1 inner { b 2 deeper { c 3 } } } ";
+
+	for (int lazy = 0; lazy < 2; lazy++)
+	{
+		KeyValueParseOptions options;
+		options.lazy = lazy == 1;
+
+		KeyValueRoot kv;
+		kv.Parse(doc.c_str(), options);
+		kv.Serialize();
+
+		kv["block7"]["inner"]["deeper"].Add("added", "4");
+		kv["block30"].AddNode("node")->Add("x", "5");
+
+		// A fresh root has no text to reuse, so it serializes everything from scratch
+		std::string expected = kv.Serialize();
+		KeyValueRoot fresh;
+		fresh.Parse(expected.c_str());
+		CHECK(fresh.Serialize() == expected);
+		CHECK(expected.find("\"added\" \"4\"") != std::string::npos);
+		CHECK(expected.find("\"x\" \"5\"") != std::string::npos);
+
+		kv["block30"]["node"].Add("y", "6");
+		CHECK(kv.Serialize().find("\"y\" \"6\"") != std::string::npos);
+	}
+}
+
+// JSON strings with quotes in them only come out as kv text that parses back when escapes are on
+static void TestJsonQuotes()
+{
+	const char* json = "{\"key\":\"say \\\"hi\\\"\",\"other\":\"plain\"}";
+
+	KeyValueStringWriter unescaped;
+	CHECK(KeyValueJson::FromJson(json, unescaped) == KeyValueErrorCode::NEEDS_ESCAPE_SEQUENCES);
+
+	KeyValueStringWriter quotedKey;
+	CHECK(KeyValueJson::FromJson("{\"a\\\"b\":\"1\"}", quotedKey) == KeyValueErrorCode::NEEDS_ESCAPE_SEQUENCES);
+
+	KeyValueJsonOptions options;
+	options.useEscapeSequences = true;
+	KeyValueStringWriter escaped;
+	CHECK(KeyValueJson::FromJson(json, escaped, options) == KeyValueErrorCode::NONE);
+
+	KeyValueRoot kv;
+	CHECK(kv.Parse(escaped.output.c_str(), true) == KeyValueErrorCode::NONE);
+	CHECK(strcmp(kv["key"].Value().string, "say \"hi\"") == 0);
+	CHECK(strcmp(kv["other"].Value().string, "plain") == 0);
+
+	// Backslashes on their own are fine either way
+	KeyValueStringWriter backslash;
+	CHECK(KeyValueJson::FromJson("{\"path\":\"a\\\\b\"}", backslash) == KeyValueErrorCode::NONE);
+}
+
+// Errors collected for a document survive the files it includes being parsed
+static void TestIncludeErrors()
+{
+	MemoryResolver resolver;
+	resolver.files["ok.kv"] = "b 2";
+	resolver.files["broken.kv"] = "c { d 3";
+	KeyValueIncludeCache cache(resolver);
+
+	std::vector<KeyValueError> errors;
+	KeyValueParseOptions options;
+	options.includes = &cache;
+	options.errors = &errors;
+
+	KeyValueRoot kv;
+	CHECK(kv.Parse("} x 1 #include ok.kv", options) == KeyValueErrorCode::UNEXPECTED_END_OF_BLOCK);
+	CHECK(errors.size() == 1);
+	CHECK(errors.size() == 1 && errors[0].code == KeyValueErrorCode::UNEXPECTED_END_OF_BLOCK);
+	CHECK(errors.size() == 1 && errors[0].offset == 0);
+	CHECK(strcmp(kv["x"].Value().string, "1") == 0);
+	CHECK(strcmp(kv["b"].Value().string, "2") == 0);
+
+	// A broken include's own errors stay out of the list, and it fails the include instead
+	KeyValueRoot withBroken;
+	CHECK(withBroken.Parse("x 1 #include broken.kv", options) == KeyValueErrorCode::INCLUDE_FAILED);
+	CHECK(errors.empty());
+	CHECK(strcmp(withBroken["x"].Value().string, "1") == 0);
+}
+
+// Readers taking snapshots while a writer keeps publishing always see a whole version, never a freed one
+static void TestStorePublish()
+{
+	KeyValueStore store(KeyValueSnapshot(std::make_shared<KeyValueRoot>("n 0 m 0")));
+
+	std::atomic<bool> done(false);
+	std::atomic<int> torn(0);
+	std::vector<std::thread> readers;
+	for (int t = 0; t < 4; t++)
+	{
+		readers.emplace_back([&store, &done, &torn]()
+		{
+			while (!done.load())
+			{
+				KeyValueSnapshot snapshot = store.Snapshot();
+				if (strcmp(snapshot["n"].Value().string, snapshot["m"].Value().string) != 0)
+					torn++;
+			}
+		});
+	}
+
+	for (int i = 1; i <= 2000; i++)
+	{
+		std::string text = "n " + std::to_string(i) + " m " + std::to_string(i);
+		KeyValueSnapshot expected = store.Snapshot();
+		KeyValueSnapshot next(std::make_shared<KeyValueRoot>(text.c_str()));
+		if (i % 2)
+			store.Publish(next);
+		else
+			CHECK(store.Publish(expected, next));
+	}
+	done = true;
+	for (std::thread& reader : readers)
+		reader.join();
+
+	CHECK(torn.load() == 0);
+	CHECK(strcmp(store.Snapshot()["n"].Value().string, "2000") == 0);
+
+	// Someone else published in between, so this one loses
+	KeyValueSnapshot stale = store.Snapshot();
+	store.Publish(KeyValueSnapshot(std::make_shared<KeyValueRoot>("n a m a")));
+	CHECK(!store.Publish(stale, KeyValueSnapshot(std::make_shared<KeyValueRoot>("n b m b"))));
+	CHECK(strcmp(store.Snapshot()["n"].Value().string, "a") == 0);
+
+	KeyValueStore empty;
+	CHECK(!empty.Snapshot().IsValid());
+}
+
+// Lookups on a version built from a SORT_KEYS base find the same things the base's sorted lists would have
+static void TestTransactionSorted()
+{
+	std::string doc;
+	for (int i = 19; i >= 0; i--)
+		doc += "k" + std::to_string(i) + " " + std::to_string(i) + " ";
+	doc += "inner { ";
+	for (int i = 11; i >= 0; i--)
+		doc += "c" + std::to_string(i) + " " + std::to_string(i) + " ";
+	doc += "c3 dup } K7 dup ";
+
+	// Plenty that the edits don't touch, so that committing doesn't just flatten everything
+	doc += "padding { ";
+	for (int i = 0; i < 500; i++)
+		doc += "p" + std::to_string(i) + " { x 1 y 2 } ";
+	doc += "}";
+
+	std::shared_ptr<KeyValueRoot> root = std::make_shared<KeyValueRoot>(doc.c_str());
+	root->Solidify(KeyValueSolidifyMode::SORT_KEYS);
+	KeyValueSnapshot base(root);
+
+	KeyValueTransaction transaction(base);
+	CHECK(transaction.Set("inner/c3", "changed"));
+	CHECK(transaction.Add("inner", "a0", "new"));
+	CHECK(transaction.Add("", "k20", "20"));
+	CHECK(transaction.Remove("k5"));
+	KeyValueSnapshot next = transaction.Commit();
+
+	for (int i = 0; i <= 20; i++)
+	{
+		std::string key = "K" + std::to_string(i);
+		if (i == 5)
+		{
+			CHECK(!next[key.c_str()].IsValid());
+			continue;
+		}
+		CHECK(next[key.c_str()].IsValid() && std::to_string(i) == next[key.c_str()].Value().string);
+	}
+
+	// The first of duplicate keys still comes first
+	CHECK(next.Root().GetAll("k7").Count() == 2);
+	CHECK(strcmp(next["inner"]["C3"].Value().string, "changed") == 0);
+	CHECK(next["inner"].GetAll("c3").Count() == 2);
+	CHECK(strcmp(next["inner"]["a0"].Value().string, "new") == 0);
+	CHECK(strcmp(next["inner"]["c11"].Value().string, "11") == 0);
+
+	// And the base is untouched
+	CHECK(strcmp(base["inner"]["c3"].Value().string, "3") == 0);
+	CHECK(base["k5"].IsValid());
+}
+
+// Counts what goes through it, so tests can tell which roots were built on it
+class CountingAllocator : public KeyValueAllocator
+{
+public:
+	void* Allocate(size_t size, size_t /*alignment*/) override { allocations++; return malloc(size); }
+	void Free(void* block, size_t /*size*/) override { free(block); }
+
+	size_t allocations = 0;
+};
+
+// Roots made on the caller's behalf come off the caller's allocator, not the default one
+static void TestAllocatorThreading()
+{
+	CountingAllocator allocator;
+
+	// An empty base has no allocator of its own to hand down
+	size_t before = allocator.allocations;
+	KeyValueTransaction transaction(KeyValueSnapshot(), allocator);
+	transaction.Set("a", "1");
+	KeyValueSnapshot fromEmpty = transaction.Commit();
+	CHECK(allocator.allocations > before);
+	CHECK(strcmp(fromEmpty["a"].Value().string, "1") == 0);
+
+	// A moved from root's stand in
+	std::shared_ptr<KeyValueRoot> movedFrom = std::make_shared<KeyValueRoot>(allocator);
+	KeyValueRoot taken(std::move(*movedFrom));
+	before = allocator.allocations;
+	KeyValueSnapshot standIn(movedFrom);
+	CHECK(allocator.allocations > before);
+	CHECK(standIn.Root().ChildCount() == 0);
+
+	MemoryResolver resolver;
+	resolver.files["inc.kv"] = "b 2";
+	KeyValueIncludeCache cache(resolver, allocator);
+	KeyValueParseOptions options;
+	options.includes = &cache;
+	before = allocator.allocations;
+	KeyValueRoot includer;
+	CHECK(includer.Parse("#include inc.kv", options) == KeyValueErrorCode::NONE);
+	CHECK(allocator.allocations > before);
+	CHECK(strcmp(includer["b"].Value().string, "2") == 0);
+
+	const char* path = "allocator_threading.kv";
+	FILE* file = fopen(path, "wb");
+	CHECK(file);
+	if (!file)
+		return;
+	fputs("c 3", file);
+	fclose(file);
+	{
+		KeyValueReloader reloader(KeyValueParseOptions(), allocator);
+		before = allocator.allocations;
+		KeyValueStore& store = reloader.Watch(path);
+		CHECK(allocator.allocations > before);
+		CHECK(strcmp(store.Snapshot()["c"].Value().string, "3") == 0);
+	}
+	remove(path);
+}
+
+// A root that's Reset keeps its string buffer for the next parse, even when dedup left some of it unused
+static void TestDedupReuse()
+{
+	std::string doc;
+	for (int i = 0; i < 100; i++)
+		doc += "key" + std::to_string(i % 10) + " same ";
+
+	KeyValueParseOptions options;
+	options.deduplicateStrings = true;
+
+	KeyValueRoot kv;
+	CHECK(kv.Parse(doc.c_str(), options) == KeyValueErrorCode::NONE);
+	KeyValueStats first = kv.GetStats();
+	CHECK(first.dedupStrings > 0);
+	CHECK(first.bufferSize == first.bufferCapacity);
+
+	// The trimmed buffer can't hold the next parse before it's deduplicated, so it grows once, then stays put
+	kv.Reset();
+	CHECK(kv.Parse(doc.c_str(), options) == KeyValueErrorCode::NONE);
+	size_t capacity = kv.GetStats().bufferCapacity;
+	CHECK(capacity > first.bufferCapacity);
+
+	for (int i = 0; i < 3; i++)
+	{
+		kv.Reset();
+		CHECK(kv.Parse(doc.c_str(), options) == KeyValueErrorCode::NONE);
+		KeyValueStats stats = kv.GetStats();
+		CHECK(stats.bufferCapacity == capacity);
+		CHECK(stats.bufferSize == first.bufferSize);
+		CHECK(strcmp(kv["key3"].Value().string, "same") == 0);
+		CHECK(kv.ChildCount() == 100);
+	}
+}
+
+// #base only brings in what the document doesn't have, all the way down
+static void TestIncludeBase()
+{
+	MemoryResolver resolver;
+	std::string base = "A base B base node { x base y base } node { z second } dup 1 dup 2 ";
+	for (int i = 0; i < 200; i++)
+		base += "many" + std::to_string(i) + " " + std::to_string(i) + " ";
+	resolver.files["base.kv"] = base;
+	KeyValueIncludeCache cache(resolver);
+
+	KeyValueParseOptions options;
+	options.includes = &cache;
+
+	KeyValueRoot kv;
+	CHECK(kv.Parse("#base base.kv a mine NODE { X mine } many7 mine", options) == KeyValueErrorCode::NONE);
+	CHECK(strcmp(kv["a"].Value().string, "mine") == 0);
+	CHECK(kv.GetAll("a").Count() == 1);
+	CHECK(strcmp(kv["b"].Value().string, "base") == 0);
+	CHECK(strcmp(kv["node"]["x"].Value().string, "mine") == 0);
+	CHECK(strcmp(kv["node"]["y"].Value().string, "base") == 0);
+	// The base's second node merges into the first, same as any node the document already had
+	CHECK(kv.GetAll("node").Count() == 1);
+	CHECK(strcmp(kv["node"]["z"].Value().string, "second") == 0);
+	// Only the first of the base's duplicates makes it in, since after that the document has one
+	CHECK(kv.GetAll("dup").Count() == 1);
+	CHECK(strcmp(kv["dup"].Value().string, "1") == 0);
+	CHECK(strcmp(kv["many7"].Value().string, "mine") == 0);
+	CHECK(strcmp(kv["many199"].Value().string, "199") == 0);
+	CHECK(kv.ChildCount() == 3 + 2 + 199);
+}
+
+// Lazy blocks' strings are counted on their own, so the buffer stats still describe the buffer
+static void TestLazyStats()
+{
+	KeyValueParseOptions options;
+	options.lazy = true;
+
+	KeyValueRoot kv;
+	CHECK(kv.Parse("top 1 block { inner value another { deep thing } }", options) == KeyValueErrorCode::NONE);
+	// GetStats walks everything, so every block gets parsed before it counts anything
+	KeyValueStats after = kv.GetStats();
+	CHECK(after.bufferSize == strlen("top") + strlen("1") + strlen("block") + 3);
+	CHECK(after.bufferSize <= after.bufferCapacity);
+	CHECK(after.lazyStringBytes == strlen("inner") + strlen("value") + strlen("another") + strlen("deep") + strlen("thing") + 5);
+	CHECK(strcmp(kv["block"]["another"]["deep"].Value().string, "thing") == 0);
+}
+
+// Every child's key and value, with each node's children in key order. Children with the same key keep their order
+static std::string Canonical(const KeyValue& kv)
+{
+	std::vector<std::pair<std::string, std::string>> children;
+	for (const KeyValue& child : kv)
+	{
+		std::string content = child.HasChildren() ? "{" + Canonical(child) + "}" : std::string("=") + child.Value().string;
+		children.emplace_back(child.Key().string, content);
+	}
+	std::stable_sort(children.begin(), children.end(), [](const std::pair<std::string, std::string>& a, const std::pair<std::string, std::string>& b)
+	{
+		return a.first < b.first;
+	});
+
+	std::string out;
+	for (const std::pair<std::string, std::string>& child : children)
+		out += child.first + child.second + " ";
+	return out;
+}
+
+// A patch made by Diff turns a copy of from into to, apart from where added children end up
+static void TestPatchRoundTrip()
+{
+	const char* pairs[][2] =
+	{
+		{ "a 1 b 2 c 3", "a 1 b 2 c 3" },
+		{ "a 1 b 2 c 3", "a 1 new 9 b 2 c 4" },
+		{ "a 1 b 2 c 3", "c 3 a 1" },
+		{ "k 1 k 2 k 3", "k 1 x 0 k 3 k 4" },
+		{ "k 1 k 2", "K 1 k 2" },
+		{ "n { x 1 y 2 } m { z 3 }", "n { y 2 x 5 w 6 } m 3" },
+		{ "deep { er { est 1 } } other 1", "deep { er { est 2 new { a b } } } other 1" },
+		{ "", "a 1 b { c 2 }" },
+		{ "a 1 b { c 2 }", "" },
+	};
+
+	for (const auto& pair : pairs)
+	{
+		KeyValueRoot from(pair[0]);
+		KeyValueRoot to(pair[1]);
+		KeyValueRoot patch = KeyValueRoot::Diff(from, to);
+
+		// Sent as text, the way a patch would be
+		char* text = patch.ToString();
+		KeyValueRoot received(text);
+		delete[] text;
+
+		KeyValueRoot replica(pair[0]);
+		CHECK(replica.ApplyPatch(received));
+		CHECK(Canonical(replica) == Canonical(to));
+		if (Canonical(replica) != Canonical(to))
+			printf("  %s -> %s\n", pair[0], pair[1]);
+	}
+}
+
+// Every key a query matched, in the order it matched them
+static std::string MatchedKeys(const std::vector<KeyValue*>& matches)
+{
+	std::string out;
+	for (const KeyValue* kv : matches)
+		out += std::string(kv->Key().string) + " ";
+	return out;
+}
+
+// Wildcards, predicates, and several paths run in one walk
+static void TestQuery()
+{
+	KeyValueRoot kv(
+		"entities {"
+		"  e1 { classname npc team 2 health 100 model a.mdl }"
+		"  e2 { classname npc team 3 health 50x model b.mdl }"
+		"  e3 { classname prop team 2 health \"75 \" sound { file s.wav } }"
+		"}"
+		"sound top.wav");
+
+	CHECK(MatchedKeys(KeyValueQuery("entities/*").Run(kv)) == "e1 e2 e3 ");
+	CHECK(MatchedKeys(KeyValueQuery("entities/*[team=2]/model").Run(kv)) == "model ");
+	CHECK(MatchedKeys(KeyValueQuery("entities/*[team!=2]").Run(kv)) == "e2 ");
+	CHECK(MatchedKeys(KeyValueQuery("entities/*[sound]").Run(kv)) == "e3 ");
+	CHECK(MatchedKeys(KeyValueQuery("**/sound").Run(kv)) == "sound sound ");
+	CHECK(MatchedKeys(KeyValueQuery("**/file").Run(kv)) == "file ");
+	CHECK(MatchedKeys(KeyValueQuery("ENTITIES/E3/**").Run(kv)) == "e3 classname team health sound file ");
+	CHECK(MatchedKeys(KeyValueQuery("entities/*/classname[=prop]").Run(kv)) == "classname ");
+
+	// "50x" isn't a number, so it's never less or more than anything. Trailing whitespace is fine
+	CHECK(MatchedKeys(KeyValueQuery("entities/*[health>60]").Run(kv)) == "e1 e3 ");
+	CHECK(MatchedKeys(KeyValueQuery("entities/*[health<=100]").Run(kv)) == "e1 e3 ");
+	CHECK(MatchedKeys(KeyValueQuery("entities/*[health<1000]").Run(kv)) == "e1 e3 ");
+
+	// Paths that don't make sense add nothing
+	KeyValueQuery bad;
+	CHECK(!bad.AddPath("entities/*[team"));
+	CHECK(!bad.AddPath("entities/*[team<abc]"));
+	CHECK(!bad.AddPath("**x"));
+	CHECK(bad.PathCount() == 0);
+
+	KeyValueQuery batch;
+	CHECK(batch.AddPath("entities/*[classname=npc]"));
+	CHECK(batch.AddPath("**/sound"));
+	CHECK(batch.AddPath("entities/e3/health"));
+	CHECK(batch.PathCount() == 3);
+
+	std::vector<std::vector<KeyValue*>> found;
+	batch.Run(kv, found);
+	CHECK(found.size() == 3);
+	if (found.size() == 3)
+	{
+		CHECK(MatchedKeys(found[0]) == "e1 e2 ");
+		CHECK(MatchedKeys(found[1]) == "sound sound ");
+		CHECK(MatchedKeys(found[2]) == "health ");
+	}
+	CHECK(batch.Run(kv).size() == 5);
+}
+
+// Numbers have to follow JSON's grammar, and come out just as they were written
+static void TestJsonNumbers()
+{
+	const char* good[] = { "0", "-0", "12", "-12.5", "1e10", "1E-3", "2.5e+7", "0.0" };
+	for (const char* number : good)
+	{
+		std::string json = std::string("{\"n\":") + number + "}";
+		KeyValueStringWriter writer;
+		CHECK(KeyValueJson::FromJson(json.c_str(), writer) == KeyValueErrorCode::NONE);
+
+		KeyValueRoot kv;
+		kv.Parse(writer.output.c_str());
+		CHECK(strcmp(kv["n"].Value().string, number) == 0);
+	}
+
+	const char* bad[] = { "1-2", "--1", "-", "01", "1.", ".5", "1e", "1e+", "1.2.3", "+1", "1ee2", "-e1" };
+	for (const char* number : bad)
+	{
+		std::string json = std::string("{\"n\":") + number + "}";
+		KeyValueStringWriter writer;
+		CHECK(KeyValueJson::FromJson(json.c_str(), writer) == KeyValueErrorCode::INVALID_JSON);
+	}
+}
+
+// GetAll finds the same children, in the same order, however the tree was solidified
+static void TestGetAllSolid()
+{
+	std::string doc;
+	for (int i = 0; i < 40; i++)
+		doc += "k" + std::to_string(i % 7) + " " + std::to_string(i) + " ";
+	doc += "K3 last small { a 1 A 2 b 3 }";
+
+	const KeyValueSolidifyMode modes[] = { KeyValueSolidifyMode::DOCUMENT_ORDER, KeyValueSolidifyMode::SORT_KEYS };
+	for (int m = -1; m < 2; m++)
+	{
+		KeyValueRoot kv(doc.c_str());
+		if (m >= 0)
+			kv.Solidify(modes[m]);
+
+		for (int k = 0; k < 7; k++)
+		{
+			std::string key = "K" + std::to_string(k);
+			std::string values;
+			for (const KeyValue& child : kv.GetAll(key.c_str()))
+				values += std::string(child.Value().string) + " ";
+
+			std::string expected;
+			for (int i = k; i < 40; i += 7)
+				expected += std::to_string(i) + " ";
+			if (k == 3)
+				expected += "last ";
+			CHECK(values == expected);
+			CHECK(strcmp(kv[key.c_str()].Value().string, std::to_string(k).c_str()) == 0);
+		}
+
+		CHECK(kv.GetAll("missing").Empty());
+		CHECK(kv["small"].GetAll("a").Count() == 2);
+	}
+}
+
+struct Test
+{
+	const char* name;
+	void (*run)();
+};
+
+static const Test tests[] =
+{
+	{ "snapshot_empty_root", TestSnapshotEmptyRoot },
+	{ "concurrent_reads", TestConcurrentReads },
+	{ "include_symbols", TestIncludeSymbols },
+	{ "serialize_after_edit", TestSerializeAfterEdit },
+	{ "json_quotes", TestJsonQuotes },
+	{ "include_errors", TestIncludeErrors },
+	{ "store_publish", TestStorePublish },
+	{ "transaction_sorted", TestTransactionSorted },
+	{ "allocator_threading", TestAllocatorThreading },
+	{ "dedup_reuse", TestDedupReuse },
+	{ "include_base", TestIncludeBase },
+	{ "lazy_stats", TestLazyStats },
+	{ "patch_round_trip", TestPatchRoundTrip },
+	{ "query", TestQuery },
+	{ "json_numbers", TestJsonNumbers },
+	{ "get_all_solid", TestGetAllSolid },
+};
+
+int main(int argc, char** argv)
+{
+	const char* only = argc > 1 ? argv[1] : nullptr;
+
+	bool found = false;
+	for (const Test& test : tests)
+	{
+		if (only && strcmp(only, test.name) != 0)
+			continue;
+
+		found = true;
+		int before = failures;
+		test.run();
+		printf("%s: %s\n", test.name, failures == before ? "passed" : "FAILED");
+	}
+
+	if (!found)
+	{
+		fprintf(stderr, "Unknown test '%s'\n", only);
+		return 1;
+	}
+
+	return failures == 0 ? 0 : 1;
+}